@@ -1,5 +1,8 @@
 #define MAX_RESERVATION_SIZE 256
 #define STATE_ACCESS_DELAY_MS 10
+#define EVENT_DENSE_INIT_SIZE 16
+#define EVENT_DENSE_MAX_ID 4096
+#define EVENT_HASH_INIT_SIZE 16
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -22,3 +25,4 @@
 #include <time.h>
 #include <sys/wait.h>
 #include <errno.h>
+#include <stdatomic.h>
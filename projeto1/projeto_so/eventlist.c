@@ -1,10 +1,123 @@
 #include "eventlist.h"
 #include "constants.h"
+#include "epoch.h"
+
+/// @brief Allocates a dense index able to hold ids in [0, capacity).
+/// @param capacity Number of slots.
+/// @return Newly created dense index, NULL on failure.
+static struct DenseIndex* create_dense(size_t capacity) {
+  struct DenseIndex* dense = malloc(sizeof(struct DenseIndex) + capacity * sizeof(_Atomic(struct Event*)));
+  if (!dense) return NULL;
+
+  dense->capacity = capacity;
+  for (size_t i = 0; i < capacity; i++) {
+    atomic_init(&dense->slots[i], NULL);
+  }
+  return dense;
+}
+
+/// @brief Grows the dense index so that it can hold the given id.
+/// @note The new table is fully built before being published, the old one is
+/// retired since readers may still be using it.
+/// @param list Event list to be modified.
+/// @param event_id Id that must fit in the table.
+/// @return 0 if the table was grown successfully, 1 otherwise.
+static int grow_dense(struct EventList* list, unsigned int event_id) {
+  struct DenseIndex* old = atomic_load_explicit(&list->dense, memory_order_relaxed);
+
+  size_t capacity = old->capacity;
+  while (capacity <= event_id) capacity *= 2;
+  if (capacity > EVENT_DENSE_MAX_ID) capacity = EVENT_DENSE_MAX_ID;
+
+  struct DenseIndex* dense = create_dense(capacity);
+  if (!dense) return 1;
+
+  for (size_t i = 0; i < old->capacity; i++) {
+    struct Event* event = atomic_load_explicit(&old->slots[i], memory_order_relaxed);
+    atomic_store_explicit(&dense->slots[i], event, memory_order_relaxed);
+  }
+
+  atomic_store_explicit(&list->dense, dense, memory_order_release);
+  epoch_retire(old, free);
+  return 0;
+}
+
+/// @brief Allocates an empty hash table.
+/// @param num_buckets Number of buckets.
+/// @return Newly created hash table, NULL on failure.
+static struct HashTable* create_hash(size_t num_buckets) {
+  struct HashTable* hash = malloc(sizeof(struct HashTable) + num_buckets * sizeof(_Atomic(struct HashEntry*)));
+  if (!hash) return NULL;
+
+  hash->num_buckets = num_buckets;
+  hash->size = 0;
+  for (size_t i = 0; i < num_buckets; i++) {
+    atomic_init(&hash->buckets[i], NULL);
+  }
+  return hash;
+}
+
+static void free_hash(void* arg) {
+  struct HashTable* hash = (struct HashTable*)arg;
+  for (size_t i = 0; i < hash->num_buckets; i++) {
+    struct HashEntry* current = atomic_load_explicit(&hash->buckets[i], memory_order_relaxed);
+    while (current) {
+      struct HashEntry* next = atomic_load_explicit(&current->next, memory_order_relaxed);
+      free(current);
+      current = next;
+    }
+  }
+  free(hash);
+}
+
+/// @brief Doubles the number of buckets of the hash table.
+/// @note Entries are copied rather than relinked, readers walking the old
+/// chains are never disturbed and the old table is retired.
+/// @param list Event list to be modified.
+/// @return 0 if the table was grown successfully, 1 otherwise.
+static int grow_hash(struct EventList* list) {
+  struct HashTable* old = atomic_load_explicit(&list->hash, memory_order_relaxed);
+  struct HashTable* hash = create_hash(old->num_buckets * 2);
+  if (!hash) return 1;
+
+  for (size_t i = 0; i < old->num_buckets; i++) {
+    struct HashEntry* current = atomic_load_explicit(&old->buckets[i], memory_order_relaxed);
+    for (; current; current = atomic_load_explicit(&current->next, memory_order_relaxed)) {
+      struct HashEntry* entry = malloc(sizeof(struct HashEntry));
+      if (!entry) {
+        free_hash(hash);
+        return 1;
+      }
+
+      size_t bucket = current->event->id % hash->num_buckets;
+      entry->event = current->event;
+      atomic_init(&entry->next, atomic_load_explicit(&hash->buckets[bucket], memory_order_relaxed));
+      atomic_store_explicit(&hash->buckets[bucket], entry, memory_order_relaxed);
+      hash->size++;
+    }
+  }
+
+  atomic_store_explicit(&list->hash, hash, memory_order_release);
+  epoch_retire(old, free_hash);
+  return 0;
+}
 
 struct EventList* create_list() {
   struct EventList* list = (struct EventList*)malloc(sizeof(struct EventList));
   if (!list) return NULL;
-  list->head = NULL;
+
+  struct DenseIndex* dense = create_dense(EVENT_DENSE_INIT_SIZE);
+  struct HashTable* hash = create_hash(EVENT_HASH_INIT_SIZE);
+  if (!dense || !hash) {
+    free(dense);
+    free(hash);
+    free(list);
+    return NULL;
+  }
+
+  atomic_init(&list->dense, dense);
+  atomic_init(&list->hash, hash);
+  atomic_init(&list->head, NULL);
   list->tail = NULL;
   return list;
 }
@@ -12,18 +125,47 @@ struct EventList* create_list() {
 int append_to_list(struct EventList* list, struct Event* event) {
   if (!list) return 1;
 
+  // Everything that may fail is done before the event becomes reachable.
   struct ListNode* new_node = (struct ListNode*)malloc(sizeof(struct ListNode));
   if (!new_node) return 1;
 
   new_node->event = event;
-  new_node->next = NULL;
+  atomic_init(&new_node->next, NULL);
 
-  if (list->head == NULL) {
-    list->head = new_node;
-    list->tail = new_node;
+  struct HashEntry* entry = NULL;
+  if (event->id < EVENT_DENSE_MAX_ID) {
+    if (event->id >= atomic_load_explicit(&list->dense, memory_order_relaxed)->capacity &&
+        grow_dense(list, event->id) != 0) {
+      free(new_node);
+      return 1;
+    }
+  } else {
+    struct HashTable* hash = atomic_load_explicit(&list->hash, memory_order_relaxed);
+    entry = malloc(sizeof(struct HashEntry));
+    if (!entry || (hash->size + 1 > hash->num_buckets && grow_hash(list) != 0)) {
+      free(entry);
+      free(new_node);
+      return 1;
+    }
+  }
+
+  if (list->tail == NULL) {
+    atomic_store_explicit(&list->head, new_node, memory_order_release);
+  } else {
+    atomic_store_explicit(&list->tail->next, new_node, memory_order_release);
+  }
+  list->tail = new_node;
+
+  if (entry) {
+    struct HashTable* hash = atomic_load_explicit(&list->hash, memory_order_relaxed);
+    size_t bucket = event->id % hash->num_buckets;
+    entry->event = event;
+    atomic_init(&entry->next, atomic_load_explicit(&hash->buckets[bucket], memory_order_relaxed));
+    atomic_store_explicit(&hash->buckets[bucket], entry, memory_order_release);
+    hash->size++;
   } else {
-    list->tail->next = new_node;
-    list->tail = new_node;
+    struct DenseIndex* dense = atomic_load_explicit(&list->dense, memory_order_relaxed);
+    atomic_store_explicit(&dense->slots[event->id], event, memory_order_release);
   }
 
   return 0;
@@ -32,35 +174,101 @@ int append_to_list(struct EventList* list, struct Event* event) {
 static void free_event(struct Event* event) {
   if (!event) return;
 
+  pthread_rwlock_destroy(&event->seat_mutex);
   free(event->data);
   free(event);
 }
 
+static void retire_event(void* event) { free_event((struct Event*)event); }
+
+/// @brief Unlinks the hash entry of the given id.
+/// @param list Event list to be modified.
+/// @param event_id Id of the entry to be unlinked.
+/// @return The unlinked entry, NULL if there is none.
+static struct HashEntry* hash_remove(struct EventList* list, unsigned int event_id) {
+  struct HashTable* hash = atomic_load_explicit(&list->hash, memory_order_relaxed);
+  _Atomic(struct HashEntry*)* link = &hash->buckets[event_id % hash->num_buckets];
+
+  struct HashEntry* current;
+  while ((current = atomic_load_explicit(link, memory_order_relaxed)) != NULL) {
+    if (current->event->id == event_id) {
+      struct HashEntry* next = atomic_load_explicit(&current->next, memory_order_relaxed);
+      atomic_store_explicit(link, next, memory_order_release);
+      hash->size--;
+      return current;
+    }
+    link = &current->next;
+  }
+  return NULL;
+}
+
+int remove_from_list(struct EventList* list, unsigned int event_id) {
+  if (!list) return 1;
+
+  struct ListNode* prev = NULL;
+  struct ListNode* node = atomic_load_explicit(&list->head, memory_order_relaxed);
+  while (node && node->event->id != event_id) {
+    prev = node;
+    node = atomic_load_explicit(&node->next, memory_order_relaxed);
+  }
+  if (!node) return 1;
+
+  // Unlinked everywhere first, readers that already hold a pointer keep it valid until they leave.
+  struct Event* event = node->event;
+  if (event_id < EVENT_DENSE_MAX_ID) {
+    struct DenseIndex* dense = atomic_load_explicit(&list->dense, memory_order_relaxed);
+    atomic_store_explicit(&dense->slots[event_id], NULL, memory_order_release);
+  } else {
+    epoch_retire(hash_remove(list, event_id), free);
+  }
+
+  struct ListNode* next = atomic_load_explicit(&node->next, memory_order_relaxed);
+  if (prev) {
+    atomic_store_explicit(&prev->next, next, memory_order_release);
+  } else {
+    atomic_store_explicit(&list->head, next, memory_order_release);
+  }
+  if (list->tail == node) list->tail = prev;
+
+  epoch_retire(node, free);
+  epoch_retire(event, retire_event);
+  return 0;
+}
+
 void free_list(struct EventList* list) {
   if (!list) return;
 
-  struct ListNode* current = list->head;
+  struct ListNode* current = atomic_load_explicit(&list->head, memory_order_relaxed);
   while (current) {
     struct ListNode* temp = current;
-    current = current->next;
+    current = atomic_load_explicit(&current->next, memory_order_relaxed);
 
     free_event(temp->event);
     free(temp);
   }
 
+  free(atomic_load_explicit(&list->dense, memory_order_relaxed));
+  free_hash(atomic_load_explicit(&list->hash, memory_order_relaxed));
   free(list);
 }
 
 struct Event* get_event(struct EventList* list, unsigned int event_id) {
   if (!list) return NULL;
 
-  struct ListNode* current = list->head;
+  if (event_id < EVENT_DENSE_MAX_ID) {
+    struct DenseIndex* dense = atomic_load_explicit(&list->dense, memory_order_acquire);
+    if (event_id >= dense->capacity) return NULL;
+    return atomic_load_explicit(&dense->slots[event_id], memory_order_acquire);
+  }
+
+  struct HashTable* hash = atomic_load_explicit(&list->hash, memory_order_acquire);
+  struct HashEntry* current = atomic_load_explicit(&hash->buckets[event_id % hash->num_buckets], memory_order_acquire);
   while (current) {
     struct Event* event = current->event;
     if (event->id == event_id) {
       return event;
     }
-    current = current->next;
+    current = atomic_load_explicit(&current->next, memory_order_acquire);
   }
 
   return NULL;
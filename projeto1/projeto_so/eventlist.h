@@ -16,13 +16,37 @@ struct Event {
 
 struct ListNode {
   struct Event* event;
-  struct ListNode* next;
+  _Atomic(struct ListNode*) next;
+};
+
+// Entry of the hash fallback, immutable once published.
+struct HashEntry {
+  struct Event* event;
+  _Atomic(struct HashEntry*) next;  // Next entry in the same bucket.
+};
+
+// Hash table for sparse or large ids, replaced as a whole when it grows.
+struct HashTable {
+  size_t num_buckets;                    // Number of buckets.
+  size_t size;                           // Number of entries.
+  _Atomic(struct HashEntry*) buckets[];  // Chains of entries.
+};
+
+// Direct-indexed table of events, slot i holds the event with id i (or NULL).
+struct DenseIndex {
+  size_t capacity;                 // Number of slots.
+  _Atomic(struct Event*) slots[];  // Events indexed by id.
 };
 
 // Linked list structure.
+// Readers never lock: they run inside an epoch section (see epoch.h) and every
+// structure below is published with release semantics.
 struct EventList {
-  struct ListNode* head;  // Head of the list.
-  struct ListNode* tail;  // Tail of the list.
+  _Atomic(struct ListNode*) head;  // Head of the list.
+  struct ListNode* tail;           // Tail of the list.
+
+  _Atomic(struct DenseIndex*) dense;  // Fast path for ids below EVENT_DENSE_MAX_ID.
+  _Atomic(struct HashTable*) hash;    // Fallback for sparse or large ids.
 };
 
 /// @brief Creates a new event list.
@@ -30,17 +54,26 @@ struct EventList {
 struct EventList* create_list();
 
 /// @brief Appends a new node to the list.
+/// @note Writers must be serialized by the caller.
 /// @param list Event list to be modified.
 /// @param data Event to be stored in the new node.
 /// @return 0 if the node was appended successfully, 1 otherwise.
 int append_to_list(struct EventList* list, struct Event* data);
 
-/// @brief Removes a node from the list.
+/// @brief Unlinks an event from the list and retires it.
+/// @note Writers must be serialized by the caller. The event and its nodes are
+/// only freed once no reader inside an epoch section can still reach them.
 /// @param list Event list to be modified.
-/// @return 0 if the node was removed successfully, 1 otherwise.
+/// @param event_id Id of the event to be removed.
+/// @return 0 if the event was removed successfully, 1 otherwise.
+int remove_from_list(struct EventList* list, unsigned int event_id);
+
+/// @brief Frees the list and every event in it.
+/// @param list Event list to be freed.
 void free_list(struct EventList* list);
 
 /// @brief Retrieves an event in the list.
+/// @note Must be called inside an epoch section or by the (serialized) writer.
 /// @param list Event list to be searched.
 /// @param event_id Event id.
 /// @return Pointer to the event if found, NULL otherwise.
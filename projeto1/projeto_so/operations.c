@@ -1,4 +1,5 @@
 #include "constants.h"
+#include "epoch.h"
 #include "eventlist.h"
 #include "operations.h"
 #include "parser.h"
@@ -22,6 +23,7 @@ static struct timespec delay_to_timespec(unsigned int delay_ms) {
 
 /// @brief Gets the event with the given ID from the state.
 /// @note Will wait to simulate a real system accessing a costly memory resource.
+/// @note Must be called inside an epoch section or with event_mutex write locked.
 /// @param event_id The ID of the event to get.
 /// @return Pointer to the event if found, NULL otherwise.
 static struct Event* get_event_with_delay(unsigned int event_id) {
@@ -90,6 +92,7 @@ int ems_terminate() {
   }
 
   free_list(event_list);
+  epoch_shutdown();
   event_list = NULL;
   state_access_delay_ms = 0;
 
@@ -100,24 +103,17 @@ int ems_terminate() {
 
 
 int ems_create(unsigned int event_id, size_t num_rows, size_t num_cols) {
-  // Read lock for init_mutex.
-  pthread_rwlock_rdlock(&init_mutex);
-
   if (event_list == NULL) {
     printf("ERR: EMS state must be initialized.\n");
-    // Read/Write unlock for init_mutex.
-    pthread_rwlock_unlock(&init_mutex);
     return 1;
   }
-  
-  // Write lock for event_mutex.
+
+  // Write lock for event_mutex, only writers serialize on it.
   pthread_rwlock_wrlock(&event_mutex);
   if (get_event_with_delay(event_id) != NULL) {
     printf("ERR: Event already exists.\n");
     // Read/Write unlock for event_mutex.
     pthread_rwlock_unlock(&event_mutex);
-    // Read/Write unlock for init_mutex.
-    pthread_rwlock_unlock(&init_mutex);
     return 1;
   }
   
@@ -127,8 +123,6 @@ int ems_create(unsigned int event_id, size_t num_rows, size_t num_cols) {
     printf("ERR: Unable to allocate memory for event.\n");
     // Read/Write unlock for event_mutex.
     pthread_rwlock_unlock(&event_mutex);
-    // Read/Write unlock for init_mutex.
-    pthread_rwlock_unlock(&init_mutex);
     return 1;
   }
 
@@ -145,8 +139,6 @@ int ems_create(unsigned int event_id, size_t num_rows, size_t num_cols) {
     free(event);
     // Read/Write unlock for event_mutex.
     pthread_rwlock_unlock(&event_mutex);
-    // Read/Write unlock for init_mutex.
-    pthread_rwlock_unlock(&init_mutex);
     return 1;
   }
 
@@ -160,43 +152,29 @@ int ems_create(unsigned int event_id, size_t num_rows, size_t num_cols) {
     free(event);
     // Read/Write unlock for event_mutex.
     pthread_rwlock_unlock(&event_mutex);
-    // Read/Write unlock for init_mutex.
-    pthread_rwlock_unlock(&init_mutex);
     return 1;
   }
 
   // Read/Write unlock for event_mutex.
   pthread_rwlock_unlock(&event_mutex);
-  // Read/Write unlock for init_mutex.
-  pthread_rwlock_unlock(&init_mutex);
   return 0;
 }
 
 int ems_reserve(unsigned int event_id, size_t num_seats, size_t* xs, size_t* ys) {
-  // Read lock for init_mutex.
-  pthread_rwlock_rdlock(&init_mutex);
-
   if (event_list == NULL) {
     printf("ERR: EMS state must be initialized.\n");
-    // Read/Write unlock for init_mutex.
-    pthread_rwlock_unlock(&init_mutex);
     return 1;
   }
 
-  // Read lock for event_mutex.
-  pthread_rwlock_rdlock(&event_mutex);
+  // Readers never lock the event table, the epoch section keeps the event alive.
+  epoch_enter();
   struct Event* event = get_event_with_delay(event_id);
   if (event == NULL) {
     printf("ERR: Event not found.\n");
-    // Read/Write unlock for event_mutex.
-    pthread_rwlock_unlock(&event_mutex);
-    // Read/Write unlock for init_mutex.
-    pthread_rwlock_unlock(&init_mutex);
+    epoch_exit();
     return 1;
   }
-  // Read/Write unlock for event_mutex.
-  pthread_rwlock_unlock(&event_mutex);
-  
+
   // Write lock for seat_mutex.
   pthread_rwlock_wrlock(&event->seat_mutex);
   unsigned int reservation_id = ++event->reservations;
@@ -228,39 +206,29 @@ int ems_reserve(unsigned int event_id, size_t num_seats, size_t* xs, size_t* ys)
 
     // Read/Write unlock for seat_mutex.
     pthread_rwlock_unlock(&event->seat_mutex);
-    // Read/Write unlock for init_mutex.
-    pthread_rwlock_unlock(&init_mutex);
+    epoch_exit();
     return 1;
   }
 
   // Read/Write unlock for seat_mutex.
   pthread_rwlock_unlock(&event->seat_mutex);
-  // Read/Write unlock for init_mutex.
-  pthread_rwlock_unlock(&init_mutex);
+  epoch_exit();
   return 0;
 }
 
 int ems_show(unsigned int event_id, int output_fd) {
-  // Read lock for init_mutex.
-  pthread_rwlock_rdlock(&init_mutex);
-
   if (event_list == NULL) {
     printf("ERR: EMS state must be initialized.\n");
-    // Read/Write unlock for init_mutex.
-    pthread_rwlock_unlock(&init_mutex);
     return 1;
   }
 
-  // Read lock for event_mutex.
-  pthread_rwlock_rdlock(&event_mutex);
+  // Readers never lock the event table, the epoch section keeps the event alive.
+  epoch_enter();
   struct Event* event = get_event_with_delay(event_id);
   
   if (event == NULL) {
     printf("ERR: Event not found.\n");
-    // Read/Write unlock for event_mutex.
-    pthread_rwlock_unlock(&event_mutex);
-    // Read/Write unlock for init_mutex.
-    pthread_rwlock_unlock(&init_mutex);
+    epoch_exit();
     return 1;
   }
 
@@ -290,43 +258,59 @@ int ems_show(unsigned int event_id, int output_fd) {
 
   // Read/Write unlock for seat_mutex.
   pthread_rwlock_unlock(&event->seat_mutex);
-  // Read/Write unlock for event_mutex.
-  pthread_rwlock_unlock(&event_mutex);
   // Read/Write unlock for write_mutex.
   pthread_rwlock_unlock(&write_mutex);
-  // Read/Write unlock for init_mutex.
-  pthread_rwlock_unlock(&init_mutex);
+  epoch_exit();
   return 0;
 }
 
-int ems_list_events(int output_fd) {
-  // Read lock for init_mutex.
-  pthread_rwlock_rdlock(&init_mutex);
-
+int ems_delete(unsigned int event_id) {
   if (event_list == NULL) {
     printf("ERR: EMS state must be initialized.\n");
-    // Read/Write unlock for init_mutex.
-    pthread_rwlock_unlock(&init_mutex);
+    return 1;
+  }
+
+  // Write lock for event_mutex, only writers serialize on it.
+  pthread_rwlock_wrlock(&event_mutex);
+  if (get_event_with_delay(event_id) == NULL) {
+    printf("ERR: Event not found.\n");
+    // Read/Write unlock for event_mutex.
+    pthread_rwlock_unlock(&event_mutex);
+    return 1;
+  }
+
+  // The event is retired, readers still holding it keep it valid until they leave.
+  if (remove_from_list(event_list, event_id) != 0) {
+    printf("ERR: Unable to remove event from list.\n");
+    // Read/Write unlock for event_mutex.
+    pthread_rwlock_unlock(&event_mutex);
     return 1;
   }
 
   // Read/Write unlock for event_mutex.
-  pthread_rwlock_rdlock(&event_mutex);
-  // Read/Write unlock for write_mutex.
+  pthread_rwlock_unlock(&event_mutex);
+  return 0;
+}
+
+int ems_list_events(int output_fd) {
+  if (event_list == NULL) {
+    printf("ERR: EMS state must be initialized.\n");
+    return 1;
+  }
+
+  // Readers never lock the event table, nodes are published with release semantics.
+  epoch_enter();
+  // Write lock for write_mutex.
   pthread_rwlock_wrlock(&write_mutex);
-  if (event_list->head == NULL) {
+  struct ListNode* current = atomic_load_explicit(&event_list->head, memory_order_acquire);
+  if (current == NULL) {
     write(output_fd, "No events\n", 10);
-    // Read/Write unlock for event_mutex.
-    pthread_rwlock_unlock(&event_mutex);
     // Read/Write unlock for write_mutex.
     pthread_rwlock_unlock(&write_mutex);
-    // Read/Write unlock for init_mutex.
-    pthread_rwlock_unlock(&init_mutex);
+    epoch_exit();
     return 0;
   }
 
-  struct ListNode* current = event_list->head;
-
   while (current != NULL) {
     char event_id[12];  
     // Turns the ID of the event from an unsigned int into a string.
@@ -337,15 +321,12 @@ int ems_list_events(int output_fd) {
     event_msg[2] = "\n";
     // Write the event id in the output file.
     build_string(output_fd, event_msg, 3);
-    current = current->next;
+    current = atomic_load_explicit(&current->next, memory_order_acquire);
   }
 
-  // Read/Write unlock for event_mutex.
-  pthread_rwlock_unlock(&event_mutex);
   // Read/Write unlock for write_mutex.
   pthread_rwlock_unlock(&write_mutex);
-  // Read/Write unlock for init_mutex.
-  pthread_rwlock_unlock(&init_mutex);
+  epoch_exit();
   return 0;
 }
 
@@ -373,13 +354,8 @@ void *ems_process_command(void *arg) {
     return NULL;
   }
 
-  // Read lock for init_mutex.
-  pthread_rwlock_rdlock(&init_mutex);
-
   if (event_list == NULL) {
     printf("ERR: EMS state must be initialized.\n");
-    // Read/Write unlock for init_mutex.
-    pthread_rwlock_unlock(&init_mutex);
     return NULL;
   }
 
@@ -393,9 +369,6 @@ void *ems_process_command(void *arg) {
     }
   }
 
-  // Read/Write unlock for init_mutex.
-  pthread_rwlock_unlock(&init_mutex);
-
   switch (threadInfo->command) {
     case CMD_CREATE:
       // Performs and verifies the command CREATE.
@@ -422,6 +395,13 @@ void *ems_process_command(void *arg) {
       }
       break;
 
+    case CMD_DELETE:
+      // Performs and verifies the command DELETE.
+      if (ems_delete(threadInfo->event_id)) {
+        printf("ERR: Failed to delete event.\n");
+      }
+      break;
+
     case CMD_LIST_EVENTS:
       // Performs and verifies the command LIST.
       if (ems_list_events(threadInfo->output_fd)) {
@@ -444,6 +424,7 @@ void *ems_process_command(void *arg) {
         "  CREATE <event_id> <num_rows> <num_columns>\n"
         "  RESERVE <event_id> [(<x1>,<y1>) (<x2>,<y2>) ...]\n"
         "  SHOW <event_id>\n"
+        "  DELETE <event_id>\n"
         "  LIST\n"
         "  WAIT <delay_ms> [thread_id]\n"
         "  BARRIER\n"
@@ -510,6 +491,14 @@ int parse_command(void *arg) {
       threadInfo->event_id = event_id;        // Store ID event in the Thread.
       break;
 
+    case CMD_DELETE:
+      // Performs the parsing of command DELETE.
+      if (parse_delete(threadInfo->input_fd, &event_id) != 0) {
+        threadInfo->invalid_command = 1;      // Set the invalid command to True.
+      }
+      threadInfo->event_id = event_id;        // Store ID event in the Thread.
+      break;
+
     case CMD_LIST_EVENTS:
       break;
 
@@ -19,7 +19,7 @@ struct ThreadInfo {
     int invalid_command;            // Bollean to know if the command is valid.
     int barrier;                    // Boolean to know if the commad line is BARRIER.
     int is_active;                  // Boolean to know if the thread is active.
-    unsigned int event_id;          // COMMAND CREATE/RESERVE/SHOW: Event ID.
+    unsigned int event_id;          // COMMAND CREATE/RESERVE/SHOW/DELETE: Event ID.
     size_t num_rows;                // COMMAND CREATE: Number of rows of the event that is being created.
     size_t num_columns;             // COMMAND CREATE: Number of columns of the event that is being created.
     size_t num_coords;              // COMMAND RESERVE: Number of seats that are being reserved.
@@ -68,6 +68,13 @@ int ems_reserve(unsigned int event_id, size_t num_seats, size_t *xs, size_t *ys)
 /// @return 0 if the event was printed successfully, 1 otherwise.
 int ems_show(unsigned int event_id, int output_fd);
 
+/// @brief Deletes the event with the given id.
+/// @note Readers that already found the event keep using it until they leave
+/// their epoch section, the memory is only freed afterwards.
+/// @param event_id Id of the event to be deleted.
+/// @return 0 if the event was deleted successfully, 1 otherwise.
+int ems_delete(unsigned int event_id);
+
 /// @brief Prints all the events.
 /// @param output_fd File descriptor of the output file.
 /// @return 0 if the events were printed successfully, 1 otherwise.
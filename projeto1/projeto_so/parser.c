@@ -76,6 +76,14 @@ enum Command get_next(int fd) {
 
       return CMD_SHOW;
 
+    case 'D':
+      if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
+        cleanup(fd);
+        return CMD_INVALID;
+      }
+
+      return CMD_DELETE;
+
     case 'L':
       if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "LIST", 4) != 0) {
         cleanup(fd);
@@ -231,6 +239,17 @@ int parse_show(int fd, unsigned int *event_id) {
   return 0;
 }
 
+int parse_delete(int fd, unsigned int *event_id) {
+  char ch;
+
+  if (read_uint(fd, event_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
+    cleanup(fd);
+    return 1;
+  }
+
+  return 0;
+}
+
 int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
   char ch;
 
@@ -0,0 +1,75 @@
+// Measures the time from ems_setup to the first reply, on a new connection and on a resumed one.
+// Usage: bench/connect <server path> [iterations]
+
+#include "client/api.h"
+#include "common/io.h"
+
+#include <time.h>
+
+#define BENCH_REQ_PIPE "/tmp/bench_connect_req"
+#define BENCH_RESP_PIPE "/tmp/bench_connect_resp"
+#define BENCH_MAX_ITERATIONS 100000
+
+static double samples[BENCH_MAX_ITERATIONS];
+
+static double now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+static int compare(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/// Connects, lists the events and leaves the session, the number of times given.
+/// @param resume Whether the session is suspended and resumed instead of closed and set up again.
+/// @return 0 if every iteration succeeded, 1 otherwise.
+static int run(const char *server, int out_fd, size_t iterations, bool resume) {
+  // The first setup of a resumed run makes the session to resume
+  if (resume && (ems_setup(BENCH_REQ_PIPE, BENCH_RESP_PIPE, server) || ems_suspend())) return 1;
+
+  for (size_t i = 0; i < iterations; i++) {
+    double start = now_us();
+    if (ems_setup(BENCH_REQ_PIPE, BENCH_RESP_PIPE, server) || ems_list_events(out_fd)) return 1;
+    samples[i] = now_us() - start;
+
+    if (resume ? ems_suspend() : ems_quit()) return 1;
+  }
+
+  if (resume && ems_destroy_client()) return 1;
+
+  double total = 0;
+  for (size_t i = 0; i < iterations; i++) total += samples[i];
+  qsort(samples, iterations, sizeof(double), compare);
+  printf("%8s %12.1f %12.1f %12.1f\n", resume ? "resumed" : "new", total / (double)iterations,
+         samples[iterations / 2], samples[iterations * 99 / 100]);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <server path> [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  size_t iterations = argc > 2 ? (size_t)atol(argv[2]) : 1000;
+  if (iterations == 0) iterations = 1;
+  if (iterations > BENCH_MAX_ITERATIONS) iterations = BENCH_MAX_ITERATIONS;
+
+  int out_fd = open("/dev/null", O_WRONLY);
+  if (out_fd == -1) {
+    fprintf(stderr, "ERROR failed to open /dev/null\n");
+    return 1;
+  }
+
+  printf("%8s %12s %12s %12s\n", "session", "mean us", "p50 us", "p99 us");
+  if (run(argv[1], out_fd, iterations, false) || run(argv[1], out_fd, iterations, true)) {
+    fprintf(stderr, "ERROR connection failed\n");
+    return 1;
+  }
+
+  close(out_fd);
+  return 0;
+}
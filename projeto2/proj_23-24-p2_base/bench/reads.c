@@ -0,0 +1,100 @@
+// Measures SHOW and LIST throughput of the EMS state as the number of reader threads grows.
+// Usage: bench/reads [seconds per run]
+
+#include "common/io.h"
+#include "server/operations.h"
+
+#include <stdatomic.h>
+
+#define BENCH_EVENTS 64
+#define BENCH_ROWS 10
+#define BENCH_COLS 10
+#define BENCH_MAX_THREADS 64
+
+enum { BENCH_SHOW, BENCH_LIST };
+
+struct Reader {
+  pthread_t tid;
+  int op;
+  unsigned long ops;
+  buffer_t reply;
+};
+
+static atomic_bool stop;
+
+static void *reader(void *args) {
+  struct Reader *self = (struct Reader *)args;
+  unsigned int event_id = 1;
+
+  while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+    // Replies are built like the server does, then dropped
+    self->reply.len = 0;
+    if (self->op == BENCH_SHOW) {
+      ems_show(&self->reply, WIRE_FIXED, event_id, NULL, NULL);
+      event_id = event_id % BENCH_EVENTS + 1;
+    } else {
+      ems_list_page(&self->reply, WIRE_FIXED, 0, LIST_PAGE_MAX);
+    }
+    self->ops++;
+  }
+
+  return NULL;
+}
+
+/// Runs the given operation on a number of threads for a fixed time.
+/// @return Operations per second over all threads.
+static double run(int op, int num_threads, unsigned int seconds) {
+  struct Reader readers[BENCH_MAX_THREADS];
+
+  atomic_store(&stop, false);
+  for (int i = 0; i < num_threads; i++) {
+    readers[i].op = op;
+    readers[i].ops = 0;
+    readers[i].reply = (buffer_t){0};
+    if (pthread_create(&readers[i].tid, NULL, reader, &readers[i]) != 0) {
+      fprintf(stderr, "ERROR failed to start reader\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  sleep(seconds);
+  atomic_store(&stop, true);
+
+  unsigned long total = 0;
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(readers[i].tid, NULL);
+    buffer_free(&readers[i].reply);
+    total += readers[i].ops;
+  }
+
+  return (double)total / seconds;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned int seconds = argc > 1 ? (unsigned int)atoi(argv[1]) : 1;
+  if (seconds == 0) seconds = 1;
+
+  if (ems_init(0, NULL)) {
+    fprintf(stderr, "ERROR failed to initialize EMS\n");
+    return 1;
+  }
+
+  for (unsigned int id = 1; id <= BENCH_EVENTS; id++) {
+    size_t xs[] = {1, 2}, ys[] = {1, 2};
+    if (ems_create(id, BENCH_ROWS, BENCH_COLS) || ems_reserve(id, 2, xs, ys)) {
+      fprintf(stderr, "ERROR failed to populate EMS\n");
+      return 1;
+    }
+  }
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  printf("%8s %14s %14s\n", "threads", "SHOW ops/s", "LIST ops/s");
+  for (int threads = 1; threads <= BENCH_MAX_THREADS && threads <= 2 * cores; threads *= 2) {
+    double show = run(BENCH_SHOW, threads, seconds);
+    double list = run(BENCH_LIST, threads, seconds);
+    printf("%8d %14.0f %14.0f\n", threads, show, list);
+  }
+
+  ems_terminate();
+  return 0;
+}
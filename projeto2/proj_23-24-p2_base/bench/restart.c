@@ -0,0 +1,109 @@
+// Measures how long a restart takes as the state grows: building the events again against restoring them from a
+// snapshot, and the first SHOW of every event, which pages in the seats of a restored one.
+// The snapshot is dropped from the page cache before it is restored, like after a reboot.
+// Usage: bench/restart
+
+#include "common/io.h"
+#include "server/operations.h"
+
+#define BENCH_SNAPSHOT_PATH "/tmp/bench_restart.snapshot"
+
+static const struct {
+  unsigned int events;
+  size_t rows;
+  size_t cols;
+} sizes[] = {{100, 10, 10}, {1000, 10, 10}, {10000, 10, 10}, {1000, 100, 100}, {10, 1000, 1000}, {100, 1000, 1000}};
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+}
+
+/// Creates the events, each with a reservation.
+/// @return 0 if every event was created, 1 otherwise.
+static int populate(unsigned int events, size_t rows, size_t cols) {
+  for (unsigned int id = 1; id <= events; id++) {
+    size_t xs[] = {1, rows}, ys[] = {1, cols};
+    if (ems_create(id, rows, cols) || ems_reserve(id, 2, xs, ys)) return 1;
+  }
+  return 0;
+}
+
+/// Shows every event once, the way the server builds the replies.
+/// @return 0 if every event was found, 1 otherwise.
+static int show_all(unsigned int events) {
+  buffer_t reply = {0};
+  int failed = 0;
+  for (unsigned int id = 1; id <= events && !failed; id++) {
+    reply.len = 0;
+    failed = ems_show(&reply, WIRE_FIXED, id, NULL, NULL) || reply.failed;
+  }
+  buffer_free(&reply);
+  return failed;
+}
+
+/// Saves the state to the snapshot and drops it from the page cache.
+/// @return 0 if the snapshot was saved, 1 otherwise.
+static int save(void) {
+  int fd = open(BENCH_SNAPSHOT_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1) return 1;
+
+  struct EventImage* image = capture_events();
+  int failed = image == NULL || save_events(image, fd) || fsync(fd) != 0;
+  release_events(image);
+  failed = failed || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0;
+  return close(fd) != 0 || failed;
+}
+
+int main(void) {
+  printf("%8s %12s %10s %12s %10s %12s %14s\n", "events", "seats/event", "MB", "rebuild ms", "save ms", "restore ms",
+         "first SHOW ms");
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    unsigned int events = sizes[i].events;
+    size_t seats = sizes[i].rows * sizes[i].cols;
+
+    double start = now_ms();
+    if (ems_init(0, NULL) || populate(events, sizes[i].rows, sizes[i].cols)) {
+      fprintf(stderr, "ERROR failed to populate EMS\n");
+      return 1;
+    }
+    double rebuild = now_ms() - start;
+
+    start = now_ms();
+    if (save() != 0) {
+      fprintf(stderr, "ERROR failed to save the snapshot\n");
+      return 1;
+    }
+    double saved = now_ms() - start;
+    ems_terminate();
+
+    struct stat st;
+    if (stat(BENCH_SNAPSHOT_PATH, &st) != 0) {
+      fprintf(stderr, "ERROR failed to stat the snapshot\n");
+      return 1;
+    }
+
+    start = now_ms();
+    if (ems_init(0, BENCH_SNAPSHOT_PATH)) {
+      fprintf(stderr, "ERROR failed to restore the snapshot\n");
+      return 1;
+    }
+    double restore = now_ms() - start;
+
+    start = now_ms();
+    if (show_all(events) != 0) {
+      fprintf(stderr, "ERROR failed to show a restored event\n");
+      return 1;
+    }
+    double first_show = now_ms() - start;
+    ems_terminate();
+
+    printf("%8u %12zu %10.1f %12.1f %10.1f %12.2f %14.1f\n", events, seats, (double)st.st_size / (1 << 20), rebuild,
+           saved, restore, first_show);
+  }
+
+  unlink(BENCH_SNAPSHOT_PATH);
+  return 0;
+}
@@ -0,0 +1,123 @@
+// Measures the bytes sent per request, header and reply included, with the fixed and compact encodings.
+// Usage: bench/wire
+
+#include "common/io.h"
+#include "server/operations.h"
+
+#define BENCH_SMALL_EVENT 1
+#define BENCH_LARGE_EVENT 2
+#define BENCH_LIST_EVENTS 64
+
+struct Case {
+  const char *name;
+  char opcode;
+  unsigned int event_id;
+  size_t num_seats;  // Seats of a RESERVE
+};
+
+/// Builds a request like the client does.
+static void build_request(buffer_t *req, wire_encoding_t encoding, const struct Case *c) {
+  switch (c->opcode) {
+    case OP_CODE_CREATE:
+      buffer_put_uint(req, encoding, c->event_id, sizeof(unsigned int));
+      buffer_put_uint(req, encoding, 10, sizeof(size_t));
+      buffer_put_uint(req, encoding, 20, sizeof(size_t));
+      break;
+    case OP_CODE_RESERVE:
+      buffer_put_uint(req, encoding, c->event_id, sizeof(unsigned int));
+      buffer_put_uint(req, encoding, c->num_seats, sizeof(size_t));
+      for (size_t i = 0; i < c->num_seats; i++) buffer_put_uint(req, encoding, i / 8 + 1, sizeof(size_t));
+      for (size_t i = 0; i < c->num_seats; i++) buffer_put_uint(req, encoding, i % 8 + 1, sizeof(size_t));
+      break;
+    case OP_CODE_SHOW:
+      buffer_put_uint(req, encoding, c->event_id, sizeof(unsigned int));
+      break;
+    case OP_CODE_LIST_PAGE:
+      buffer_put_uint(req, encoding, 0, sizeof(unsigned int));
+      buffer_put_uint(req, encoding, LIST_PAGE_SIZE, sizeof(size_t));
+      break;
+    default:
+      break;
+  }
+}
+
+/// Builds the reply like the server does, without changing the state.
+static void build_reply(buffer_t *reply, wire_encoding_t encoding, const struct Case *c) {
+  switch (c->opcode) {
+    case OP_CODE_SHOW:
+      ems_show(reply, encoding, c->event_id, NULL, NULL);
+      break;
+    case OP_CODE_LIST_PAGE:
+      ems_list_page(reply, encoding, 0, LIST_PAGE_SIZE);
+      break;
+    default:
+      buffer_put_uint(reply, encoding, 0, sizeof(int));
+      break;
+  }
+}
+
+/// Computes the bytes a request and its reply take on the pipes.
+static size_t wire_bytes(wire_encoding_t encoding, const struct Case *c) {
+  buffer_t req = {0};
+  buffer_t reply = {0};
+
+  build_request(&req, encoding, c);
+  build_reply(&reply, encoding, c);
+  if (req.failed || reply.failed) {
+    fprintf(stderr, "ERROR failed to build %s\n", c->name);
+    exit(EXIT_FAILURE);
+  }
+
+  size_t bytes = 2 * sizeof(frame_header_t) + req.len + reply.len;
+  buffer_free(&req);
+  buffer_free(&reply);
+  return bytes;
+}
+
+int main() {
+  if (ems_init(0, NULL)) {
+    fprintf(stderr, "ERROR failed to initialize EMS\n");
+    return 1;
+  }
+
+  // A small event with a few reservations and a large one half booked in blocks
+  size_t xs[MAX_RESERVATION_SIZE], ys[MAX_RESERVATION_SIZE];
+  if (ems_create(BENCH_SMALL_EVENT, 10, 20) || ems_create(BENCH_LARGE_EVENT, 100, 100)) {
+    fprintf(stderr, "ERROR failed to populate EMS\n");
+    return 1;
+  }
+  for (size_t i = 0; i < 3; i++) {
+    xs[i] = 2;
+    ys[i] = i + 5;
+  }
+  ems_reserve(BENCH_SMALL_EVENT, 3, xs, ys);
+  for (size_t row = 1; row <= 50; row++) {
+    for (size_t i = 0; i < 100; i++) {
+      xs[i] = row;
+      ys[i] = i + 1;
+    }
+    ems_reserve(BENCH_LARGE_EVENT, 100, xs, ys);
+  }
+  for (unsigned int id = 1; id <= BENCH_LIST_EVENTS; id++) {
+    ems_create(100 + id * 3, 1, 1);
+  }
+
+  struct Case cases[] = {
+      {"CREATE", OP_CODE_CREATE, 7, 0},
+      {"RESERVE 4 seats", OP_CODE_RESERVE, BENCH_SMALL_EVENT, 4},
+      {"RESERVE 64 seats", OP_CODE_RESERVE, BENCH_SMALL_EVENT, 64},
+      {"SHOW 10x20", OP_CODE_SHOW, BENCH_SMALL_EVENT, 0},
+      {"SHOW 100x100", OP_CODE_SHOW, BENCH_LARGE_EVENT, 0},
+      {"LIST_PAGE", OP_CODE_LIST_PAGE, 0, 0},
+  };
+
+  printf("%-18s %12s %12s %8s\n", "request", "fixed B", "compact B", "ratio");
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    size_t fixed = wire_bytes(WIRE_FIXED, &cases[i]);
+    size_t compact = wire_bytes(WIRE_COMPACT, &cases[i]);
+    printf("%-18s %12zu %12zu %7.1fx\n", cases[i].name, fixed, compact, (double)fixed / (double)compact);
+  }
+
+  ems_terminate();
+  return 0;
+}
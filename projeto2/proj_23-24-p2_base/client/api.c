@@ -1,13 +1,1071 @@
 #include "api.h"
 #include "common/io.h"
 #include "common/constants.h"
+#include "common/histogram.h"
+#include "common/shm.h"
+
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 int fd_resp;
 int fd_req;
 char req_client_pipe[PIPENAME_SIZE];
 char resp_client_pipe[PIPENAME_SIZE];
 
-int ems_setup(char const* req_pipe_path, char const* resp_pipe_path, char const* server_pipe_path) {
+static uint32_t last_request_id;  // Id of the last request sent
+static wire_encoding_t encoding;  // Encoding of the requests, WIRE_COMPACT if the server offered it
+static buffer_t out;              // Payload of the request being built
+static size_t out_prefix;         // Bytes of out taken by the logical session
+static buffer_t in;               // Bytes read from the response pipe, from the start of the last message
+static size_t in_used;            // Size of the last message returned by recv_frame
+static bool use_socket;           // Connected through a SOCK_SEQPACKET socket, fd_req is then fd_resp
+static bool sessions_offered;     // The server multiplexes logical sessions over the connection
+static bool resume_offered;       // The server keeps a session suspended by ems_suspend
+static bool suspended;            // Set from ems_suspend until the session is resumed or destroyed
+static char *server_path;         // Path the connection was set up with
+static uint32_t logical_session;  // Logical session of the requests made from now on, 0 for the one of the connection
+
+// In shm mode requests and replies go through the channel once the server attached it,
+// the socket then only carries doorbells that wake the server
+static shm_channel_t *channel;
+static bool attached;
+static char channel_name[SHM_NAME_SIZE];  // Unlinked once the server attached the channel
+static size_t in_place;                   // Size of the last message returned by recv_frame from the channel
+
+// Seats of recently shown events, at the entry of their id modulo CLIENT_SEAT_CACHE_SIZE. A SHOW of a
+// cached event sends its version, the server then only answers with the seats taken since
+struct CachedEvent {
+  unsigned int event_id;
+  uint64_t version;     // 0 while the seats are not known
+  uint64_t num_rows;
+  uint64_t num_cols;
+  unsigned int *seats;  // NULL while the seats are not known
+  size_t pins;          // SHOWs in flight that were sent the version, the entry keeps its event until they are handled
+};
+
+static struct CachedEvent seat_cache[CLIENT_SEAT_CACHE_SIZE];
+static struct CachedEvent *out_cached;  // Entry of the seat cache the SHOW being built refers to, NULL if none
+
+// Requests in flight, at the entry of their id modulo CLIENT_MAX_IN_FLIGHT. The calling thread
+// sends requests and handles their replies, the reader thread matches the replies to them
+struct Pending {
+  uint32_t request_id;    // 0 while the entry is free
+  char opcode;
+  uint32_t logical_session;
+  wire_encoding_t enc;    // Encoding of the request, the reply comes back in it too
+  int out_fd;             // Where a SHOW prints the event and a STATS the metrics
+  ems_list_iter_t *iter;  // Where a LIST_PAGE stores the page
+  struct CachedEvent *cached;  // Entry of the seat cache pinned by a SHOW, NULL if none
+  bool done;              // Whether reply holds the payload of the reply
+  bool streamed;          // The reply came in several messages, reply only holds the part not printed yet
+  buffer_t reply;
+};
+
+// Progress of a SHOW whose reply is printed as its messages arrive
+struct ShowStream {
+  bool started;  // Whether the dimensions were read
+  uint64_t num_rows;
+  uint64_t num_cols;
+  uint64_t row;  // Position of the next seat
+  uint64_t col;
+};
+
+static struct Pending pending[CLIENT_MAX_IN_FLIGHT];
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reply_arrived = PTHREAD_COND_INITIALIZER;
+static size_t num_waiting;  // Requests sent whose reply did not arrive yet
+static bool broken;         // Set once the connection failed while reading replies
+static bool connected;      // Set from the handshake until the client quits or is destroyed
+static ems_notify_fn notify_fn;  // Given the notifications of the subscribed events
+static void *notify_arg;
+
+// A single request in flight is answered by the caller reading the reply itself, the reader
+// thread only starts once a second one is sent and then reads every reply
+static pthread_t reader;
+static bool reader_running;
+
+// Requests collected between ems_batch_begin and ems_batch_end, sent together as one BATCH
+// request whose id is the one of the first operation, the ids of the others follow it
+static bool batching;
+static size_t batch_max;         // Largest number of operations per batch
+static buffer_t batch;           // Opcode and payload of each operation collected
+static size_t batch_count;
+static uint32_t batch_first_id;
+static uint32_t batch_session;   // Logical session of every operation collected
+static buffer_t batch_out;       // Payload of the BATCH request being sent
+static buffer_t collected;  // Payload of the reply being handled, swapped with the buffer of its entry
+
+static void lock_pending(void) {
+  if (pthread_mutex_lock(&pending_lock) != 0) {
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void unlock_pending(void) {
+  if (pthread_mutex_unlock(&pending_lock) != 0) {
+    exit(EXIT_FAILURE);
+  }
+}
+
+/// Empties the payload being built and starts it with the logical session, if one is selected.
+/// @param enc Encoding the payload is built in.
+static void start_payload(wire_encoding_t enc) {
+  out.len = 0;
+  out_cached = NULL;
+  if (logical_session != 0) {
+    buffer_put_uint(&out, enc, logical_session, sizeof(uint32_t));
+  }
+  out_prefix = out.len;
+}
+
+/// Sends a request as a single message.
+/// @param opcode Opcode of the request.
+/// @param enc Encoding the payload was built in, the reply comes back in it too.
+/// @param request_id Id the reply will carry.
+/// @param payload Payload of the request.
+/// @param flags FRAME_FLAG_* bits other than the encoding, FRAME_FLAG_SESSION if the payload starts
+/// with a logical session.
+/// @return 0 if the request was sent successfully, 1 otherwise.
+static int send_request(char opcode, wire_encoding_t enc, uint32_t request_id, const buffer_t *payload,
+                        uint16_t flags) {
+  if (enc == WIRE_COMPACT) flags |= FRAME_FLAG_COMPACT;
+  frame_header_t header = {PROTOCOL_VERSION, (uint8_t)opcode, flags, (uint32_t)payload->len, request_id};
+
+  if (payload->failed) {
+    fprintf(stdout, "ERR: failed to allocate memory\n");
+    return 1;
+  }
+
+  int failed;
+  if (attached) {
+    // The server sleeps in its event loop, which only the connection wakes
+    bool woken = false;
+    failed = shm_write(channel, SHM_REQUESTS, &header, sizeof(frame_header_t), fd_req, &woken) ||
+             shm_write(channel, SHM_REQUESTS, payload->data, payload->len, fd_req, &woken) ||
+             (woken && send(fd_req, "", 1, MSG_NOSIGNAL) != 1);
+  } else {
+    failed = write_frame(fd_req, &header, payload->data, use_socket ? SOCKET_PACKET_SIZE : SIZE_MAX);
+  }
+
+  if (failed) {
+    ems_destroy_client();
+    return 1;
+  }
+
+  return 0;
+}
+
+/// Waits for the next message in the channel and gives it without copying when it is contiguous in the ring.
+/// @param header Variable to store the header in.
+/// @param payload Set to the payload, valid until the next call to recv_frame.
+/// @param delivered Set if the message was given, otherwise it wraps around the ring and must be copied.
+/// @return 0 if the message was given or must be copied, 1 on failure.
+static int recv_in_place(frame_header_t *header, const char **payload, bool *delivered) {
+  *delivered = false;
+
+  while (1) {
+    const char *data;
+    size_t to_end;
+    size_t available = shm_peek(channel, SHM_REPLIES, &data, &to_end);
+
+    if (available >= sizeof(frame_header_t)) {
+      memcpy(header, data, sizeof(frame_header_t));
+      if (header->version != PROTOCOL_VERSION) {
+        fprintf(stdout, "ERR: unsupported protocol version %u\n", header->version);
+        return 1;
+      }
+
+      size_t needed = sizeof(frame_header_t) + header->length;
+      if (needed > to_end) return 0;
+      if (available >= needed) {
+        *payload = data + sizeof(frame_header_t);
+        in_place = needed;
+        *delivered = true;
+        return 0;
+      }
+    } else if (to_end < sizeof(frame_header_t)) {
+      return 0;
+    }
+
+    if (shm_wait(channel, SHM_REPLIES, available, fd_resp)) {
+      return 1;
+    }
+  }
+}
+
+/// Receives the next message, reading as much of the response pipe as is available at a time.
+/// @param header Variable to store the header in.
+/// @param payload Set to the payload, valid until the next call.
+/// @return 0 if a message was received, 1 otherwise.
+static int recv_frame(frame_header_t *header, const char **payload) {
+  // Drops the message returned by the previous call, the bytes after it may start the next one
+  if (in_place > 0) {
+    shm_consume(channel, SHM_REPLIES, in_place);
+    in_place = 0;
+  }
+  if (in_used > 0) {
+    memmove(in.data, in.data + in_used, in.len - in_used);
+    in.len -= in_used;
+    in_used = 0;
+  }
+
+  // Replies are read in place unless they wrap around the ring or part of one was already copied
+  if (attached && in.len == 0) {
+    bool delivered;
+    if (recv_in_place(header, payload, &delivered)) {
+      return 1;
+    }
+    if (delivered) {
+      return 0;
+    }
+  }
+
+  while (1) {
+    size_t needed = sizeof(frame_header_t);
+    if (in.len >= sizeof(frame_header_t)) {
+      memcpy(header, in.data, sizeof(frame_header_t));
+      if (header->version != PROTOCOL_VERSION) {
+        fprintf(stdout, "ERR: unsupported protocol version %u\n", header->version);
+        return 1;
+      }
+
+      needed += header->length;
+      if (in.len >= needed) {
+        *payload = in.data + sizeof(frame_header_t);
+        in_used = needed;
+        return 0;
+      }
+    }
+
+    // A packet longer than the room left would be cut, the server never sends one over SOCKET_PACKET_SIZE
+    size_t room = needed - in.len;
+    if (use_socket && room < SOCKET_PACKET_SIZE) room = SOCKET_PACKET_SIZE;
+    if (buffer_reserve(&in, room)) {
+      fprintf(stdout, "ERR: failed to allocate memory\n");
+      return 1;
+    }
+
+    ssize_t ret;
+    if (attached) {
+      ret = (ssize_t)shm_read(channel, SHM_REPLIES, in.data + in.len, in.capacity - in.len);
+      if (ret == 0) {
+        if (shm_wait(channel, SHM_REPLIES, 0, fd_resp)) return 1;
+        continue;
+      }
+    } else {
+      ret = read(fd_resp, in.data + in.len, in.capacity - in.len);
+    }
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) {
+      return 1;
+    }
+    in.len += (size_t)ret;
+  }
+}
+
+/// Hands the payload of a reply to the request waiting for it.
+/// @note Must be called with pending_lock held.
+/// @param request_id Id of the request.
+/// @param opcode Opcode of the request.
+/// @param session Logical session of the reply.
+/// @param payload Payload of the reply.
+/// @param length Size of the payload.
+/// @param more Whether more messages of the reply follow, only a SHOW_SINCE is streamed.
+/// @return 0 if the reply was handed, 1 if no such request is in flight.
+static int hand_reply(uint32_t request_id, char opcode, uint32_t session, const char *payload, size_t length,
+                      bool more) {
+  struct Pending *request = &pending[request_id % CLIENT_MAX_IN_FLIGHT];
+
+  // A reply to no request in flight means both sides lost track of the stream
+  if (request->request_id != request_id || request->done || request->opcode != opcode ||
+      request->logical_session != session || (more && opcode != OP_CODE_SHOW_SINCE)) {
+    return 1;
+  }
+
+  // The messages of a streamed reply pile up until the caller prints them
+  if (!request->streamed) request->reply.len = 0;
+  if (buffer_append(&request->reply, payload, length)) {
+    return 1;
+  }
+  if (more) {
+    request->streamed = true;
+    return 0;
+  }
+  request->done = true;
+  num_waiting--;
+  return 0;
+}
+
+/// Splits the reply to a batch among its operations, each reply is prefixed with its size.
+/// @note Must be called with pending_lock held.
+/// @param header Header of the reply, its id is the one of the first operation.
+/// @param session Logical session of the reply.
+/// @param payload Payload of the reply.
+/// @return 0 if every operation got its reply, 1 otherwise.
+static int hand_batch(const frame_header_t *header, uint32_t session, const char *payload) {
+  wire_encoding_t enc = (header->flags & FRAME_FLAG_COMPACT) ? WIRE_COMPACT : WIRE_FIXED;
+  size_t left = header->length;
+  uint64_t count;
+
+  if (take_uint(&count, enc, &payload, &left, sizeof(size_t)) || count == 0 || count > BATCH_MAX_OPERATIONS) {
+    return 1;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t request_id = header->request_id + i;
+    uint64_t length;
+    if (take_uint(&length, enc, &payload, &left, sizeof(size_t)) || length > left ||
+        hand_reply(request_id, pending[request_id % CLIENT_MAX_IN_FLIGHT].opcode, session, payload, length, false)) {
+      return 1;
+    }
+    payload += length;
+    left -= length;
+  }
+
+  return left != 0;
+}
+
+/// Gives the notifications in a message to the notify function.
+/// @param header Header of the message.
+/// @param payload Payload of the message.
+/// @return 0 if the message held valid notifications, 1 otherwise.
+static int hand_notices(const frame_header_t *header, const char *payload) {
+  wire_encoding_t enc = (header->flags & FRAME_FLAG_COMPACT) ? WIRE_COMPACT : WIRE_FIXED;
+  size_t left = header->length;
+  uint64_t dropped;
+  uint64_t count;
+
+  lock_pending();
+  ems_notify_fn notify = notify_fn;
+  void *arg = notify_arg;
+  unlock_pending();
+
+  if (take_uint(&dropped, enc, &payload, &left, sizeof(uint8_t)) ||
+      take_uint(&count, enc, &payload, &left, sizeof(size_t))) {
+    return 1;
+  }
+  if (dropped && notify != NULL) notify(0, 0, 0, NULL, NULL, arg);
+
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t event_id;
+    uint64_t reservation_id;
+    uint64_t num_seats;
+    size_t xs[MAX_RESERVATION_SIZE];
+    size_t ys[MAX_RESERVATION_SIZE];
+    if (take_uint(&event_id, enc, &payload, &left, sizeof(unsigned int)) ||
+        take_uint(&reservation_id, enc, &payload, &left, sizeof(unsigned int)) ||
+        take_uint(&num_seats, enc, &payload, &left, sizeof(size_t)) || num_seats > MAX_RESERVATION_SIZE) {
+      return 1;
+    }
+    for (uint64_t j = 0; j < 2 * num_seats; j++) {
+      uint64_t value;
+      if (take_uint(&value, enc, &payload, &left, sizeof(size_t))) return 1;
+      if (j < num_seats) {
+        xs[j] = value;
+      } else {
+        ys[j - num_seats] = value;
+      }
+    }
+
+    if (notify != NULL) notify((unsigned int)event_id, (unsigned int)reservation_id, num_seats, xs, ys, arg);
+  }
+
+  return left != 0;
+}
+
+/// Receives a reply and hands it to the request waiting for it.
+/// @return 0 if the reply was handed, 1 if the connection failed.
+static int receive_reply(void) {
+  frame_header_t header;
+  const char *payload;
+  uint32_t session = 0;
+  int failed = recv_frame(&header, &payload) ||
+               ((header.flags & FRAME_FLAG_SESSION) && take_logical_session(&header, &payload, &session));
+
+  // Notifications answer no request, nobody waits on them
+  if (!failed && header.opcode == OP_CODE_NOTIFY && header.request_id == 0) {
+    failed = hand_notices(&header, payload);
+    if (!failed) return 0;
+  }
+
+  lock_pending();
+  if (!failed) {
+    bool more = (header.flags & FRAME_FLAG_MORE) != 0;
+    failed = header.opcode == OP_CODE_BATCH
+                 ? more || hand_batch(&header, session, payload)
+                 : hand_reply(header.request_id, (char)header.opcode, session, payload, header.length, more);
+  }
+
+  if (failed) {
+    broken = true;
+  }
+  pthread_cond_broadcast(&reply_arrived);
+  unlock_pending();
+  return failed;
+}
+
+/// Receives replies until the connection fails or the thread is cancelled.
+static void *read_replies(void *args) {
+  (void)args;
+
+  while (receive_reply() == 0) {
+  }
+  return NULL;
+}
+
+/// Starts the reader thread, which must not take the signals meant for the caller.
+/// @return 0 if the thread started, 1 otherwise.
+static int start_reader(void) {
+  sigset_t mask;
+  sigset_t old_mask;
+  sigfillset(&mask);
+
+  if (pthread_sigmask(SIG_BLOCK, &mask, &old_mask) != 0) {
+    return 1;
+  }
+  reader_running = pthread_create(&reader, NULL, read_replies, NULL) == 0;
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  return reader_running ? 0 : 1;
+}
+
+/// Stops the reader thread and forgets the requests in flight.
+static void stop_reader(void) {
+  if (reader_running) {
+    // The thread only holds the lock between cancellation points, a sleep on the channel ends at the interrupt
+    pthread_cancel(reader);
+    if (attached) shm_interrupt(channel, SHM_REPLIES);
+    pthread_join(reader, NULL);
+    reader_running = false;
+  }
+
+  for (size_t i = 0; i < CLIENT_MAX_IN_FLIGHT; i++) {
+    pending[i].request_id = 0;
+    pending[i].done = false;
+    pending[i].streamed = false;
+    pending[i].cached = NULL;
+    buffer_free(&pending[i].reply);
+  }
+  for (size_t i = 0; i < CLIENT_SEAT_CACHE_SIZE; i++) {
+    seat_cache[i].pins = 0;
+  }
+  buffer_free(&collected);
+  buffer_free(&batch);
+  buffer_free(&batch_out);
+  batch_count = 0;
+  batching = false;
+  num_waiting = 0;
+  broken = false;
+  connected = false;
+}
+
+/// Sends the operations collected in the open batch, if any.
+/// @return 0 if the batch was sent or empty, 1 otherwise.
+static int send_batch(void) {
+  if (batch_count == 0) {
+    return 0;
+  }
+
+  batch_out.len = 0;
+  if (batch_session != 0) {
+    buffer_put_uint(&batch_out, encoding, batch_session, sizeof(uint32_t));
+  }
+  buffer_put_uint(&batch_out, encoding, batch_count, sizeof(size_t));
+  buffer_append(&batch_out, batch.data, batch.len);
+  batch.len = 0;
+  batch_count = 0;
+  if (batch.failed) batch_out.failed = true;
+  batch.failed = false;
+
+  uint16_t flags = batch_session != 0 ? FRAME_FLAG_SESSION : 0;
+  return send_request(OP_CODE_BATCH, encoding, batch_first_id, &batch_out, flags);
+}
+
+/// Tells whether the request built in out may join the open batch.
+/// @param opcode Opcode of the request.
+/// @param enc Encoding of the request, a batch only holds requests in the encoding of the connection.
+/// @param request_id Id of the request, it must follow the ids already in the batch.
+/// @return true if the request may join the batch, false if it must be sent on its own.
+static bool fits_batch(char opcode, wire_encoding_t enc, uint32_t request_id) {
+  if (!batching || enc != encoding ||
+      (opcode != OP_CODE_CREATE && opcode != OP_CODE_RESERVE && opcode != OP_CODE_SHOW_SINCE &&
+       opcode != OP_CODE_DELETE)) {
+    return false;
+  }
+
+  // The batch starts like out with the logical session, then the count takes at most a size_t
+  // and each operation adds its opcode and payload
+  if (sizeof(size_t) + batch.len + sizeof(uint8_t) + out.len > REQUEST_MAX_PAYLOAD) {
+    return false;
+  }
+  return batch_count == 0 || (batch_count < batch_max && batch_session == logical_session &&
+                              request_id == batch_first_id + (uint32_t)batch_count);
+}
+
+/// Sends the request built in out, or adds it to the open batch, and records it as in flight.
+/// @param opcode Opcode of the request.
+/// @param enc Encoding the payload was built in.
+/// @param out_fd Where the event is printed, for a SHOW, or the metrics, for a STATS.
+/// @param iter Where the page is stored, for a LIST_PAGE.
+/// @return Handle of the request, 0 if it could not be sent.
+static ems_handle_t submit(char opcode, wire_encoding_t enc, int out_fd, ems_list_iter_t *iter) {
+  if (!connected) {
+    return 0;
+  }
+  if (!reader_running && num_waiting > 0 && start_reader()) {
+    fprintf(stdout, "ERR: failed to start the reader thread\n");
+    ems_destroy_client();
+    return 0;
+  }
+
+  // Handle 0 reports failures, so it is never an id
+  uint32_t request_id = ++last_request_id;
+  if (request_id == 0) request_id = ++last_request_id;
+  struct Pending *request = &pending[request_id % CLIENT_MAX_IN_FLIGHT];
+
+  // Requests leave in id order, so a request that cannot join the batch sends it first
+  bool batched = fits_batch(opcode, enc, request_id);
+  if (!batched) {
+    if (send_batch()) return 0;
+    batched = fits_batch(opcode, enc, request_id);
+  }
+
+  // The entry is free once the request CLIENT_MAX_IN_FLIGHT ids earlier was answered, even if nobody waited on it
+  lock_pending();
+  while (request->request_id != 0 && !request->done && !broken) {
+    pthread_cond_wait(&reply_arrived, &pending_lock);
+  }
+  if (broken) {
+    unlock_pending();
+    ems_destroy_client();
+    return 0;
+  }
+  // A SHOW nobody waited on no longer needs its cached seats
+  if (request->request_id != 0 && request->cached != NULL) request->cached->pins--;
+  request->cached = out_cached;
+  if (out_cached != NULL) out_cached->pins++;
+  request->request_id = request_id;
+  request->opcode = opcode;
+  request->logical_session = logical_session;
+  request->enc = enc;
+  request->out_fd = out_fd;
+  request->iter = iter;
+  request->done = false;
+  request->streamed = false;
+  num_waiting++;
+  unlock_pending();
+
+  if (batched) {
+    if (batch_count == 0) {
+      batch_first_id = request_id;
+      batch_session = logical_session;
+    }
+    buffer_put_uint(&batch, encoding, (uint8_t)opcode, sizeof(uint8_t));
+    buffer_append(&batch, out.data + out_prefix, out.len - out_prefix);
+    if (out.failed) batch.failed = true;
+    batch_count++;
+    return request_id;
+  }
+
+  if (send_request(opcode, enc, request_id, &out, logical_session != 0 ? FRAME_FLAG_SESSION : 0)) {
+    return 0;
+  }
+  return request_id;
+}
+
+/// Prints the seats of an event, row by row.
+/// @param out_fd File descriptor to print the event to.
+/// @param num_rows Number of rows of the event.
+/// @param num_cols Number of columns of the event.
+/// @param seats Reservation of each seat, row by row.
+/// @return 0 if the event was printed successfully, 1 otherwise.
+static int print_seats(int out_fd, uint64_t num_rows, uint64_t num_cols, const unsigned int *seats) {
+  // The whole event goes through one buffer, written out each time it fills up
+  io_writer_t text;
+  io_writer_init(&text, out_fd, SIZE_MAX);
+  for(size_t i = 0; i < num_rows; i++) {
+    for(size_t j = 0; j < num_cols; j++){
+      if(print_uint(&text, seats[i * num_cols + j]) || write_all(&text, j < num_cols - 1 ? " " : "\n", 1)) {
+        fprintf(stdout, "Error writing to file descriptor\n");
+        return 1;
+      }
+    }
+  }
+
+  if (io_flush(&text)) {
+    fprintf(stdout, "Error writing to file descriptor\n");
+    return 1;
+  }
+  return 0;
+}
+
+/// Reads the dimensions and the seats of an event from a reply, compact seats come in runs of equal seats.
+/// @param enc Encoding of the reply.
+/// @param reply Start of the dimensions, moved past the seats.
+/// @param left Bytes left in the reply.
+/// @param event Entry to store the dimensions and the seats in, its seats must be freed by the caller.
+/// @return 0 if the reply holds the seats and they were stored, 1 otherwise.
+static int take_seats(wire_encoding_t enc, const char **reply, size_t *left, struct CachedEvent *event) {
+  if (take_uint(&event->num_rows, enc, reply, left, sizeof(size_t)) ||
+      take_uint(&event->num_cols, enc, reply, left, sizeof(size_t)) ||
+      (event->num_rows > 0 && event->num_cols > SIZE_MAX / sizeof(unsigned int) / event->num_rows) ||
+      (enc == WIRE_FIXED && *left != sizeof(unsigned int) * event->num_rows * event->num_cols)) {
+    return 1;
+  }
+
+  size_t num_seats = event->num_rows * event->num_cols;
+  event->seats = malloc(sizeof(unsigned int) * (num_seats > 0 ? num_seats : 1));
+  if (event->seats == NULL) {
+    fprintf(stdout, "ERR: failed to allocate memory\n");
+    return 1;
+  }
+
+  uint64_t seat = 0;
+  uint64_t run = 0;
+  for (size_t i = 0; i < num_seats; i++) {
+    int failed;
+    if (enc == WIRE_FIXED) {
+      failed = take_uint(&seat, enc, reply, left, sizeof(unsigned int));
+    } else {
+      failed = run == 0 && (take_uint(&run, enc, reply, left, sizeof(size_t)) ||
+                            take_uint(&seat, enc, reply, left, sizeof(unsigned int)) || run == 0);
+      run--;
+    }
+    if (failed) {
+      return 1;
+    }
+    event->seats[i] = (unsigned int)seat;
+  }
+
+  return run != 0;
+}
+
+/// Forgets the seats of a cached event.
+/// @param cached Entry of the seat cache.
+static void drop_cached(struct CachedEvent *cached) {
+  free(cached->seats);
+  cached->seats = NULL;
+  cached->version = 0;
+}
+
+/// Prints the seats in the messages of a SHOW_ROWS reply received so far.
+/// @param stream Progress of the reply, its first message starts with the dimensions.
+/// @param out_fd File descriptor to print the event to.
+/// @param enc Encoding of the reply.
+/// @param reply Whole messages of the reply, one after the other.
+/// @param left Size of the messages.
+/// @param last Whether these messages end the reply.
+/// @return 0 if the seats were printed successfully, 1 otherwise.
+static int print_rows(struct ShowStream *stream, int out_fd, wire_encoding_t enc, const char *reply, size_t left,
+                      bool last) {
+  if (!stream->started) {
+    uint64_t success;
+    uint64_t version;
+    uint64_t kind;
+    if (take_uint(&success, enc, &reply, &left, sizeof(int)) || success != 0 ||
+        take_uint(&version, enc, &reply, &left, sizeof(uint64_t)) ||
+        take_uint(&kind, enc, &reply, &left, sizeof(uint8_t)) || kind != SHOW_ROWS ||
+        take_uint(&stream->num_rows, enc, &reply, &left, sizeof(size_t)) ||
+        take_uint(&stream->num_cols, enc, &reply, &left, sizeof(size_t)) || stream->num_cols == 0) {
+      return 1;
+    }
+    stream->started = true;
+  }
+
+  // Seats are formatted in a buffer of fixed size, written out each time it fills up
+  io_writer_t text;
+  io_writer_init(&text, out_fd, SIZE_MAX);
+  while (left > 0) {
+    uint64_t seat;
+    uint64_t run = 1;
+    if (enc == WIRE_FIXED ? take_uint(&seat, enc, &reply, &left, sizeof(unsigned int))
+                          : take_uint(&run, enc, &reply, &left, sizeof(size_t)) ||
+                                take_uint(&seat, enc, &reply, &left, sizeof(unsigned int)) || run == 0) {
+      return 1;
+    }
+
+    for (; run > 0; run--) {
+      if (stream->row == stream->num_rows) return 1;
+
+      bool row_done = ++stream->col == stream->num_cols;
+      if (print_uint(&text, (unsigned int)seat) || write_all(&text, row_done ? "\n" : " ", 1)) {
+        fprintf(stdout, "Error writing to file descriptor\n");
+        return 1;
+      }
+      if (row_done) {
+        stream->col = 0;
+        stream->row++;
+      }
+    }
+  }
+
+  if (io_flush(&text)) {
+    fprintf(stdout, "Error writing to file descriptor\n");
+    return 1;
+  }
+  return last && stream->row != stream->num_rows;
+}
+
+/// Applies the reply to a SHOW_SINCE to the seat cache and prints the event.
+/// @param out_fd File descriptor to print the event to.
+/// @param enc Encoding of the reply.
+/// @param cached Entry of the seat cache pinned by the request, NULL if none.
+/// @param reply Payload of the reply.
+/// @param left Size of the payload.
+/// @return 0 if the event was printed successfully, 1 otherwise.
+static int print_event(int out_fd, wire_encoding_t enc, struct CachedEvent *cached, const char *reply, size_t left) {
+  const char *start = reply;
+  size_t size = left;
+  uint64_t success;
+  uint64_t version;
+  uint64_t kind;
+
+  if (cached != NULL) cached->pins--;
+  if (take_uint(&success, enc, &reply, &left, sizeof(int))) {
+    return 1;
+  }
+
+  if(success){
+    // Other SHOWs in flight may still get a delta against the seats
+    if (cached != NULL && cached->pins == 0) drop_cached(cached);
+    io_writer_t text;
+    io_writer_init(&text, out_fd, SIZE_MAX);
+    if (print_str(&text, "Event not found\n") == 0) io_flush(&text);
+    return (int)success;
+  }
+
+  if (take_uint(&version, enc, &reply, &left, sizeof(uint64_t)) || take_uint(&kind, enc, &reply, &left, sizeof(uint8_t))) {
+    ems_destroy_client();
+    return 1;
+  }
+
+  if (kind == SHOW_ROWS) {
+    // Rows that fit in one message, never kept like the ones of a streamed reply
+    if (cached != NULL && cached->pins == 0) drop_cached(cached);
+    struct ShowStream stream = {0};
+    if (print_rows(&stream, out_fd, enc, start, size, true)) {
+      ems_destroy_client();
+      return 1;
+    }
+    return 0;
+  } else if (kind == SHOW_FULL) {
+    struct CachedEvent event = {0};
+    if (take_seats(enc, &reply, &left, &event) || left != 0) {
+      free(event.seats);
+      ems_destroy_client();
+      return 1;
+    }
+
+    // A reply handled after a newer one must not replace its seats
+    if (cached == NULL || (cached->seats != NULL && version <= cached->version)) {
+      int result = print_seats(out_fd, event.num_rows, event.num_cols, event.seats);
+      free(event.seats);
+      return result;
+    }
+    free(cached->seats);
+    cached->seats = event.seats;
+    cached->num_rows = event.num_rows;
+    cached->num_cols = event.num_cols;
+    cached->version = version;
+  } else if (kind == SHOW_DELTA && cached != NULL && cached->seats != NULL) {
+    // Seats are only ever taken, so the delta also applies to seats newer than the version sent
+    uint64_t count;
+    int failed = take_uint(&count, enc, &reply, &left, sizeof(size_t));
+    for (uint64_t i = 0; !failed && i < count; i++) {
+      uint64_t seat;
+      uint64_t reservation;
+      failed = take_uint(&seat, enc, &reply, &left, sizeof(size_t)) ||
+               take_uint(&reservation, enc, &reply, &left, sizeof(unsigned int)) ||
+               seat >= cached->num_rows * cached->num_cols;
+      if (!failed) cached->seats[seat] = (unsigned int)reservation;
+    }
+    if (failed || left != 0) {
+      ems_destroy_client();
+      return 1;
+    }
+    if (version > cached->version) cached->version = version;
+  } else if (kind != SHOW_UNCHANGED || cached == NULL || cached->seats == NULL || left != 0) {
+    ems_destroy_client();
+    return 1;
+  }
+
+  return print_seats(out_fd, cached->num_rows, cached->num_cols, cached->seats);
+}
+
+/// Stores the page in the reply to a LIST_PAGE.
+/// @param iter Iterator to be filled.
+/// @param enc Encoding of the reply.
+/// @param reply Payload of the reply.
+/// @param left Size of the payload.
+/// @return 0 if the page was stored successfully, 1 otherwise.
+static int store_list_page(ems_list_iter_t* iter, wire_encoding_t enc, const char *reply, size_t left) {
+  uint64_t success;
+  uint64_t count;
+  uint64_t more;
+
+  if (take_uint(&success, enc, &reply, &left, sizeof(int))) {
+    return 1;
+  }
+
+  if (success) {
+    return (int)success;
+  }
+
+  if (take_uint(&count, enc, &reply, &left, sizeof(size_t)) || count > LIST_PAGE_SIZE) {
+    ems_destroy_client();
+    return 1;
+  }
+
+  // Compact ids are sent as the gap from the previous one
+  unsigned int previous = 0;
+  for (size_t i = 0; i < count; i++) {
+    uint64_t id;
+    if (take_uint(&id, enc, &reply, &left, sizeof(unsigned int))) {
+      ems_destroy_client();
+      return 1;
+    }
+    iter->ids[i] = enc == WIRE_COMPACT ? previous + (unsigned int)id : (unsigned int)id;
+    previous = iter->ids[i];
+  }
+
+  if (take_uint(&more, enc, &reply, &left, sizeof(int))) {
+    ems_destroy_client();
+    return 1;
+  }
+
+  iter->count = count;
+  iter->pos = 0;
+  iter->last_page = !more;
+  if (more) {
+    iter->cursor = iter->ids[iter->count - 1] + 1;
+  }
+
+  return 0;
+}
+
+/// Gives the latency under which a share of the requests of a histogram were answered.
+/// @param buckets Requests counted in each bucket.
+/// @param count Requests in the histogram, at least one.
+/// @param per_mille Share of the requests, in thousandths.
+/// @return Largest latency of the bucket holding the request at that rank, in microseconds.
+static double percentile_us(const uint64_t *buckets, uint64_t count, uint64_t per_mille) {
+  uint64_t rank = (count * per_mille + 999) / 1000;
+  if (rank == 0) rank = 1;
+
+  uint64_t seen = 0;
+  size_t bucket = 0;
+  for (; bucket < HISTOGRAM_BUCKETS - 1; bucket++) {
+    seen += buckets[bucket];
+    if (seen >= rank) break;
+  }
+  return (double)histogram_bucket_max(bucket) / 1e3;
+}
+
+/// Prints the metrics in the reply to a STATS.
+/// @param out_fd File descriptor to print the metrics to.
+/// @param enc Encoding of the reply.
+/// @param reply Payload of the reply.
+/// @param left Size of the payload.
+/// @return 0 if the metrics were printed successfully, 1 otherwise.
+static int print_stats(int out_fd, wire_encoding_t enc, const char *reply, size_t left) {
+  static const char *const names[STATS_NUM_OPS] = {"CREATE", "RESERVE", "SHOW", "LIST"};
+  uint64_t success;
+  uint64_t fields[8];  // Requests, bytes in and out, lock holds, wait, held and longest held time, sessions
+
+  if (take_uint(&success, enc, &reply, &left, sizeof(int)) || success != 0) {
+    return 1;
+  }
+  for (size_t i = 0; i < 8; i++) {
+    if (take_uint(&fields[i], enc, &reply, &left, sizeof(uint64_t))) {
+      ems_destroy_client();
+      return 1;
+    }
+  }
+
+  io_writer_t text;
+  io_writer_init(&text, out_fd, SIZE_MAX);
+  char line[256];
+  double holds = fields[3] > 0 ? (double)fields[3] : 1.0;
+  snprintf(line, sizeof(line),
+           "Requests: %" PRIu64 ", %" PRIu64 " bytes in, %" PRIu64 " bytes out\nSessions: %" PRIu64 "\n"
+           "Event locks: taken %" PRIu64 " times, %.1f us waited and %.1f us held on average, %.1f us at most\n",
+           fields[0], fields[1], fields[2], fields[7], fields[3], (double)fields[4] / holds / 1e3,
+           (double)fields[5] / holds / 1e3, (double)fields[6] / 1e3);
+  int failed = print_str(&text, line);
+
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+  for (size_t op = 0; op < STATS_NUM_OPS; op++) {
+    uint64_t used;
+    uint64_t count = 0;
+    memset(buckets, 0, sizeof(buckets));
+    if (take_uint(&used, enc, &reply, &left, sizeof(size_t)) || used > HISTOGRAM_BUCKETS) {
+      ems_destroy_client();
+      return 1;
+    }
+    for (uint64_t i = 0; i < used; i++) {
+      uint64_t bucket;
+      uint64_t requests;
+      if (take_uint(&bucket, enc, &reply, &left, sizeof(uint32_t)) || bucket >= HISTOGRAM_BUCKETS ||
+          take_uint(&requests, enc, &reply, &left, sizeof(uint64_t))) {
+        ems_destroy_client();
+        return 1;
+      }
+      buckets[bucket] = requests;
+      count += requests;
+    }
+
+    if (count == 0) {
+      snprintf(line, sizeof(line), "%s: 0 requests\n", names[op]);
+    } else {
+      snprintf(line, sizeof(line), "%s: %" PRIu64 " requests, p50 %.1f us, p99 %.1f us, p999 %.1f us\n", names[op],
+               count, percentile_us(buckets, count, 500), percentile_us(buckets, count, 990),
+               percentile_us(buckets, count, 999));
+    }
+    failed = failed || print_str(&text, line);
+  }
+
+  if (left != 0) {
+    ems_destroy_client();
+    return 1;
+  }
+  if (failed || io_flush(&text)) {
+    fprintf(stdout, "Error writing to file descriptor\n");
+    return 1;
+  }
+  return 0;
+}
+
+int ems_wait(ems_handle_t handle) {
+  // The request may still be in the open batch
+  if (handle == 0 || send_batch()) {
+    return 1;
+  }
+
+  struct Pending *entry = &pending[handle % CLIENT_MAX_IN_FLIGHT];
+  struct ShowStream stream = {0};
+  while (1) {
+    if (!reader_running) {
+      // Nobody else reads, and entries only change in this thread
+      while (entry->request_id == handle && !entry->done && !broken && !(entry->streamed && entry->reply.len > 0)) {
+        receive_reply();
+      }
+    }
+
+    lock_pending();
+    while (entry->request_id == handle && !entry->done && !broken && !(entry->streamed && entry->reply.len > 0)) {
+      pthread_cond_wait(&reply_arrived, &pending_lock);
+    }
+    if (entry->request_id != handle) {
+      unlock_pending();
+      return 1;
+    }
+    if (entry->done) break;
+    if (broken) {
+      unlock_pending();
+      ems_destroy_client();
+      return 1;
+    }
+
+    // The part of a streamed reply received so far is printed while the rest arrives in the other buffer
+    buffer_t part = entry->reply;
+    entry->reply = collected;
+    entry->reply.len = 0;
+    collected = part;
+    unlock_pending();
+
+    if (print_rows(&stream, entry->out_fd, entry->enc, collected.data, collected.len, false)) {
+      ems_destroy_client();
+      return 1;
+    }
+  }
+
+  // The buffers are swapped rather than copied, so the entry keeps memory for its next reply
+  struct Pending request = *entry;
+  entry->reply = collected;
+  entry->request_id = 0;
+  collected = request.reply;
+  unlock_pending();
+
+  uint64_t success;
+  const char *reply = collected.data;
+  size_t left = collected.len;
+  switch (request.opcode) {
+    case OP_CODE_SHOW_SINCE:
+      if (!request.streamed) return print_event(request.out_fd, request.enc, request.cached, reply, left);
+
+      // Streamed seats are never kept, the next SHOW of the event asks for all of them again
+      if (request.cached != NULL && --request.cached->pins == 0) drop_cached(request.cached);
+      if (print_rows(&stream, request.out_fd, request.enc, reply, left, true)) {
+        ems_destroy_client();
+        return 1;
+      }
+      return 0;
+    case OP_CODE_LIST_PAGE:
+      return store_list_page(request.iter, request.enc, reply, left);
+    case OP_CODE_STATS:
+      return print_stats(request.out_fd, request.enc, reply, left);
+    default:
+      if (take_uint(&success, request.enc, &reply, &left, sizeof(int))) {
+        return 1;
+      }
+      return (int)success;
+  }
+}
+
+int ems_poll(ems_handle_t handle) {
+  struct Pending *entry = &pending[handle % CLIENT_MAX_IN_FLIGHT];
+  int ret;
+
+  if (send_batch()) {
+    return -1;
+  }
+  lock_pending();
+  if (handle == 0 || entry->request_id != handle) {
+    ret = -1;
+  } else {
+    ret = entry->done || broken;
+  }
+  unlock_pending();
+
+  // A reply nobody reads would never arrive
+  if (ret == 0 && !reader_running && start_reader()) {
+    fprintf(stdout, "ERR: failed to start the reader thread\n");
+    ems_destroy_client();
+    return -1;
+  }
+  return ret;
+}
+
+/// Connects to the listening socket of the server.
+/// @param path Path of the socket.
+/// @return 0 if the connection was established, 1 otherwise.
+static int connect_socket(const char* path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stdout, "ERROR socket path too long: %s\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+
+  fd_req = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (fd_req == -1 || connect(fd_req, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    fprintf(stderr, "[ERR]: connect failed: %s\n", strerror(errno));
+    if (fd_req != -1) close(fd_req);
+    return 1;
+  }
+
+  fd_resp = fd_req;
+  return 0;
+}
+
+/// Creates the client pipes and registers them through the server pipe.
+/// @param req_pipe_path Path to the name pipe to be created for requests.
+/// @param resp_pipe_path Path to the name pipe to be created for responses.
+/// @param server_pipe_path Path to the name pipe where the server is listening.
+/// @return 0 if both pipes were opened, 1 otherwise.
+static int open_pipes(char const* req_pipe_path, char const* resp_pipe_path, char const* server_pipe_path) {
   strcpy(req_client_pipe, req_pipe_path);
   strcpy(resp_client_pipe, resp_pipe_path);
 
@@ -63,74 +1121,208 @@ int ems_setup(char const* req_pipe_path, char const* resp_pipe_path, char const*
       msg_to_server[i] = resp_pipe_path_fixed[i-(PIPENAME_SIZE+1)];
   }
 
-  ssize_t ret = write(fd_server, msg_to_server, (2*PIPENAME_SIZE)+1);
-  if (ret < 0) {
+  io_writer_t registration;
+  io_writer_init(&registration, fd_server, SIZE_MAX);
+  if (write_all(&registration, msg_to_server, (2*PIPENAME_SIZE)+1) || io_flush(&registration)) {
     fprintf(stdout, "ERR: write failed\n");
     return 1;
   }
 
   close(fd_server);
-  // Open server pipe for reading
+
+  // Open request client pipe for writing
+  // This waits for someone to open it for reading
+  fd_req = open(req_client_pipe, O_WRONLY);
+  if (fd_req == -1) {
+    fprintf(stderr, "[ERR]: open failed: %s\n", strerror(errno));
+    return 1;
+  }
+
+  // Open request client pipe for reading
   // This waits for someone to open it for writing
-  fd_server = open(server_pipe_path, O_RDONLY);
-  if (fd_server == -1) {
+  fd_resp = open(resp_client_pipe, O_RDONLY);
+  if (fd_resp == -1) {
     fprintf(stderr, "[ERR]: open failed: %s\n", strerror(errno));
     return 1;
   }
 
-  int session_id;
-  ret = read(fd_server, &session_id, sizeof(int));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: read failed\n");
+  return 0;
+}
+
+/// Creates the channel and sends its name, the server attaches it before sending the session id.
+/// @return 0 if the name was sent, 1 otherwise.
+static int create_channel(void) {
+  channel = shm_create(channel_name);
+  if (channel == NULL) {
+    fprintf(stdout, "ERR: failed to create channel: %s\n", strerror(errno));
+    channel_name[0] = '\0';
     return 1;
   }
 
-  close(fd_server);
+  frame_header_t header = {PROTOCOL_VERSION, OP_CODE_CLIENT, 0, (uint32_t)strlen(channel_name), 0};
+  return write_frame(fd_req, &header, channel_name, SOCKET_PACKET_SIZE);
+}
 
-  if(!(session_id >= 0 && session_id < MAX_SESSION_COUNT)){
-    // Remove req_pipe_path if it does exist
-    if (unlink(req_pipe_path) != 0 && errno != ENOENT) {
-      fprintf(stdout, "ERROR unlink(%s) failed:\n", req_pipe_path);
+/// Reads the setup message, skipping the replies to requests sent before the session was suspended.
+/// @return 0 if the session id and the flags were read, 1 otherwise.
+static int receive_setup(void) {
+  frame_header_t header;
+  const char *reply;
+  size_t left;
+  uint64_t session_id;
+  do {
+    if (recv_frame(&header, &reply)) {
       return 1;
     }
+  } while (header.opcode != OP_CODE_CLIENT);
+  left = header.length;
+  if (take_uint(&session_id, WIRE_FIXED, &reply, &left, sizeof(int)) || session_id > INT_MAX) {
+    return 1;
+  }
 
-    // Remove resp_pipe_path if it does exist
-    if (unlink(resp_pipe_path) != 0 && errno != ENOENT) {
-      fprintf(stdout, "ERROR unlink(%s) failed:\n", resp_pipe_path);
+  // The server lists the FRAME_FLAG_* bits it understands after the id
+  uint64_t flags = 0;
+  take_uint(&flags, WIRE_FIXED, &reply, &left, sizeof(uint32_t));
+  encoding = (flags & FRAME_FLAG_COMPACT) ? WIRE_COMPACT : WIRE_FIXED;
+  sessions_offered = (flags & FRAME_FLAG_SESSION) != 0;
+  resume_offered = (flags & FRAME_FLAG_RESUME) != 0;
+  logical_session = 0;
+  return 0;
+}
+
+/// Resumes the suspended session if it was set up with the same paths.
+/// @return 0 if the session was resumed, 1 if the client was destroyed instead.
+static int resume_session(char const* req_pipe_path, char const* resp_pipe_path, char const* server_pipe_path) {
+  suspended = false;
+  bool same = strcmp(server_pipe_path, server_path) == 0 &&
+              (use_socket || (strcmp(req_pipe_path, req_client_pipe) == 0 &&
+                              strcmp(resp_pipe_path, resp_client_pipe) == 0));
+  if (!same) {
+    ems_destroy_client();
+    return 1;
+  }
+
+  out.len = 0;
+  if (send_request(OP_CODE_CLIENT, WIRE_FIXED, ++last_request_id, &out, 0)) {
+    return 1;
+  }
+  if (receive_setup()) {
+    ems_destroy_client();
+    return 1;
+  }
+
+  connected = true;
+  return 0;
+}
+
+int ems_setup(char const* req_pipe_path, char const* resp_pipe_path, char const* server_pipe_path) {
+  // A failed resume falls back to a new connection
+  if (suspended && resume_session(req_pipe_path, resp_pipe_path, server_pipe_path) == 0) {
+    return 0;
+  }
+
+  // The transport is chosen by the path of the server, the client pipes are not used with a socket
+  bool use_shm = strncmp(server_pipe_path, SHM_PATH_PREFIX, strlen(SHM_PATH_PREFIX)) == 0;
+  use_socket = use_shm || strncmp(server_pipe_path, SOCKET_PATH_PREFIX, strlen(SOCKET_PATH_PREFIX)) == 0;
+  if (use_shm) {
+    if (connect_socket(server_pipe_path + strlen(SHM_PATH_PREFIX))) {
       return 1;
     }
+    if (create_channel()) {
+      ems_destroy_client();
+      return 1;
+    }
+  } else if (use_socket ? connect_socket(server_pipe_path + strlen(SOCKET_PATH_PREFIX))
+                        : open_pipes(req_pipe_path, resp_pipe_path, server_pipe_path)) {
     return 1;
   }
 
-  // Open request client pipe for writing
-  // This waits for someone to open it for reading
-  fd_req = open(req_client_pipe, O_WRONLY);
-  if (fd_req == -1) {
-    fprintf(stderr, "[ERR]: open failed: %s\n", strerror(errno));
+  // The session id is the first message on the response pipe, the server pipe is shared by every client
+  if (receive_setup()) {
+    ems_destroy_client();
     return 1;
   }
 
-  // Open request client pipe for reading
-  // This waits for someone to open it for writing
-  fd_resp = open(resp_client_pipe, O_RDONLY);
-  if (fd_resp == -1) {
-    fprintf(stderr, "[ERR]: open failed: %s\n", strerror(errno));
+  // Both sides have the channel mapped, its name is no longer needed
+  if (use_shm) {
+    shm_remove(channel_name);
+    channel_name[0] = '\0';
+    attached = true;
+  }
+
+  // Kept to tell whether a later setup can resume the session
+  free(server_path);
+  server_path = strdup(server_pipe_path);
+
+  connected = true;
+  return 0;
+}
+
+int ems_suspend(void) {
+  if (!resume_offered || server_path == NULL) {
+    return ems_quit();
+  }
+
+  out.len = 0;
+  if (send_batch() || send_request(OP_CODE_QUIT, WIRE_FIXED, ++last_request_id, &out, FRAME_FLAG_RESUME)) {
     return 1;
   }
 
+  // Replies nobody waited on are dropped when the session is resumed
+  stop_reader();
+  suspended = true;
+
+  // Both sides keep the pipes open, their names are no longer needed
+  if (!use_socket) {
+    unlink(req_client_pipe);
+    unlink(resp_client_pipe);
+  }
+
   return 0;
 }
 
+/// Forgets every cached event, their versions only mean something to the server they came from.
+static void clear_seat_cache(void) {
+  for (size_t i = 0; i < CLIENT_SEAT_CACHE_SIZE; i++) {
+    drop_cached(&seat_cache[i]);
+    seat_cache[i].event_id = 0;
+  }
+}
+
+/// Unmaps the channel, removing it if the server never attached it.
+static void close_channel(void) {
+  if (channel_name[0] != '\0') {
+    shm_remove(channel_name);
+    channel_name[0] = '\0';
+  }
+  shm_detach(channel);
+  channel = NULL;
+  attached = false;
+  in_place = 0;
+}
+
 int ems_quit(void) { 
-  ssize_t ret = write(fd_req, "2", sizeof(char));
-  if (ret < 0) {
-    ems_destroy_client();
+  out.len = 0;
+  if (send_batch() || send_request(OP_CODE_QUIT, WIRE_FIXED, ++last_request_id, &out, 0)) {
     return 1;
   }
 
+  // Replies nobody waited on are dropped, the server stops at the QUIT anyway
+  stop_reader();
   close(fd_req);
-  close(fd_resp);
-
+  if (fd_resp != fd_req) close(fd_resp);
+  buffer_free(&out);
+  buffer_free(&in);
+  in_used = 0;
+  close_channel();
+  clear_seat_cache();
+  suspended = false;
+  free(server_path);
+  server_path = NULL;
+
+  if (use_socket) {
+    return 0;
+  }
 
   if (unlink(req_client_pipe) != 0 && errno != ENOENT) {
     fprintf(stdout, "ERROR unlink(%s) failed:\n", req_client_pipe);
@@ -148,8 +1340,21 @@ int ems_quit(void) {
 
 int ems_destroy_client(void) { 
 
+  stop_reader();
   close(fd_req);
-  close(fd_resp);
+  if (fd_resp != fd_req) close(fd_resp);
+  buffer_free(&out);
+  buffer_free(&in);
+  in_used = 0;
+  close_channel();
+  clear_seat_cache();
+  suspended = false;
+  free(server_path);
+  server_path = NULL;
+
+  if (use_socket) {
+    return 0;
+  }
 
   if (unlink(req_client_pipe) != 0 && errno != ENOENT) {
     fprintf(stdout, "ERROR unlink(%s) failed:\n", req_client_pipe);
@@ -165,220 +1370,188 @@ int ems_destroy_client(void) {
   return 0;
 }
 
+ems_handle_t ems_create_async(unsigned int event_id, size_t num_rows, size_t num_cols) {
+  start_payload(encoding);
+  buffer_put_uint(&out, encoding, event_id, sizeof(unsigned int));
+  buffer_put_uint(&out, encoding, num_rows, sizeof(size_t));
+  buffer_put_uint(&out, encoding, num_cols, sizeof(size_t));
+
+  return submit(OP_CODE_CREATE, encoding, -1, NULL);
+}
+
 int ems_create(unsigned int event_id, size_t num_rows, size_t num_cols) {
+  return ems_wait(ems_create_async(event_id, num_rows, num_cols));
+}
 
-  ssize_t ret = write(fd_req, "3", sizeof(char));
-  if (ret < 0) {
-    ems_destroy_client();
-    return 1;
-  }
+ems_handle_t ems_delete_async(unsigned int event_id) {
+  start_payload(encoding);
+  buffer_put_uint(&out, encoding, event_id, sizeof(unsigned int));
 
-  ret = write(fd_req, &event_id, sizeof(event_id));
-  if (ret < 0) {
-    ems_destroy_client();
-    return 1;
-  }
-  
-  ret = write(fd_req, &num_rows, sizeof(num_rows));
-  if (ret < 0) {
-    ems_destroy_client();
-    return 1;
-  }
+  return submit(OP_CODE_DELETE, encoding, -1, NULL);
+}
 
-  ret = write(fd_req, &num_cols, sizeof(num_cols));
-  if (ret < 0) {
-    ems_destroy_client();
-    return 1;
+int ems_delete(unsigned int event_id) { return ems_wait(ems_delete_async(event_id)); }
+
+ems_handle_t ems_reserve_async(unsigned int event_id, size_t num_seats, size_t* xs, size_t* ys) {
+  if (num_seats == 0 || num_seats > MAX_RESERVATION_SIZE) {
+    return 0;
   }
 
-  int success;
-  ret = read(fd_resp, &success, sizeof(int));
-  if (ret < 0) {
-    ems_destroy_client();
-    return 1;
+  // Huge coordinates could make the compact request larger than the server accepts
+  wire_encoding_t enc = encoding;
+  while (1) {
+    start_payload(enc);
+    buffer_put_uint(&out, enc, event_id, sizeof(unsigned int));
+    buffer_put_uint(&out, enc, num_seats, sizeof(size_t));
+    for (size_t i = 0; i < num_seats; i++) {
+      buffer_put_uint(&out, enc, xs[i], sizeof(size_t));
+    }
+    for (size_t i = 0; i < num_seats; i++) {
+      buffer_put_uint(&out, enc, ys[i], sizeof(size_t));
+    }
+
+    if (enc == WIRE_FIXED || out.len <= REQUEST_MAX_PAYLOAD) break;
+    enc = WIRE_FIXED;
   }
 
-  return success;
+  return submit(OP_CODE_RESERVE, enc, -1, NULL);
 }
 
 int ems_reserve(unsigned int event_id, size_t num_seats, size_t* xs, size_t* ys) {
+  return ems_wait(ems_reserve_async(event_id, num_seats, xs, ys));
+}
 
-  ssize_t ret = write(fd_req, "4", sizeof(char));
-  if (ret < 0) {
-    ems_destroy_client();
-    return 1;
-  }
-
-  ret = write(fd_req, &event_id, sizeof(event_id));
-  if (ret < 0) {
-    ems_destroy_client();
-    return 1;
-  }
-  
-  ret = write(fd_req, &num_seats, sizeof(num_seats));
-  if (ret < 0) {
-    ems_destroy_client();
-    return 1;
-  }
-  
-  ret = write(fd_req, xs, sizeof(size_t[num_seats]));
-  if (ret < 0) {
-    ems_destroy_client();
-    return 1;
-  }
-  
-  ret = write(fd_req, ys, sizeof(size_t[num_seats]));
-  if (ret < 0) {
-    ems_destroy_client();
-    return 1;
-  }
+ems_handle_t ems_show_async(int out_fd, unsigned int event_id) {
+  start_payload(encoding);
+  buffer_put_uint(&out, encoding, event_id, sizeof(unsigned int));
 
-  int success;
-  ret = read(fd_resp, &success, sizeof(int));
-  if (ret < 0) {
-    ems_destroy_client();
-    return 1;
+  // An entry holding another event is only taken over once no SHOW in flight needs it
+  struct CachedEvent *cached = &seat_cache[event_id % CLIENT_SEAT_CACHE_SIZE];
+  if (cached->event_id != event_id && cached->pins == 0) {
+    drop_cached(cached);
+    cached->event_id = event_id;
   }
+  if (cached->event_id == event_id) out_cached = cached;
+  buffer_put_uint(&out, encoding, out_cached != NULL ? out_cached->version : 0, sizeof(uint64_t));
 
-  return success;
+  return submit(OP_CODE_SHOW_SINCE, encoding, out_fd, NULL);
 }
 
-int ems_show(int out_fd, unsigned int event_id) {
-  int success;
-  size_t num_rows;
-  size_t num_cols;
+int ems_show(int out_fd, unsigned int event_id) { return ems_wait(ems_show_async(out_fd, event_id)); }
 
-  ssize_t ret = write(fd_req, "5", sizeof(char));
-  if (ret < 0) {
-    ems_destroy_client();
+int ems_select_session(uint32_t session) {
+  if (session != 0 && !sessions_offered) {
     return 1;
   }
 
-  ret = write(fd_req, &event_id, sizeof(event_id));
-  if (ret < 0) {
-    ems_destroy_client();
-    return 1;
-  }
+  logical_session = session;
+  return 0;
+}
 
-  ret = read(fd_resp, &success, sizeof(int));
-  if (ret < 0) {
-    ems_destroy_client();
-    return 1;
-  }
+void ems_batch_begin(size_t max_operations) {
+  batching = true;
+  batch_max = max_operations < BATCH_MAX_OPERATIONS ? max_operations : BATCH_MAX_OPERATIONS;
+}
 
-  if(success){
-    print_str(out_fd, "Event not found\n");
-    return success;
-  }
+int ems_batch_end(void) {
+  batching = false;
+  return send_batch();
+}
 
-  ret = read(fd_resp, &num_rows, sizeof(size_t));
-  if (ret < 0) {
-    ems_destroy_client();
+int ems_subscribe(unsigned int event_id, ems_notify_fn notify, void* arg) {
+  lock_pending();
+  notify_fn = notify;
+  notify_arg = arg;
+  unlock_pending();
+
+  start_payload(encoding);
+  buffer_put_uint(&out, encoding, event_id, sizeof(unsigned int));
+  if (ems_wait(submit(OP_CODE_SUBSCRIBE, encoding, -1, NULL))) {
     return 1;
   }
 
-  ret = read(fd_resp, &num_cols, sizeof(size_t));
-  if (ret < 0) {
+  // Notifications only arrive if something keeps reading
+  if (!reader_running && start_reader()) {
+    fprintf(stdout, "ERR: failed to start the reader thread\n");
     ems_destroy_client();
     return 1;
   }
+  return 0;
+}
 
-  unsigned int *seats = malloc(sizeof(unsigned int[num_rows*num_cols]));
+/// Fetches the page of the iterator's cursor from the server.
+/// @param iter Iterator to be filled.
+/// @return 0 if the page was fetched successfully, 1 otherwise.
+static int fetch_list_page(ems_list_iter_t* iter) {
+  start_payload(encoding);
+  buffer_put_uint(&out, encoding, iter->cursor, sizeof(unsigned int));
+  buffer_put_uint(&out, encoding, LIST_PAGE_SIZE, sizeof(size_t));
 
-  if (seats == NULL) {
-    fprintf(stdout, "ERR: failed to allocate memory\n");
-    return 1;
-  }
+  return ems_wait(submit(OP_CODE_LIST_PAGE, encoding, -1, iter));
+}
 
-  ret = read(fd_resp, seats, sizeof(unsigned int[num_rows*num_cols]));
-  if (ret < 0) {
-    ems_destroy_client();
-    return 1;
-  }
+void ems_list_iter_init(ems_list_iter_t* iter, unsigned int from) {
+  iter->cursor = from;
+  iter->last_page = 0;
+  iter->count = 0;
+  iter->pos = 0;
+}
 
-  int aux = 0;
-  for(size_t i = 1; i <= num_rows; i++) {
-    for(size_t j = 1; j <= num_cols; j++){
-      char buffer[16];
-      sprintf(buffer, "%u", seats[aux]);
-      if(print_str(out_fd, buffer)) {
-        fprintf(stdout, "Error writing to file descriptor\n");
-        free(seats);
-        return 1;
-      }
-      aux++;
-
-      if (j < num_cols) {
-        if(print_str(out_fd, " ")) {
-          fprintf(stdout, "Error writing to file descriptor\n");
-            free(seats);
-          return 1;
-        }      
-      }
+int ems_list_iter_next(ems_list_iter_t* iter, unsigned int* event_id) {
+  if (iter->pos == iter->count) {
+    if (iter->last_page) {
+      return 0;
     }
-    if(print_str(out_fd, "\n")) {
-      fprintf(stdout, "Error writing to file descriptor");
-      free(seats);
-      return 1;
-    }  
-  }
-  free(seats);
-  return success;
-}
 
-int ems_list_events(int out_fd) {
-  int success;
-  size_t num_events;
+    if (fetch_list_page(iter)) {
+      return -1;
+    }
 
-  ssize_t ret = write(fd_req, "6", sizeof(char));
-  if (ret < 0) {
-    ems_destroy_client();
-    return 1;
+    if (iter->count == 0) {
+      return 0;
+    }
   }
 
-  ret = read(fd_resp, &success, sizeof(int));
-  if (ret < 0) {
-    ems_destroy_client();
-    return 1;
-  }
+  *event_id = iter->ids[iter->pos++];
+  return 1;
+}
 
-  if(success){
-    return success;
+int ems_stats(int out_fd) {
+  start_payload(encoding);
+  return ems_wait(submit(OP_CODE_STATS, encoding, out_fd, NULL));
+}
+
+int ems_list_events(int out_fd) {
+  ems_list_iter_t iter;
+  unsigned int event_id;
+  int ret;
+  size_t num_events = 0;
+
+  // Ids are written out in one go once listed, or each time the buffer fills up
+  io_writer_t text;
+  io_writer_init(&text, out_fd, SIZE_MAX);
+  ems_list_iter_init(&iter, 0);
+  while ((ret = ems_list_iter_next(&iter, &event_id)) == 1) {
+    if (print_str(&text, "Event: ") || print_uint(&text, event_id) || print_str(&text, "\n")) {
+      fprintf(stdout, "Error writing to file descriptor");
+      return 1;
+    }
+    num_events++;
   }
 
-  ret = read(fd_resp, &num_events, sizeof(size_t));
   if (ret < 0) {
-    ems_destroy_client();
+    io_flush(&text);
     return 1;
   }
 
-  if(num_events == (size_t)0) {
-    print_str(out_fd,"No events\n");
-    return success;
+  if (num_events == 0) {
+    print_str(&text, "No events\n");
   }
 
-  unsigned int ids[num_events];
-
-  ret = read(fd_resp, ids, sizeof(unsigned int[num_events]));
-  if (ret < 0) {
-    ems_destroy_client();
+  if (io_flush(&text)) {
+    fprintf(stdout, "Error writing to file descriptor");
     return 1;
   }
 
-  for(size_t i = 0; i < num_events; i++) {
-    char buff[] = "Event: ";
-    if (print_str(out_fd, buff)) {
-      fprintf(stdout, "Error writing to file descriptor");
-      return 1;
-    }
-
-    char id[16];
-    sprintf(id, "%u\n", ids[i]);
-    if (print_str(out_fd, id)) {
-      fprintf(stdout, "Error writing to file descriptor");
-      return 1;
-    }
-  }
-
-  return success;
+  return 0;
 }
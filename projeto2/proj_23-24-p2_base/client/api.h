@@ -2,11 +2,36 @@
 #define CLIENT_API_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+#include "common/constants.h"
+
+// Iterator over the ids of the events in the server, fetched one page at a time.
+typedef struct {
+  unsigned int cursor;                // Smallest id of the next page to fetch
+  int last_page;                      // Whether the current page is the last one
+  size_t count;                       // Number of ids in the current page
+  size_t pos;                         // Position of the next id in the current page
+  unsigned int ids[LIST_PAGE_SIZE];   // Current page
+} ems_list_iter_t;
+
+// Handle of a request sent without waiting for its reply, 0 if it could not be sent. At most
+// CLIENT_MAX_IN_FLIGHT requests are in flight: sending one more waits for the reply to the
+// request CLIENT_MAX_IN_FLIGHT ids earlier, which is dropped if nobody waited on it.
+typedef uint32_t ems_handle_t;
+
+// Receives a reservation made in a subscribed event. A reservation id of 0, with no seats, tells
+// that notifications were dropped because the client fell behind, so the events must be shown again.
+// It runs on the thread reading the replies and must not call the other functions of the API.
+typedef void (*ems_notify_fn)(unsigned int event_id, unsigned int reservation_id, size_t num_seats, const size_t* xs,
+                              const size_t* ys, void* arg);
 
 /// Connects to an EMS server.
 /// @param req_pipe_path Path to the name pipe to be created for requests.
 /// @param resp_pipe_path Path to the name pipe to be created for responses.
-/// @param server_pipe_path Path to the name pipe where the server is listening.
+/// @param server_pipe_path Path to the name pipe where the server is listening, or SOCKET_PATH_PREFIX or
+/// SHM_PATH_PREFIX followed by the path of its socket, in which case the client pipes are not created.
+/// A session left by ems_suspend is resumed on its connection when the paths are the same.
 /// @return 0 if the connection was established successfully, 1 otherwise.
 int ems_setup(char const* req_pipe_path, char const* resp_pipe_path, char const* server_pipe_path);
 
@@ -14,6 +39,11 @@ int ems_setup(char const* req_pipe_path, char const* resp_pipe_path, char const*
 /// @return 0 in case of success, 1 otherwise.
 int ems_quit(void);
 
+/// Leaves the session without closing the connection, so that the next ems_setup with the same
+/// paths skips creating the pipes and the server handshake. Quits if the server does not keep sessions.
+/// @return 0 in case of success, 1 otherwise.
+int ems_suspend(void);
+
 int ems_destroy_client(void);
 
 /// Creates a new event with the given id and dimensions.
@@ -23,6 +53,11 @@ int ems_destroy_client(void);
 /// @return 0 if the event was created successfully, 1 otherwise.
 int ems_create(unsigned int event_id, size_t num_rows, size_t num_cols);
 
+/// Deletes the event with the given id.
+/// @param event_id Id of the event to be deleted.
+/// @return 0 if the event was deleted successfully, 1 otherwise.
+int ems_delete(unsigned int event_id);
+
 /// Creates a new reservation for the given event.
 /// @param event_id Id of the event to create a reservation for.
 /// @param num_seats Number of seats to reserve.
@@ -31,6 +66,67 @@ int ems_create(unsigned int event_id, size_t num_rows, size_t num_cols);
 /// @return 0 if the reservation was created successfully, 1 otherwise.
 int ems_reserve(unsigned int event_id, size_t num_seats, size_t* xs, size_t* ys);
 
+/// Sends a request to create an event without waiting for the reply.
+/// @param event_id Id of the event to be created.
+/// @param num_rows Number of rows of the event to be created.
+/// @param num_cols Number of columns of the event to be created.
+/// @return Handle of the request, 0 on failure.
+ems_handle_t ems_create_async(unsigned int event_id, size_t num_rows, size_t num_cols);
+
+/// Sends a request to delete an event without waiting for the reply.
+/// @param event_id Id of the event to be deleted.
+/// @return Handle of the request, 0 on failure.
+ems_handle_t ems_delete_async(unsigned int event_id);
+
+/// Sends a reservation without waiting for the reply.
+/// @param event_id Id of the event to create a reservation for.
+/// @param num_seats Number of seats to reserve.
+/// @param xs Array of rows of the seats to reserve.
+/// @param ys Array of columns of the seats to reserve.
+/// @return Handle of the request, 0 on failure.
+ems_handle_t ems_reserve_async(unsigned int event_id, size_t num_seats, size_t* xs, size_t* ys);
+
+/// Sends a request for an event without waiting for the reply, the event is printed by ems_wait.
+/// @param out_fd File descriptor to print the event to.
+/// @param event_id Id of the event to print.
+/// @return Handle of the request, 0 on failure.
+ems_handle_t ems_show_async(int out_fd, unsigned int event_id);
+
+/// Waits for the reply to a request and handles it like the synchronous call would.
+/// @param handle Handle of the request.
+/// @return Result of the request, 1 if it failed, was dropped or was already waited on.
+int ems_wait(ems_handle_t handle);
+
+/// Tells whether the reply to a request arrived, without waiting.
+/// @param handle Handle of the request.
+/// @return 1 if ems_wait would not block, 0 while the reply is pending, -1 if the handle is unknown.
+int ems_poll(ems_handle_t handle);
+
+/// Makes the requests sent from now on part of a logical session of the connection. Each logical
+/// session keeps the order of its own requests, requests of different ones run and are answered
+/// independently, so one connection can serve many users without taking a server session each.
+/// @param session Id of the logical session, 0 for the one of the connection.
+/// @return 0 if the logical session was selected, 1 if the server does not multiplex sessions.
+int ems_select_session(uint32_t session);
+
+/// Collects the requests sent by the *_async functions from now on into BATCH requests, each one
+/// answered by a single reply. A batch is sent once it is full, before a request that cannot join
+/// it, like a LIST, and when any request is waited on or polled.
+/// @param max_operations Largest number of requests per batch, capped at BATCH_MAX_OPERATIONS.
+void ems_batch_begin(size_t max_operations);
+
+/// Sends the requests collected and stops collecting them.
+/// @return 0 if the batch was sent, 1 otherwise.
+int ems_batch_end(void);
+
+/// Asks to be notified of the reservations made in an event, until it is deleted or the client quits.
+/// Notifications arrive while the client waits on nothing, a thread keeps reading for them.
+/// @param event_id Id of the event.
+/// @param notify Function given every notification, it replaces the one of earlier subscriptions.
+/// @param arg Last argument of notify.
+/// @return 0 if the subscription was made, 1 otherwise.
+int ems_subscribe(unsigned int event_id, ems_notify_fn notify, void* arg);
+
 /// Prints the given event to the given file.
 /// @param out_fd File descriptor to print the event to.
 /// @param event_id Id of the event to print.
@@ -42,4 +138,21 @@ int ems_show(int out_fd, unsigned int event_id);
 /// @return 0 if the events were printed successfully, 1 otherwise.
 int ems_list_events(int out_fd);
 
+/// Prints the metrics of the server: traffic, sessions, event locks and the p50, p99 and p999 latencies of
+/// CREATE, RESERVE, SHOW and LIST requests, from when the server read them until it sent the reply.
+/// @param out_fd File descriptor to print the metrics to.
+/// @return 0 if the metrics were printed successfully, 1 otherwise.
+int ems_stats(int out_fd);
+
+/// Starts iterating over the events in the server, in ascending id order.
+/// @param iter Iterator to be initialized.
+/// @param from Smallest event id to be returned.
+void ems_list_iter_init(ems_list_iter_t* iter, unsigned int from);
+
+/// Retrieves the next event id, fetching a new page from the server when needed.
+/// @param iter Iterator to be advanced.
+/// @param event_id Pointer to the variable to store the event id in.
+/// @return 1 if an id was retrieved, 0 if there are no more events, -1 on failure.
+int ems_list_iter_next(ems_list_iter_t* iter, unsigned int* event_id);
+
 #endif  // CLIENT_API_H
@@ -5,6 +5,45 @@
 
 int in_fd;
 int out_fd;
+static io_reader_t in;  // Commands are parsed from one refill of the file at a time
+
+// Requests sent and not yet waited on, oldest first, with the message printed if they fail
+static struct {
+  ems_handle_t handle;
+  const char *failure;
+} in_flight[CLIENT_MAX_IN_FLIGHT];
+static size_t first_in_flight;
+static size_t num_in_flight;
+static size_t depth = 1;       // Largest number of requests in flight, 1 runs the file synchronously
+static size_t batch_size = 1;  // Largest number of requests per BATCH message, 1 sends each one alone
+
+/// Waits for the oldest request in flight and reports whether it failed.
+static void wait_oldest(void) {
+  if (ems_wait(in_flight[first_in_flight].handle)) {
+    fprintf(stderr, "%s", in_flight[first_in_flight].failure);
+  }
+  first_in_flight = (first_in_flight + 1) % CLIENT_MAX_IN_FLIGHT;
+  num_in_flight--;
+}
+
+/// Waits for every request in flight, in the order they were sent.
+static void wait_all(void) {
+  while (num_in_flight > 0) {
+    wait_oldest();
+  }
+}
+
+/// Records a request just sent, then waits until the next one may be sent.
+/// @param handle Handle of the request.
+/// @param failure Message printed if the request fails.
+static void track(ems_handle_t handle, const char *failure) {
+  size_t last = (first_in_flight + num_in_flight++) % CLIENT_MAX_IN_FLIGHT;
+  in_flight[last].handle = handle;
+  in_flight[last].failure = failure;
+  while (num_in_flight >= depth) {
+    wait_oldest();
+  }
+}
 
 static void sig_handler(int sig) {
   if (sig == SIGINT) {
@@ -15,12 +54,37 @@ static void sig_handler(int sig) {
 }
 
 int main(int argc, char* argv[]) {
-  if (argc < 5) {
-    fprintf(stderr, "Usage: %s <request pipe path> <response pipe path> <server pipe path> <.jobs file path>\n",
+  if (argc < 5 || argc > 7) {
+    fprintf(stderr,
+            "Usage: %s <request pipe path> <response pipe path> <server pipe path> <.jobs file path> [pipeline depth] "
+            "[batch size]\n",
             argv[0]);
     return 1;
   }
 
+  // Pipelined requests are waited on in order, so the output is the same as when run synchronously
+  if (argc >= 6) {
+    char* endptr;
+    unsigned long int value = strtoul(argv[5], &endptr, 10);
+    if (*endptr != '\0' || value == 0 || value > CLIENT_MAX_IN_FLIGHT) {
+      fprintf(stderr, "Invalid pipeline depth, it must be between 1 and %d\n", CLIENT_MAX_IN_FLIGHT);
+      return 1;
+    }
+    depth = value;
+  }
+
+  // Batches are sent at the latest when their first request is waited on, so they never exceed the depth
+  if (argc == 7) {
+    char* endptr;
+    unsigned long int value = strtoul(argv[6], &endptr, 10);
+    if (*endptr != '\0' || value == 0 || value > BATCH_MAX_OPERATIONS || value > depth) {
+      fprintf(stderr, "Invalid batch size, it must be between 1 and %d and at most the pipeline depth\n",
+              BATCH_MAX_OPERATIONS);
+      return 1;
+    }
+    batch_size = value;
+  }
+
   if (ems_setup(argv[1], argv[2], argv[3])) {
     fprintf(stderr, "Failed to set up EMS\n");
     return 1;
@@ -42,6 +106,7 @@ int main(int argc, char* argv[]) {
     fprintf(stderr, "Failed to open input file. Path: %s\n", argv[4]);
     return 1;
   }
+  io_reader_init(&in, in_fd);
 
   out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
   if (out_fd == -1) {
@@ -51,52 +116,73 @@ int main(int argc, char* argv[]) {
 
   signal(SIGINT, sig_handler);
 
+  // Runs of commands between WAITs and LISTs go out as batches
+  if (batch_size > 1) {
+    ems_batch_begin(batch_size);
+  }
+
   while (1) {
     unsigned int event_id;
     size_t num_rows, num_columns, num_coords;
     unsigned int delay = 0;
     size_t xs[MAX_RESERVATION_SIZE], ys[MAX_RESERVATION_SIZE];
 
-    switch (get_next(in_fd)) {
+    switch (get_next(&in)) {
       case CMD_CREATE:
-        if (parse_create(in_fd, &event_id, &num_rows, &num_columns) != 0) {
+        if (parse_create(&in, &event_id, &num_rows, &num_columns) != 0) {
           fprintf(stderr, "Invalid command. See HELP for usage\n");
           continue;
         }
 
-        if (ems_create(event_id, num_rows, num_columns)) fprintf(stderr, "Failed to create event\n");
+        track(ems_create_async(event_id, num_rows, num_columns), "Failed to create event\n");
         break;
 
       case CMD_RESERVE:
-        num_coords = parse_reserve(in_fd, MAX_RESERVATION_SIZE, &event_id, xs, ys);
+        num_coords = parse_reserve(&in, MAX_RESERVATION_SIZE, &event_id, xs, ys);
 
         if (num_coords == 0) {
           fprintf(stderr, "Invalid command. See HELP for usage\n");
           continue;
         }
 
-        if (ems_reserve(event_id, num_coords, xs, ys)) fprintf(stderr, "Failed to reserve seats\n");
+        track(ems_reserve_async(event_id, num_coords, xs, ys), "Failed to reserve seats\n");
         break;
 
       case CMD_SHOW:
-        if (parse_show(in_fd, &event_id) != 0) {
+        if (parse_show(&in, &event_id) != 0) {
+          fprintf(stderr, "Invalid command. See HELP for usage\n");
+          continue;
+        }
+
+        track(ems_show_async(out_fd, event_id), "Failed to show event\n");
+        break;
+
+      case CMD_DELETE:
+        if (parse_delete(&in, &event_id) != 0) {
           fprintf(stderr, "Invalid command. See HELP for usage\n");
           continue;
         }
 
-        if (ems_show(out_fd, event_id)) fprintf(stderr, "Failed to show event\n");
+        track(ems_delete_async(event_id), "Failed to delete event\n");
         break;
 
       case CMD_LIST_EVENTS:
+        wait_all();
         if (ems_list_events(out_fd)) fprintf(stderr, "Failed to list events\n");
         break;
 
+      case CMD_STATS:
+        wait_all();
+        if (ems_stats(out_fd)) fprintf(stderr, "Failed to get the server stats\n");
+        break;
+
       case CMD_WAIT:
-        if (parse_wait(in_fd, &delay, NULL) == -1) {
+        if (parse_wait(&in, &delay, NULL) == -1) {
             fprintf(stderr, "Invalid command. See HELP for usage\n");
             continue;
         }
 
+        wait_all();
         if (delay > 0) {
             printf("Waiting...\n");
             sleep(delay);
@@ -113,7 +199,9 @@ int main(int argc, char* argv[]) {
             "  CREATE <event_id> <num_rows> <num_columns>\n"
             "  RESERVE <event_id> [(<x1>,<y1>) (<x2>,<y2>) ...]\n"
             "  SHOW <event_id>\n"
+            "  DELETE <event_id>\n"
             "  LIST\n"
+            "  STATS\n"
             "  WAIT <delay_ms>\n"
             "  HELP\n");
 
@@ -123,6 +211,7 @@ int main(int argc, char* argv[]) {
         break;
 
       case EOC:
+        wait_all();
         close(in_fd);
         close(out_fd);
         ems_quit();
@@ -1,7 +1,45 @@
 #define MAX_RESERVATION_SIZE 256
 #define STATE_ACCESS_DELAY_US 500000  // 500ms
 #define MAX_JOB_FILE_NAME_SIZE 256
-#define MAX_SESSION_COUNT 8
+#define EVENTS_DUMP_PATH "ems_events.dump"
+#define SNAPSHOT_INTERVAL_S 300  // Default time between two snapshots saved on their own, 0 saves none
+#define SESSION_COUNT 1024  // Default size of the session table, the server may be given any other
+#define WORKER_COUNT 8
+#define SESSION_MAX_REQUESTS 32
+#define SESSION_MAX_SUBSCRIPTIONS 16
+#define NOTIFY_MAX_PENDING 65536
+#define CLIENT_MAX_IN_FLIGHT 64
+#define CLIENT_SEAT_CACHE_SIZE 64
+#define BATCH_MAX_OPERATIONS 32
+#define SCHEDULER_DEQUE_INIT_SIZE 64
+#define SCHEDULER_INBOX_SIZE 1024
+#define EPOLL_BATCH_SIZE 64
+#define PROTOCOL_VERSION 1
+#define FRAME_HEADER_SIZE 12
+#define LOGICAL_SESSION_MAX_SIZE 5
+#define REQUEST_MAX_PAYLOAD (LOGICAL_SESSION_MAX_SIZE + sizeof(unsigned int) + sizeof(size_t) * (1 + 2 * MAX_RESERVATION_SIZE))
+#define REQUEST_MAX_SIZE (FRAME_HEADER_SIZE + REQUEST_MAX_PAYLOAD)
 #define PIPENAME_SIZE 40
+#define SOCKET_PATH_PREFIX "unix:"
+#define SOCKET_PACKET_SIZE 65536
+#define SHM_PATH_PREFIX "shm:"
+#define SHM_NAME_SIZE 64
+#define SHM_REQUEST_RING_SIZE 65536
+#define SHM_REPLY_RING_SIZE 1048576
+#define SHM_WAIT_TIMEOUT_MS 100
+#define CONNECT_RETRY_MS 1        // How often the server tries again to open the response pipe of a new client
+#define CONNECT_TIMEOUT_MS 5000   // A client that has not opened its response pipe by then is dropped
 #define INIT_SIZE 16
+#define IO_BUFFER_SIZE 4096
 #define OP_CODE 1
+#define EVENT_DENSE_INIT_SIZE 16
+#define EVENT_DENSE_MAX_ID 4096
+#define EVENT_HASH_INIT_SIZE 16
+#define EVENT_INDEX_MAX_LEVEL 16
+#define EVENT_CHANGE_LOG_SIZE 128
+#define SEAT_CHUNK_SIZE 1024  // Seats copied together by a reservation, a page of them
+#define SHOW_CHUNK_SIZE 65536
+#define HISTOGRAM_SUB_BITS 4   // 16 buckets per power of two, latencies within 1/16 of their bucket
+#define HISTOGRAM_BUCKETS 592  // Up to 2^40 ns, longer latencies go in the last bucket
+#define LIST_PAGE_SIZE 64
+#define LIST_PAGE_MAX 256
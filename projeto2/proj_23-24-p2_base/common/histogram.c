@@ -0,0 +1,21 @@
+#include "histogram.h"
+
+size_t histogram_bucket(uint64_t ns) {
+  const size_t sub_buckets = (size_t)1 << HISTOGRAM_SUB_BITS;
+  if (ns < sub_buckets) return (size_t)ns;
+
+  // Each power of two is split in sub_buckets buckets of equal width
+  unsigned int exponent = 63 - (unsigned int)__builtin_clzll(ns);
+  size_t bucket = ((size_t)(exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) +
+                  (size_t)((ns >> (exponent - HISTOGRAM_SUB_BITS)) & (sub_buckets - 1));
+  return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+uint64_t histogram_bucket_max(size_t bucket) {
+  const size_t sub_buckets = (size_t)1 << HISTOGRAM_SUB_BITS;
+  if (bucket < sub_buckets) return bucket;
+
+  unsigned int shift = (unsigned int)(bucket >> HISTOGRAM_SUB_BITS) - 1;
+  uint64_t lowest = (uint64_t)(sub_buckets + (bucket & (sub_buckets - 1))) << shift;
+  return lowest + ((uint64_t)1 << shift) - 1;
+}
@@ -0,0 +1,23 @@
+#ifndef COMMON_HISTOGRAM_H
+#define COMMON_HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+// Latency histogram buckets, shared by the server recording them and the client
+// reading them from a STATS reply. Latencies below 2^HISTOGRAM_SUB_BITS ns get a
+// bucket each, every larger power of two is split in 2^HISTOGRAM_SUB_BITS buckets.
+
+/// Gives the histogram bucket a latency is counted in.
+/// @param ns Latency in nanoseconds.
+/// @return Index of the bucket, below HISTOGRAM_BUCKETS.
+size_t histogram_bucket(uint64_t ns);
+
+/// Gives the largest latency counted in a histogram bucket.
+/// @param bucket Index of the bucket.
+/// @return Latency in nanoseconds.
+uint64_t histogram_bucket_max(size_t bucket);
+
+#endif  // COMMON_HISTOGRAM_H
@@ -2,21 +2,142 @@
 #include "constants.h"
 
 #include <limits.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-int parse_uint(int fd, unsigned int *value, char *next) {
+/// Waits until a non-blocking descriptor is ready.
+/// @param fd The file descriptor to wait for.
+/// @param events POLLIN or POLLOUT.
+/// @return 0 once it is ready, 1 if polling failed.
+static int wait_ready(int fd, short events) {
+  struct pollfd pfd = {fd, events, 0};
+  while (poll(&pfd, 1, -1) == -1) {
+    if (errno != EINTR) return 1;
+  }
+  return 0;
+}
+
+void io_reader_init(io_reader_t *reader, int fd) {
+  reader->fd = fd;
+  reader->start = 0;
+  reader->len = 0;
+}
+
+ssize_t io_read(io_reader_t *reader, void *dest, size_t size) {
+  if (reader->start == reader->len) {
+    ssize_t ret;
+    while ((ret = read(reader->fd, reader->data, sizeof(reader->data))) == -1) {
+      if (errno == EINTR) continue;
+      if ((errno != EAGAIN && errno != EWOULDBLOCK) || wait_ready(reader->fd, POLLIN)) return -1;
+    }
+    reader->start = 0;
+    reader->len = (size_t)ret;
+  }
+
+  size_t len = reader->len - reader->start;
+  if (len > size) len = size;
+  memcpy(dest, reader->data + reader->start, len);
+  reader->start += len;
+  return (ssize_t)len;
+}
+
+int read_exact(io_reader_t *reader, void *dest, size_t size) {
+  for (size_t done = 0; done < size;) {
+    ssize_t ret = io_read(reader, (char *)dest + done, size - done);
+    if (ret <= 0) return 1;
+    done += (size_t)ret;
+  }
+  return 0;
+}
+
+/// Writes parts one after the other, each system call writes as many of them as fit in max_write.
+/// @param fd The file descriptor to write to.
+/// @param parts Parts to write, at most two.
+/// @param lens Size of each part.
+/// @param num_parts Number of parts.
+/// @param max_write Largest single write.
+/// @return 0 if every part was written, 1 otherwise.
+static int write_parts(int fd, const char *const *parts, const size_t *lens, size_t num_parts, size_t max_write) {
+  size_t part = 0;
+  size_t offset = 0;  // Bytes of parts[part] already written
+
+  while (1) {
+    struct iovec iov[2];
+    int count = 0;
+    size_t total = 0;
+    for (size_t i = part, start = offset; i < num_parts && total < max_write; i++, start = 0) {
+      size_t len = lens[i] - start;
+      if (len > max_write - total) len = max_write - total;
+      if (len == 0) continue;
+
+      iov[count].iov_base = (void *)(parts[i] + start);
+      iov[count].iov_len = len;
+      count++;
+      total += len;
+    }
+    if (count == 0) return 0;
+
+    ssize_t written = writev(fd, iov, count);
+    if (written == -1 && errno == EINTR) continue;
+    if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (wait_ready(fd, POLLOUT)) return 1;
+      continue;
+    }
+    if (written == -1) {
+      return 1;
+    }
+
+    size_t left = (size_t)written;
+    while (part < num_parts && left >= lens[part] - offset) {
+      left -= lens[part] - offset;
+      part++;
+      offset = 0;
+    }
+    offset += left;
+  }
+}
+
+void io_writer_init(io_writer_t *writer, int fd, size_t max_write) {
+  writer->fd = fd;
+  writer->max_write = max_write;
+  writer->len = 0;
+}
+
+int write_all(io_writer_t *writer, const void *data, size_t size) {
+  if (size <= sizeof(writer->data) - writer->len) {
+    memcpy(writer->data + writer->len, data, size);
+    writer->len += size;
+    return 0;
+  }
+
+  const char *parts[2] = {writer->data, data};
+  size_t lens[2] = {writer->len, size};
+  writer->len = 0;
+  return write_parts(writer->fd, parts, lens, 2, writer->max_write);
+}
+
+int io_flush(io_writer_t *writer) {
+  const char *parts[1] = {writer->data};
+  size_t lens[1] = {writer->len};
+  writer->len = 0;
+  return write_parts(writer->fd, parts, lens, 1, writer->max_write);
+}
+
+int parse_uint(io_reader_t *reader, unsigned int *value, char *next) {
   char buf[16];
 
   int i = 0;
   while (1) {
-    ssize_t read_bytes = read(fd, buf + i, 1);
+    ssize_t read_bytes = io_read(reader, buf + i, 1);
     if (read_bytes == -1) {
       return 1;
     } else if (read_bytes == 0) {
       *next = '\0';
+      buf[i] = '\0';
       break;
     }
 
@@ -41,7 +162,7 @@ int parse_uint(int fd, unsigned int *value, char *next) {
   return 0;
 }
 
-int print_uint(int fd, unsigned int value) {
+int print_uint(io_writer_t *writer, unsigned int value) {
   char buffer[16];
   size_t i = 16;
 
@@ -53,31 +174,11 @@ int print_uint(int fd, unsigned int value) {
     buffer[--i] = '0';
   }
 
-  while (i < 16) {
-    ssize_t written = write(fd, buffer + i, 16 - i);
-    if (written == -1) {
-      return 1;
-    }
-
-    i += (size_t)written;
-  }
-
-  return 0;
+  return write_all(writer, buffer + i, 16 - i);
 }
 
-int print_str(int fd, const char *str) {
-  size_t len = strlen(str);
-  while (len > 0) {
-    ssize_t written = write(fd, str, len);
-    if (written == -1) {
-      return 1;
-    }
-
-    str += (size_t)written;
-    len -= (size_t)written;
-  }
-
-  return 0;
+int print_str(io_writer_t *writer, const char *str) {
+  return write_all(writer, str, strlen(str));
 }
 
 /* void build_string(char **finalstring, const char **strings, int n_strings, const size_t *string_sizes, size_t msg_size) {
@@ -95,6 +196,131 @@ int print_str(int fd, const char *str) {
   finalstring[msg_size] = '\0';
 } */
 
+int buffer_reserve(buffer_t *buffer, size_t size) {
+  if (buffer->failed) return 1;
+
+  if (buffer->len + size > buffer->capacity) {
+    if (buffer->fixed) {
+      buffer->failed = true;
+      return 1;
+    }
+
+    size_t capacity = buffer->capacity > 0 ? buffer->capacity : INIT_SIZE;
+    while (capacity < buffer->len + size) capacity *= 2;
+
+    char *grown = realloc(buffer->data, capacity);
+    if (grown == NULL) {
+      buffer->failed = true;
+      return 1;
+    }
+    buffer->data = grown;
+    buffer->capacity = capacity;
+  }
+
+  return 0;
+}
+
+int buffer_append(buffer_t *buffer, const void *data, size_t size) {
+  if (buffer_reserve(buffer, size) != 0) return 1;
+
+  memcpy(buffer->data + buffer->len, data, size);
+  buffer->len += size;
+  return 0;
+}
+
+int buffer_put_uint(buffer_t *buffer, wire_encoding_t encoding, uint64_t value, size_t size) {
+  if (encoding == WIRE_FIXED) {
+    if (size == sizeof(uint8_t)) {
+      uint8_t byte = (uint8_t)value;
+      return buffer_append(buffer, &byte, sizeof(uint8_t));
+    }
+    if (size == sizeof(uint32_t)) {
+      uint32_t narrow = (uint32_t)value;
+      return buffer_append(buffer, &narrow, sizeof(uint32_t));
+    }
+    return buffer_append(buffer, &value, sizeof(uint64_t));
+  }
+
+  // Seven bits per byte, lowest first, the high bit tells that more bytes follow
+  uint8_t bytes[10];
+  size_t len = 0;
+  do {
+    bytes[len] = (uint8_t)(value & 0x7f);
+    value >>= 7;
+    if (value != 0) bytes[len] |= 0x80;
+    len++;
+  } while (value != 0);
+
+  return buffer_append(buffer, bytes, len);
+}
+
+int take_uint(uint64_t *value, wire_encoding_t encoding, const char **src, size_t *left, size_t size) {
+  if (encoding == WIRE_FIXED) {
+    if (*left < size) return 1;
+
+    if (size == sizeof(uint8_t)) {
+      *value = (uint8_t)**src;
+    } else if (size == sizeof(uint32_t)) {
+      uint32_t narrow;
+      memcpy(&narrow, *src, sizeof(uint32_t));
+      *value = narrow;
+    } else {
+      memcpy(value, *src, sizeof(uint64_t));
+    }
+    *src += size;
+    *left -= size;
+    return 0;
+  }
+
+  uint64_t result = 0;
+  for (unsigned int shift = 0; shift < 64; shift += 7) {
+    if (*left == 0) return 1;
+
+    uint8_t byte = (uint8_t)**src;
+    (*src)++;
+    (*left)--;
+
+    result |= (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      if (size < sizeof(uint64_t) && result >> (8 * size) != 0) return 1;
+      *value = result;
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+int take_logical_session(frame_header_t *header, const char **payload, uint32_t *logical_session) {
+  wire_encoding_t encoding = (header->flags & FRAME_FLAG_COMPACT) ? WIRE_COMPACT : WIRE_FIXED;
+  size_t left = header->length;
+  uint64_t id;
+
+  if (take_uint(&id, encoding, payload, &left, sizeof(uint32_t)) || id == 0) return 1;
+  header->length = (uint32_t)left;
+  *logical_session = (uint32_t)id;
+  return 0;
+}
+
+void buffer_wrap(buffer_t *buffer, char *data, size_t capacity) {
+  *buffer = (buffer_t){.data = data, .capacity = capacity, .fixed = true};
+}
+
+void buffer_free(buffer_t *buffer) {
+  if (!buffer->fixed) free(buffer->data);
+  buffer->data = NULL;
+  buffer->len = 0;
+  buffer->capacity = 0;
+  buffer->failed = false;
+  buffer->fixed = false;
+}
+
+int write_frame(int fd, const frame_header_t *header, const void *payload, size_t max_write) {
+  const char *parts[2] = {(const char *)header, payload};
+  size_t lens[2] = {sizeof(frame_header_t), header->length};
+  return write_parts(fd, parts, lens, 2, max_write);
+}
+
 void fill_string(const char *input_string, char output_string[PIPENAME_SIZE]) {
   // Copia a string original para a nova string
   memset(output_string, '\0', PIPENAME_SIZE);
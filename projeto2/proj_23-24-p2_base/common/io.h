@@ -24,45 +24,257 @@ enum {
     OP_CODE_CREATE = '3',
     OP_CODE_RESERVE = '4',
     OP_CODE_SHOW = '5',
-    OP_CODE_LIST = '6',
+    // '6' was LIST, which sent every id in one reply, LIST_PAGE replaced it
+    OP_CODE_LIST_PAGE = '7',
+    OP_CODE_DELETE = '8',
+    OP_CODE_BATCH = '9',       // CREATE, RESERVE, SHOW, SHOW_SINCE and DELETE operations run in order, answered in one reply
+    OP_CODE_SHOW_SINCE = 'A',  // SHOW given the version of the event the client has, 0 if none
+    OP_CODE_SUBSCRIBE = 'B',   // Reservations of the event are notified to the session until it ends
+    OP_CODE_NOTIFY = 'C',      // Sent by the server with request id 0, answers no request
+    OP_CODE_STATS = 'D',       // Metrics of the server, see the layout of its reply below
 };
 
+// What follows the status and the version of the event in the reply to an OP_CODE_SHOW_SINCE
+enum {
+    SHOW_UNCHANGED = 0,  // Nothing, the seats are the ones of the version the client has
+    SHOW_DELTA = 1,      // The number of seats taken since that version, then the index and the reservation of each
+    SHOW_FULL = 2,       // The rows, the columns and the seats, like the reply to an OP_CODE_SHOW
+    SHOW_ROWS = 3,       // The rows and the columns, the seats follow row by row in the messages of the reply
+};
+
+// Header in front of every message on the client pipes, followed by length bytes of payload
+typedef struct {
+    uint8_t version;      // PROTOCOL_VERSION, a peer speaking another version is dropped
+    uint8_t opcode;
+    uint16_t flags;       // FRAME_FLAG_* bits, a reply carries the flags of its request
+    uint32_t length;
+    uint32_t request_id;  // Chosen by the client, echoed by the reply
+} frame_header_t;
+
+_Static_assert(sizeof(frame_header_t) == FRAME_HEADER_SIZE, "frame header must not be padded");
+
+// The payload uses WIRE_COMPACT, only sent once the server offered it during the handshake
+#define FRAME_FLAG_COMPACT 0x1
+// The payload starts with the id of a logical session, a uint32_t other than 0 in the encoding of the
+// frame. Requests of different logical sessions of a connection are not ordered with each other
+#define FRAME_FLAG_SESSION 0x2
+// On a QUIT, the server keeps the connection and the session id, the only message it then
+// accepts is an empty OP_CODE_CLIENT request, answered like the setup, which resumes the session
+#define FRAME_FLAG_RESUME 0x4
+// Only sent by the server, the reply goes on in the next message with the same request id. Each message of a
+// SHOW_ROWS reply holds whole rows, runs of compact seats never cross them, so the client prints it as it arrives
+#define FRAME_FLAG_MORE 0x8
+
+// Encoding of the integers in a payload
+typedef enum {
+    WIRE_FIXED,    // Every field is the native integer of its C type
+    WIRE_COMPACT,  // Every field is an unsigned LEB128 varint, seats are run-length and ids delta encoded
+} wire_encoding_t;
+
+// An OP_CODE_NOTIFY payload holds a uint8_t set if notifications were dropped before these because
+// the client fell behind, the number of notifications, then the event id, the reservation id, the
+// number of seats, the rows and the columns of each reservation, in the encoding of the SUBSCRIBE
+
+// Operations with a latency histogram in an OP_CODE_STATS reply, in the order they are sent
+enum {
+    STATS_CREATE,
+    STATS_RESERVE,
+    STATS_SHOW,     // SHOW and SHOW_SINCE
+    STATS_LIST,     // LIST_PAGE
+    STATS_NUM_OPS,
+};
+
+// An OP_CODE_STATS reply holds the status, then uint64_t fields: the number of requests, the bytes received and
+// sent, the times an event mutex was taken, the nanoseconds spent waiting for and holding them, the longest one
+// was held for, and the sessions connected. Then, for each operation, the number of histogram buckets that are not empty as a size_t and the
+// index, a uint32_t, and the number of requests, a uint64_t, of each, in the encoding of the request
+
+// Growable in-memory byte buffer
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+    bool failed;  // Set once an append could not allocate, the contents are then incomplete
+    bool fixed;   // data is memory the buffer does not own, an append past the capacity fails instead of growing
+} buffer_t;
+
+// Buffered reading side of a file descriptor, small fields are taken from one refill instead of a read each
+typedef struct {
+    int fd;
+    size_t start;  // Bytes of data already taken
+    size_t len;    // Bytes of data read from the descriptor
+    char data[IO_BUFFER_SIZE];
+} io_reader_t;
+
+// Buffered writing side of a file descriptor, writes are kept until the buffer fills up or is flushed
+typedef struct {
+    int fd;
+    size_t max_write;  // Largest single write, like the one of write_frame
+    size_t len;        // Bytes of data not written yet
+    char data[IO_BUFFER_SIZE];
+} io_writer_t;
+
+struct Task;
+struct ShmChannel;
+
+// Lifecycle of a server session
+typedef enum {
+    SESSION_FREE,        // Unused, in the free stack
+    SESSION_CONNECTING,  // Registered, the pipes may still be opening and the handshake has not run yet
+    SESSION_READING,     // The request pipe is watched or being read
+    SESSION_PAUSED,      // SESSION_MAX_REQUESTS are pending, reading resumes once replies are sent
+    SESSION_DRAINING,    // No more requests will be read, the pipes close once every reply is sent
+} session_state_t;
+
+// Entry of the server session table
 typedef struct {
     int session_id;
 
-    int fd_req;
+    int fd_req;   // Non-blocking once the handshake is done
     int fd_resp;
+    uint64_t connect_deadline_ns;  // Pipes only, when the event loop stops waiting for the client to open them
+    struct ShmChannel *shm;  // Carries requests and replies in shm mode, the connection then only wakes the server
+    io_writer_t out;         // Replies written on fd_resp, protected by lock and flushed before it is released
+
+    char in[REQUEST_MAX_SIZE];  // Bytes of requests not yet complete, only touched by the read task
+    size_t in_len;
+    struct Task *io_task;  // Runs the step of the current state, at most once at a time
+
+    pthread_mutex_t lock;      // Protects the fields below
+    session_state_t state;
+    bool broken;               // A reply could not be built or sent, later replies are dropped until the client leaves
+    bool parked;               // Quit keeping the connection, waiting for the client to resume the session
+    struct Task *head;         // Requests whose reply was not sent yet, in arrival order
+    struct Task *tail;
+    size_t num_requests;
 
-    char opcode;
-    bool to_execute;
-    bool client_was_used;
+    unsigned int subscriptions[SESSION_MAX_SUBSCRIPTIONS];  // Events subscribed, protected by lock
+    size_t num_subscriptions;
 
-    pthread_t tid;
-    pthread_mutex_t lock;
-    pthread_cond_t cond;
+    // Reservers queue notifications without waiting for the session, notify_task sends them
+    pthread_mutex_t notify_lock;  // Protects the fields below, never held while writing
+    buffer_t notices;             // Notifications not sent yet, at most NOTIFY_MAX_PENDING bytes
+    size_t num_notices;
+    bool notices_dropped;         // Notifications were dropped since the last ones sent
+    bool notify_pending;          // notify_task is submitted or running
+    wire_encoding_t notify_encoding;
+    struct Task *notify_task;
 
     char req_client_pipe[PIPENAME_SIZE];
     char resp_client_pipe[PIPENAME_SIZE];
 } worker_client_t;
 
-/// Parses an unsigned integer from the given file descriptor.
-/// @param fd The file descriptor to read from.
+/// Appends bytes to a buffer, growing it when needed.
+/// @param buffer Buffer to append to.
+/// @param data Bytes to append.
+/// @param size Number of bytes to append.
+/// @return 0 if the bytes were appended, 1 otherwise.
+int buffer_append(buffer_t *buffer, const void *data, size_t size);
+
+/// Makes room for more bytes at the end of a buffer.
+/// @param buffer Buffer to grow.
+/// @param size Number of bytes that must fit after the current contents.
+/// @return 0 if the room was made, 1 otherwise.
+int buffer_reserve(buffer_t *buffer, size_t size);
+
+/// Appends an unsigned integer field to a buffer.
+/// @param buffer Buffer to append to.
+/// @param encoding Encoding of the payload being built.
+/// @param value Value of the field, it must fit in size bytes.
+/// @param size Size of the field in WIRE_FIXED, sizeof(uint8_t), sizeof(uint32_t) or sizeof(uint64_t).
+/// @return 0 if the field was appended, 1 otherwise.
+int buffer_put_uint(buffer_t *buffer, wire_encoding_t encoding, uint64_t value, size_t size);
+
+/// Reads an unsigned integer field and moves past it.
+/// @param value Variable to store the value in.
+/// @param encoding Encoding of the payload being read.
+/// @param src Start of the field, moved past it.
+/// @param left Bytes left in the payload, reduced by the size of the field.
+/// @param size Size of the field in WIRE_FIXED, the value must also fit in it in WIRE_COMPACT.
+/// @return 0 if the payload holds a valid field, 1 otherwise.
+int take_uint(uint64_t *value, wire_encoding_t encoding, const char **src, size_t *left, size_t size);
+
+/// Takes the logical session a message with FRAME_FLAG_SESSION starts with.
+/// @param header Header of the message, its length becomes the one of the payload after the id.
+/// @param payload Start of the payload, moved past the id.
+/// @param logical_session Variable to store the id in.
+/// @return 0 if the payload starts with a valid id, 1 otherwise.
+int take_logical_session(frame_header_t *header, const char **payload, uint32_t *logical_session);
+
+/// Sets up an empty buffer over memory it does not own, see buffer_t.fixed.
+/// @param buffer Buffer to set up.
+/// @param data Memory the bytes are appended to.
+/// @param capacity Size of the memory.
+void buffer_wrap(buffer_t *buffer, char *data, size_t capacity);
+
+/// Frees the contents of a buffer and leaves it empty.
+/// @param buffer Buffer to be freed.
+void buffer_free(buffer_t *buffer);
+
+/// Sets up an empty reader.
+/// @param reader Reader to set up.
+/// @param fd The file descriptor to read from, if it is non-blocking reads wait for it.
+void io_reader_init(io_reader_t *reader, int fd);
+
+/// Reads the bytes buffered, refilling the buffer once if it is empty.
+/// @param reader Reader to read from.
+/// @param dest Where the bytes go.
+/// @param size Largest number of bytes to read.
+/// @return Number of bytes read, 0 at the end of the file, -1 on failure.
+ssize_t io_read(io_reader_t *reader, void *dest, size_t size);
+
+/// Reads exactly the given number of bytes, refilling the buffer as often as needed.
+/// @param reader Reader to read from.
+/// @param dest Where the bytes go.
+/// @param size Number of bytes to read.
+/// @return 0 if every byte was read, 1 if the file ended or a read failed first.
+int read_exact(io_reader_t *reader, void *dest, size_t size);
+
+/// Sets up an empty writer.
+/// @param writer Writer to set up.
+/// @param fd The file descriptor to write to, if it is non-blocking writes wait for it.
+/// @param max_write Largest single write, SIZE_MAX on pipes and files.
+void io_writer_init(io_writer_t *writer, int fd, size_t max_write);
+
+/// Writes bytes through the buffer. Bytes that do not fit are written along with the buffer in one system call.
+/// @param writer Writer to write to.
+/// @param data Bytes to write.
+/// @param size Number of bytes to write.
+/// @return 0 if the bytes were buffered or written, 1 otherwise.
+int write_all(io_writer_t *writer, const void *data, size_t size);
+
+/// Writes the bytes buffered, the buffer is empty afterwards even if the write failed.
+/// @param writer Writer to flush.
+/// @return 0 if the bytes were written, 1 otherwise.
+int io_flush(io_writer_t *writer);
+
+/// Parses an unsigned integer from the given reader.
+/// @param reader The reader to read from.
 /// @param value Pointer to the variable to store the value in.
 /// @param next Pointer to the variable to store the next character in.
 /// @return 0 if the integer was read successfully, 1 otherwise.
-int parse_uint(int fd, unsigned int *value, char *next);
+int parse_uint(io_reader_t *reader, unsigned int *value, char *next);
 
-/// Prints an unsigned integer to the given file descriptor.
-/// @param fd The file descriptor to write to.
+/// Prints an unsigned integer to the given writer.
+/// @param writer The writer to write to.
 /// @param value The value to write.
 /// @return 0 if the integer was written successfully, 1 otherwise.
-int print_uint(int fd, unsigned int value);
+int print_uint(io_writer_t *writer, unsigned int value);
 
-/// Writes a string to the given file descriptor.
-/// @param fd The file descriptor to write to.
+/// Writes a string to the given writer.
+/// @param writer The writer to write to.
 /// @param str The string to write.
 /// @return 0 if the string was written successfully, 1 otherwise.
-int print_str(int fd, const char *str);
+int print_str(io_writer_t *writer, const char *str);
+
+/// Writes a message with a single system call, retrying only if it is cut short.
+/// @param fd The file descriptor to write to.
+/// @param header Header of the message, its length is the size of the payload.
+/// @param payload Payload of the message.
+/// @param max_write Largest single write, SIZE_MAX on pipes. On SOCK_SEQPACKET sockets every write
+/// is one packet, which must fit in the send buffer, so longer messages are split.
+/// @return 0 if the message was written successfully, 1 otherwise.
+int write_frame(int fd, const frame_header_t *header, const void *payload, size_t max_write);
 
 //void build_string(char **finalstring, const char **strings, int n_strings, const size_t *string_sizes, size_t msg_size);
 
@@ -0,0 +1,247 @@
+// syscall() is only declared with the GNU extensions
+#define _GNU_SOURCE
+
+#include "shm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static atomic_uint next_channel;  // Makes the names of the channels of a process unique
+
+static shm_ring_t *ring_of(shm_channel_t *channel, shm_dir_t dir, char **data, uint32_t *size) {
+  if (dir == SHM_REQUESTS) {
+    *data = channel->request_data;
+    *size = SHM_REQUEST_RING_SIZE;
+    return &channel->requests;
+  }
+  *data = channel->reply_data;
+  *size = SHM_REPLY_RING_SIZE;
+  return &channel->replies;
+}
+
+/// Sleeps while a futex word holds the given value, for at most SHM_WAIT_TIMEOUT_MS.
+static void futex_wait(_Atomic uint32_t *word, uint32_t value) {
+  struct timespec timeout = {0, SHM_WAIT_TIMEOUT_MS * 1000000L};
+  // The word lives in memory shared by two processes, so the futex must not be private
+  syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *word) { syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, 1, NULL, NULL, 0); }
+
+/// Tells whether the other side closed its end of the connection.
+static bool peer_gone(int peer_fd) {
+  struct pollfd pfd = {.fd = peer_fd, .events = 0, .revents = 0};
+  return poll(&pfd, 1, 0) < 0 || (pfd.revents & (POLLHUP | POLLERR | POLLNVAL)) != 0;
+}
+
+/// Sleeps until a position moves away from the given value or the peer leaves.
+/// @param position Position the other side moves.
+/// @param waiting Flag telling the other side to wake this one.
+/// @param value Position seen before sleeping.
+/// @return 0 once the position moved, 1 if the peer is gone.
+static int wait_for(_Atomic uint32_t *position, _Atomic uint32_t *waiting, uint32_t value, int peer_fd) {
+  while (1) {
+    // The other side reads the flag after moving the position, so one of the two sees the other
+    atomic_store(waiting, 1);
+    if (atomic_load(position) != value) {
+      atomic_store(waiting, 0);
+      return 0;
+    }
+
+    futex_wait(position, value);
+    if (atomic_load(position) != value) {
+      atomic_store(waiting, 0);
+      return 0;
+    }
+    if (peer_gone(peer_fd)) return 1;
+  }
+}
+
+shm_channel_t *shm_create(char name[SHM_NAME_SIZE]) {
+  snprintf(name, SHM_NAME_SIZE, "/ems-%ld-%u", (long)getpid(), atomic_fetch_add(&next_channel, 1));
+
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd == -1) return NULL;
+
+  if (ftruncate(fd, sizeof(shm_channel_t)) != 0) {
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+  }
+
+  // A new object is zero-filled, so both rings start empty
+  shm_channel_t *channel = mmap(NULL, sizeof(shm_channel_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (channel == MAP_FAILED) {
+    shm_unlink(name);
+    return NULL;
+  }
+  return channel;
+}
+
+shm_channel_t *shm_attach(const char *name) {
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd == -1) return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size != sizeof(shm_channel_t)) {
+    close(fd);
+    return NULL;
+  }
+
+  shm_channel_t *channel = mmap(NULL, sizeof(shm_channel_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  return channel == MAP_FAILED ? NULL : channel;
+}
+
+void shm_remove(const char *name) { shm_unlink(name); }
+
+void shm_detach(shm_channel_t *channel) {
+  if (channel != NULL) munmap(channel, sizeof(shm_channel_t));
+}
+
+/// Moves the tail of a ring and wakes its consumer if it sleeps.
+/// @param ring Ring written to.
+/// @param tail New tail.
+/// @param woken Set if the consumer was woken.
+static void publish(shm_ring_t *ring, uint32_t tail, bool *woken) {
+  atomic_store(&ring->tail, tail);
+  if (atomic_load(&ring->consumer_waiting) && atomic_exchange(&ring->consumer_waiting, 0)) {
+    futex_wake(&ring->tail);
+    *woken = true;
+  }
+}
+
+int shm_write(shm_channel_t *channel, shm_dir_t dir, const void *src, size_t len, int peer_fd, bool *woken) {
+  char *data;
+  uint32_t size;
+  shm_ring_t *ring = ring_of(channel, dir, &data, &size);
+  const char *bytes = src;
+
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  while (len > 0) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == size) {
+      if (wait_for(&ring->head, &ring->producer_waiting, head, peer_fd) != 0) return 1;
+      continue;
+    }
+
+    // Copies up to the end of the free space or of the ring memory, whichever comes first
+    uint32_t offset = tail & (size - 1);
+    size_t chunk = size - (tail - head);
+    if (chunk > size - offset) chunk = size - offset;
+    if (chunk > len) chunk = len;
+
+    memcpy(data + offset, bytes, chunk);
+    bytes += chunk;
+    len -= chunk;
+    tail += (uint32_t)chunk;
+
+    // Publishing each chunk lets the consumer drain a message longer than the ring
+    publish(ring, tail, woken);
+  }
+
+  return 0;
+}
+
+char *shm_reserve(shm_channel_t *channel, shm_dir_t dir, size_t len) {
+  char *data;
+  uint32_t size;
+  shm_ring_t *ring = ring_of(channel, dir, &data, &size);
+
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  uint32_t offset = tail & (size - 1);
+  if (len > size - (tail - head) || len > size - offset) return NULL;
+  return data + offset;
+}
+
+void shm_commit(shm_channel_t *channel, shm_dir_t dir, size_t len, bool *woken) {
+  char *data;
+  uint32_t size;
+  shm_ring_t *ring = ring_of(channel, dir, &data, &size);
+
+  publish(ring, atomic_load_explicit(&ring->tail, memory_order_relaxed) + (uint32_t)len, woken);
+}
+
+size_t shm_read(shm_channel_t *channel, shm_dir_t dir, char *dest, size_t room) {
+  size_t copied = 0;
+
+  while (copied < room) {
+    const char *data;
+    size_t to_end;
+    size_t available = shm_peek(channel, dir, &data, &to_end);
+    if (available == 0) break;
+
+    size_t chunk = available < room - copied ? available : room - copied;
+    memcpy(dest + copied, data, chunk);
+    shm_consume(channel, dir, chunk);
+    copied += chunk;
+  }
+
+  return copied;
+}
+
+size_t shm_peek(shm_channel_t *channel, shm_dir_t dir, const char **data, size_t *to_end) {
+  char *base;
+  uint32_t size;
+  shm_ring_t *ring = ring_of(channel, dir, &base, &size);
+
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  uint32_t offset = head & (size - 1);
+
+  *data = base + offset;
+  *to_end = size - offset;
+  size_t available = tail - head;
+  return available < *to_end ? available : *to_end;
+}
+
+void shm_consume(shm_channel_t *channel, shm_dir_t dir, size_t len) {
+  char *data;
+  uint32_t size;
+  shm_ring_t *ring = ring_of(channel, dir, &data, &size);
+
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  atomic_store(&ring->head, head + (uint32_t)len);
+  if (atomic_load(&ring->producer_waiting) && atomic_exchange(&ring->producer_waiting, 0)) {
+    futex_wake(&ring->head);
+  }
+}
+
+int shm_wait(shm_channel_t *channel, shm_dir_t dir, size_t seen, int peer_fd) {
+  char *data;
+  uint32_t size;
+  shm_ring_t *ring = ring_of(channel, dir, &data, &size);
+
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  return wait_for(&ring->tail, &ring->consumer_waiting, head + (uint32_t)seen, peer_fd);
+}
+
+bool shm_sleep(shm_channel_t *channel, shm_dir_t dir) {
+  char *data;
+  uint32_t size;
+  shm_ring_t *ring = ring_of(channel, dir, &data, &size);
+
+  atomic_store(&ring->consumer_waiting, 1);
+  if (atomic_load(&ring->tail) != atomic_load_explicit(&ring->head, memory_order_relaxed)) {
+    atomic_store(&ring->consumer_waiting, 0);
+    return false;
+  }
+  return true;
+}
+
+void shm_interrupt(shm_channel_t *channel, shm_dir_t dir) {
+  char *data;
+  uint32_t size;
+  futex_wake(&ring_of(channel, dir, &data, &size)->tail);
+}
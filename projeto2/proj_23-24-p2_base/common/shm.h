@@ -0,0 +1,117 @@
+#ifndef COMMON_SHM_H
+#define COMMON_SHM_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+// Shared-memory channel of a session: one ring per direction, each a byte
+// stream with a single producer and a single consumer. Positions only grow
+// and wrap at 2^32, the ring sizes are powers of two. A side that finds its
+// ring empty or full sets the matching waiting flag and sleeps on a futex,
+// the other side wakes it only when the flag is set.
+
+typedef enum { SHM_REQUESTS, SHM_REPLIES } shm_dir_t;
+
+typedef struct {
+  _Atomic uint32_t head;              // Bytes consumed, only moved by the consumer
+  _Atomic uint32_t tail;              // Bytes produced, only moved by the producer
+  _Atomic uint32_t consumer_waiting;  // The consumer sleeps until tail moves
+  _Atomic uint32_t producer_waiting;  // The producer sleeps until head moves
+} shm_ring_t;
+
+typedef struct ShmChannel {
+  shm_ring_t requests;
+  shm_ring_t replies;
+  char request_data[SHM_REQUEST_RING_SIZE];
+  char reply_data[SHM_REPLY_RING_SIZE];
+} shm_channel_t;
+
+/// Creates and maps a new channel, to be attached by the server.
+/// @param name Set to the name of the shared memory object, to be unlinked once the server attached.
+/// @return Mapped channel, NULL on failure.
+shm_channel_t *shm_create(char name[SHM_NAME_SIZE]);
+
+/// Maps the channel created by a client.
+/// @param name Name of the shared memory object.
+/// @return Mapped channel, NULL on failure.
+shm_channel_t *shm_attach(const char *name);
+
+/// Removes the name of a channel, its memory lives on while it is mapped.
+/// @param name Name of the shared memory object.
+void shm_remove(const char *name);
+
+/// Unmaps a channel.
+/// @param channel Channel to be unmapped, may be NULL.
+void shm_detach(shm_channel_t *channel);
+
+/// Copies bytes into a ring, sleeping while it is full.
+/// @param channel Channel to write to.
+/// @param dir Ring to write to.
+/// @param src Bytes to be written.
+/// @param len Number of bytes.
+/// @param peer_fd Connection to the other side, checked while sleeping so a gone peer is noticed.
+/// @param woken Set if the consumer was sleeping and was woken, left untouched otherwise.
+/// @return 0 if every byte was written, 1 if the peer is gone.
+int shm_write(shm_channel_t *channel, shm_dir_t dir, const void *src, size_t len, int peer_fd, bool *woken);
+
+/// Gives room at the end of a ring to build bytes in place, without sleeping.
+/// @note The room must be contiguous in the ring memory, a message that would wrap is written with shm_write.
+/// @param channel Channel to write to.
+/// @param dir Ring to write to.
+/// @param len Number of bytes to make room for.
+/// @return Start of the room, NULL if the ring has no contiguous room for len bytes right now.
+char *shm_reserve(shm_channel_t *channel, shm_dir_t dir, size_t len);
+
+/// Publishes bytes built in the room given by shm_reserve.
+/// @param channel Channel written to.
+/// @param dir Ring written to.
+/// @param len Number of bytes built, at most the room reserved.
+/// @param woken Set if the consumer was sleeping and was woken, left untouched otherwise.
+void shm_commit(shm_channel_t *channel, shm_dir_t dir, size_t len, bool *woken);
+
+/// Copies the bytes available in a ring, without sleeping.
+/// @param channel Channel to read from.
+/// @param dir Ring to read from.
+/// @param dest Where the bytes go.
+/// @param room Largest number of bytes to copy.
+/// @return Number of bytes copied.
+size_t shm_read(shm_channel_t *channel, shm_dir_t dir, char *dest, size_t room);
+
+/// Gives the bytes available in a ring that are contiguous in memory, to be read in place.
+/// @param channel Channel to read from.
+/// @param dir Ring to read from.
+/// @param data Set to the oldest byte not yet consumed.
+/// @param to_end Set to the number of bytes from data to the end of the ring memory.
+/// @return Number of bytes readable at data.
+size_t shm_peek(shm_channel_t *channel, shm_dir_t dir, const char **data, size_t *to_end);
+
+/// Releases bytes read in place.
+/// @param channel Channel read from.
+/// @param dir Ring read from.
+/// @param len Number of bytes released.
+void shm_consume(shm_channel_t *channel, shm_dir_t dir, size_t len);
+
+/// Sleeps until more than the given number of bytes is available in a ring.
+/// @param channel Channel to wait on.
+/// @param dir Ring to wait on.
+/// @param seen Number of bytes already available.
+/// @param peer_fd Connection to the other side, checked while sleeping so a gone peer is noticed.
+/// @return 0 once more bytes are available, 1 if the peer is gone.
+int shm_wait(shm_channel_t *channel, shm_dir_t dir, size_t seen, int peer_fd);
+
+/// Marks the consumer of an empty ring as about to sleep, to be woken by the next write.
+/// @param channel Channel to be checked.
+/// @param dir Ring to be checked.
+/// @return true if the ring is still empty and the consumer may sleep, false if bytes arrived.
+bool shm_sleep(shm_channel_t *channel, shm_dir_t dir);
+
+/// Wakes the consumer of a ring sleeping in shm_wait, which then checks whether the peer is gone.
+/// @param channel Channel whose consumer is woken.
+/// @param dir Ring the consumer waits on.
+void shm_interrupt(shm_channel_t *channel, shm_dir_t dir);
+
+#endif  // COMMON_SHM_H
@@ -0,0 +1,147 @@
+#include "epoch.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Announcement of one thread, records are never freed but are reused once their thread exits
+struct EpochRecord {
+  _Atomic unsigned long state;  // (epoch << 1) | 1 while inside a section, 0 otherwise
+  atomic_bool in_use;           // Whether a thread owns the record
+  struct EpochRecord* next;     // Next record, the list only grows
+};
+
+// Object waiting for every reader of its epoch to leave
+struct Retired {
+  void* ptr;
+  void (*free_fn)(void*);
+  unsigned long epoch;  // Epoch in which the object was retired
+  struct Retired* next;
+};
+
+static _Atomic unsigned long global_epoch = 1;
+static _Atomic(struct EpochRecord*) records = NULL;
+
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct Retired* limbo = NULL;
+
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+
+static _Thread_local struct EpochRecord* self = NULL;
+static _Thread_local unsigned int nesting = 0;
+
+static void release_record(void* arg) {
+  struct EpochRecord* record = (struct EpochRecord*)arg;
+  atomic_store(&record->state, 0);
+  atomic_store(&record->in_use, false);
+}
+
+static void create_record_key(void) {
+  if (pthread_key_create(&record_key, release_record) != 0) {
+    fprintf(stderr, "Error creating epoch key\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/// Gives the calling thread a record, reusing one left by a finished thread when possible.
+/// @return Record owned by the calling thread.
+static struct EpochRecord* acquire_record(void) {
+  pthread_once(&record_key_once, create_record_key);
+
+  struct EpochRecord* record;
+  for (record = atomic_load(&records); record != NULL; record = record->next) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&record->in_use, &expected, true)) break;
+  }
+
+  if (record == NULL) {
+    record = malloc(sizeof(struct EpochRecord));
+    if (record == NULL) {
+      fprintf(stderr, "Error allocating memory for epoch record\n");
+      exit(EXIT_FAILURE);
+    }
+
+    atomic_init(&record->state, 0);
+    atomic_init(&record->in_use, true);
+    record->next = atomic_load(&records);
+    while (!atomic_compare_exchange_weak(&records, &record->next, record))
+      ;
+  }
+
+  pthread_setspecific(record_key, record);
+  return record;
+}
+
+void epoch_enter(void) {
+  if (nesting++ > 0) return;
+  if (self == NULL) self = acquire_record();
+
+  unsigned long epoch = atomic_load(&global_epoch);
+  atomic_store(&self->state, (epoch << 1) | 1);
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit(void) {
+  if (--nesting > 0) return;
+  atomic_store_explicit(&self->state, 0, memory_order_release);
+}
+
+/// Moves to the next epoch if every active reader already runs in the current one.
+/// @note Must be called with retire_lock held.
+/// @return The current epoch.
+static unsigned long try_advance(void) {
+  unsigned long epoch = atomic_load(&global_epoch);
+
+  for (struct EpochRecord* record = atomic_load(&records); record != NULL; record = record->next) {
+    unsigned long state = atomic_load(&record->state);
+    if ((state & 1) && (state >> 1) != epoch) return epoch;
+  }
+
+  atomic_store(&global_epoch, epoch + 1);
+  return epoch + 1;
+}
+
+void epoch_retire(void* ptr, void (*free_fn)(void*)) {
+  struct Retired* retired = malloc(sizeof(struct Retired));
+  if (retired == NULL) {
+    fprintf(stderr, "Error allocating memory for retired object\n");
+    exit(EXIT_FAILURE);
+  }
+
+  retired->ptr = ptr;
+  retired->free_fn = free_fn;
+
+  pthread_mutex_lock(&retire_lock);
+  retired->epoch = atomic_load(&global_epoch);
+  retired->next = limbo;
+  limbo = retired;
+
+  // Readers that entered two epochs ago or earlier have all left
+  unsigned long epoch = try_advance();
+  struct Retired** current = &limbo;
+  while (*current) {
+    struct Retired* item = *current;
+    if (item->epoch + 2 <= epoch) {
+      *current = item->next;
+      item->free_fn(item->ptr);
+      free(item);
+    } else {
+      current = &item->next;
+    }
+  }
+  pthread_mutex_unlock(&retire_lock);
+}
+
+void epoch_shutdown(void) {
+  pthread_mutex_lock(&retire_lock);
+  while (limbo) {
+    struct Retired* item = limbo;
+    limbo = item->next;
+    item->free_fn(item->ptr);
+    free(item);
+  }
+  pthread_mutex_unlock(&retire_lock);
+}
@@ -0,0 +1,26 @@
+#ifndef SERVER_EPOCH_H
+#define SERVER_EPOCH_H
+
+// Epoch-based reclamation: readers announce the epoch they run in and never
+// take locks, writers unlink memory and retire it, and retired memory is
+// only freed once every reader that could still see it has left.
+
+/// Marks the calling thread as inside a read-side critical section.
+/// @note Sections may be nested, pointers read from shared structures can
+/// only be used until the matching epoch_exit.
+void epoch_enter(void);
+
+/// Leaves the read-side critical section entered with epoch_enter.
+void epoch_exit(void);
+
+/// Defers freeing an object until no reader can hold a reference to it.
+/// @note The object must already be unreachable for new readers.
+/// @param ptr Object to be freed.
+/// @param free_fn Function used to free the object.
+void epoch_retire(void *ptr, void (*free_fn)(void *));
+
+/// Frees every retired object.
+/// @note Must only be called when no thread is inside a read-side section.
+void epoch_shutdown(void);
+
+#endif  // SERVER_EPOCH_H
@@ -3,14 +3,203 @@
 #include <pthread.h>
 #include <stdlib.h>
 
+#include "common/constants.h"
+#include "epoch.h"
+
+/// Allocates a dense index able to hold ids in [0, capacity).
+/// @param capacity Number of slots.
+/// @return Newly created dense index, NULL on failure.
+static struct DenseIndex* create_dense(size_t capacity) {
+  struct DenseIndex* dense = malloc(sizeof(struct DenseIndex) + capacity * sizeof(_Atomic(struct Event*)));
+  if (!dense) return NULL;
+
+  dense->capacity = capacity;
+  for (size_t i = 0; i < capacity; i++) {
+    atomic_init(&dense->slots[i], NULL);
+  }
+  return dense;
+}
+
+/// Grows the dense index so that it can hold the given id.
+/// @note The new table is fully built before being published, the old one is
+/// retired since readers may still be using it.
+/// @param list Event list to be modified.
+/// @param event_id Id that must fit in the table.
+/// @return 0 if the table was grown successfully, 1 otherwise.
+static int grow_dense(struct EventList* list, unsigned int event_id) {
+  struct DenseIndex* old = atomic_load_explicit(&list->dense, memory_order_relaxed);
+
+  size_t capacity = old->capacity;
+  while (capacity <= event_id) capacity *= 2;
+  if (capacity > EVENT_DENSE_MAX_ID) capacity = EVENT_DENSE_MAX_ID;
+
+  struct DenseIndex* dense = create_dense(capacity);
+  if (!dense) return 1;
+
+  for (size_t i = 0; i < old->capacity; i++) {
+    struct Event* event = atomic_load_explicit(&old->slots[i], memory_order_relaxed);
+    atomic_store_explicit(&dense->slots[i], event, memory_order_relaxed);
+  }
+
+  atomic_store_explicit(&list->dense, dense, memory_order_release);
+  epoch_retire(old, free);
+  return 0;
+}
+
+/// Allocates an empty hash table.
+/// @param num_buckets Number of buckets.
+/// @return Newly created hash table, NULL on failure.
+static struct HashTable* create_hash(size_t num_buckets) {
+  struct HashTable* hash = malloc(sizeof(struct HashTable) + num_buckets * sizeof(_Atomic(struct HashEntry*)));
+  if (!hash) return NULL;
+
+  hash->num_buckets = num_buckets;
+  hash->size = 0;
+  for (size_t i = 0; i < num_buckets; i++) {
+    atomic_init(&hash->buckets[i], NULL);
+  }
+  return hash;
+}
+
+static void free_hash(void* arg) {
+  struct HashTable* hash = (struct HashTable*)arg;
+  for (size_t i = 0; i < hash->num_buckets; i++) {
+    struct HashEntry* current = atomic_load_explicit(&hash->buckets[i], memory_order_relaxed);
+    while (current) {
+      struct HashEntry* next = atomic_load_explicit(&current->next, memory_order_relaxed);
+      free(current);
+      current = next;
+    }
+  }
+  free(hash);
+}
+
+/// Doubles the number of buckets of the hash table.
+/// @note Entries are copied rather than relinked, readers walking the old
+/// chains are never disturbed and the old table is retired.
+/// @param list Event list to be modified.
+/// @return 0 if the table was grown successfully, 1 otherwise.
+static int grow_hash(struct EventList* list) {
+  struct HashTable* old = atomic_load_explicit(&list->hash, memory_order_relaxed);
+  struct HashTable* hash = create_hash(old->num_buckets * 2);
+  if (!hash) return 1;
+
+  for (size_t i = 0; i < old->num_buckets; i++) {
+    struct HashEntry* current = atomic_load_explicit(&old->buckets[i], memory_order_relaxed);
+    for (; current; current = atomic_load_explicit(&current->next, memory_order_relaxed)) {
+      struct HashEntry* entry = malloc(sizeof(struct HashEntry));
+      if (!entry) {
+        free_hash(hash);
+        return 1;
+      }
+
+      size_t bucket = current->event->id % hash->num_buckets;
+      entry->event = current->event;
+      atomic_init(&entry->next, atomic_load_explicit(&hash->buckets[bucket], memory_order_relaxed));
+      atomic_store_explicit(&hash->buckets[bucket], entry, memory_order_relaxed);
+      hash->size++;
+    }
+  }
+
+  atomic_store_explicit(&list->hash, hash, memory_order_release);
+  epoch_retire(old, free_hash);
+  return 0;
+}
+
+/// Allocates a node of the ordered index.
+/// @param event Event referenced by the node.
+/// @param level Number of forward pointers.
+/// @return Newly created node, NULL on failure.
+static struct IndexNode* create_index_node(struct Event* event, int level) {
+  struct IndexNode* node = malloc(sizeof(struct IndexNode) + (size_t)level * sizeof(_Atomic(struct IndexNode*)));
+  if (!node) return NULL;
+
+  node->event = event;
+  node->level = level;
+  for (int i = 0; i < level; i++) {
+    atomic_init(&node->next[i], NULL);
+  }
+  return node;
+}
+
+/// Picks the level of a new index node, each level being half as likely as the previous one.
+/// @param list Event list whose generator is used.
+/// @return Level between 1 and EVENT_INDEX_MAX_LEVEL.
+static int random_level(struct EventList* list) {
+  // xorshift32, good enough to balance the skiplist
+  unsigned int x = list->index_seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  list->index_seed = x;
+
+  int level = 1;
+  while (level < EVENT_INDEX_MAX_LEVEL && (x & 1)) {
+    level++;
+    x >>= 1;
+  }
+  return level;
+}
+
+/// Finds the last node of each level whose id is lower than the given one.
+/// @param list Event list to be searched.
+/// @param event_id Id to search for.
+/// @param preds Array of EVENT_INDEX_MAX_LEVEL nodes to store the predecessors in, may be NULL.
+/// @return First node with id greater or equal to event_id, NULL if there is none.
+static struct IndexNode* index_seek(struct EventList* list, unsigned int event_id, struct IndexNode** preds) {
+  struct IndexNode* current = list->index;
+  for (int i = EVENT_INDEX_MAX_LEVEL - 1; i >= 0; i--) {
+    struct IndexNode* next = atomic_load_explicit(&current->next[i], memory_order_acquire);
+    while (next && next->event->id < event_id) {
+      current = next;
+      next = atomic_load_explicit(&current->next[i], memory_order_acquire);
+    }
+    if (preds) preds[i] = current;
+  }
+  return atomic_load_explicit(&current->next[0], memory_order_acquire);
+}
+
+/// Links a node in the ordered index.
+/// @note Levels are linked bottom-up, each with release semantics, so that
+/// readers walking the index concurrently always see a valid skiplist.
+/// @param list Event list to be modified.
+/// @param node Node to be linked.
+static void index_insert(struct EventList* list, struct IndexNode* node) {
+  struct IndexNode* preds[EVENT_INDEX_MAX_LEVEL];
+  index_seek(list, node->event->id, preds);
+
+  for (int i = 0; i < node->level; i++) {
+    struct IndexNode* next = atomic_load_explicit(&preds[i]->next[i], memory_order_relaxed);
+    atomic_store_explicit(&node->next[i], next, memory_order_relaxed);
+    atomic_store_explicit(&preds[i]->next[i], node, memory_order_release);
+  }
+}
+
 struct EventList* create_list() {
   struct EventList* list = (struct EventList*)malloc(sizeof(struct EventList));
   if (!list) return NULL;
-  if (pthread_rwlock_init(&list->rwl, NULL) != 0) {
+  if (pthread_mutex_init(&list->lock, NULL) != 0) {
     free(list);
     return NULL;
   }
-  list->head = NULL;
+
+  struct DenseIndex* dense = create_dense(EVENT_DENSE_INIT_SIZE);
+  struct HashTable* hash = create_hash(EVENT_HASH_INIT_SIZE);
+  list->index = create_index_node(NULL, EVENT_INDEX_MAX_LEVEL);
+  if (!dense || !hash || !list->index) {
+    free(dense);
+    free(hash);
+    free(list->index);
+    pthread_mutex_destroy(&list->lock);
+    free(list);
+    return NULL;
+  }
+
+  atomic_init(&list->dense, dense);
+  atomic_init(&list->hash, hash);
+  atomic_init(&list->head, NULL);
+  atomic_init(&list->size, 0);
+  list->index_seed = 2463534242u;
   list->tail = NULL;
   return list;
 }
@@ -18,57 +207,217 @@ struct EventList* create_list() {
 int append_to_list(struct EventList* list, struct Event* event) {
   if (!list) return 1;
 
+  // Everything that may fail is done before the event becomes reachable
   struct ListNode* new_node = (struct ListNode*)malloc(sizeof(struct ListNode));
-  if (!new_node) return 1;
+  struct IndexNode* index_node = create_index_node(event, random_level(list));
+  struct HashEntry* entry = NULL;
+  if (!new_node || !index_node) {
+    free(new_node);
+    free(index_node);
+    return 1;
+  }
 
   new_node->event = event;
-  new_node->next = NULL;
+  atomic_init(&new_node->next, NULL);
 
-  if (list->head == NULL) {
-    list->head = new_node;
-    list->tail = new_node;
+  if (event->id < EVENT_DENSE_MAX_ID) {
+    if (event->id >= atomic_load_explicit(&list->dense, memory_order_relaxed)->capacity &&
+        grow_dense(list, event->id) != 0) {
+      free(index_node);
+      free(new_node);
+      return 1;
+    }
   } else {
-    list->tail->next = new_node;
-    list->tail = new_node;
+    struct HashTable* hash = atomic_load_explicit(&list->hash, memory_order_relaxed);
+    entry = malloc(sizeof(struct HashEntry));
+    if (!entry || (hash->size + 1 > hash->num_buckets && grow_hash(list) != 0)) {
+      free(entry);
+      free(index_node);
+      free(new_node);
+      return 1;
+    }
   }
 
+  if (list->tail == NULL) {
+    atomic_store_explicit(&list->head, new_node, memory_order_release);
+  } else {
+    atomic_store_explicit(&list->tail->next, new_node, memory_order_release);
+  }
+  list->tail = new_node;
+
+  index_insert(list, index_node);
+
+  if (entry) {
+    struct HashTable* hash = atomic_load_explicit(&list->hash, memory_order_relaxed);
+    size_t bucket = event->id % hash->num_buckets;
+    entry->event = event;
+    atomic_init(&entry->next, atomic_load_explicit(&hash->buckets[bucket], memory_order_relaxed));
+    atomic_store_explicit(&hash->buckets[bucket], entry, memory_order_release);
+    hash->size++;
+  } else {
+    struct DenseIndex* dense = atomic_load_explicit(&list->dense, memory_order_relaxed);
+    atomic_store_explicit(&dense->slots[event->id], event, memory_order_release);
+  }
+
+  atomic_fetch_add_explicit(&list->size, 1, memory_order_relaxed);
   return 0;
 }
 
+bool seat_chunk_owned(const struct Event* event, const struct SeatMap* seats, size_t chunk) {
+  return event->mapped == NULL || seats->chunks[chunk] != event->mapped + chunk * SEAT_CHUNK_SIZE;
+}
+
 static void free_event(struct Event* event) {
   if (!event) return;
-  free(event->data);
+  pthread_mutex_destroy(&event->mutex);
+  while (event->subscribers) {
+    struct Subscriber* subscriber = event->subscribers;
+    event->subscribers = subscriber->next;
+    free(subscriber);
+  }
+
+  // Replaced chunks were retired by the reservations, the current map holds every other one
+  struct SeatMap* seats = atomic_load_explicit(&event->seats, memory_order_relaxed);
+  for (size_t i = 0; i < seats->num_chunks; i++) {
+    if (seat_chunk_owned(event, seats, i)) free(seats->chunks[i]);
+  }
+  free(seats);
   free(event);
 }
 
+static void retire_event(void* event) { free_event((struct Event*)event); }
+
+/// Unlinks a node from the ordered index.
+/// @note The node keeps its forward pointers, so readers standing on it can
+/// still move on.
+/// @param list Event list to be modified.
+/// @param event_id Id of the node to be unlinked.
+/// @return The unlinked node, NULL if there is none.
+static struct IndexNode* index_remove(struct EventList* list, unsigned int event_id) {
+  struct IndexNode* preds[EVENT_INDEX_MAX_LEVEL];
+  struct IndexNode* node = index_seek(list, event_id, preds);
+  if (!node || node->event->id != event_id) return NULL;
+
+  for (int i = node->level - 1; i >= 0; i--) {
+    if (atomic_load_explicit(&preds[i]->next[i], memory_order_relaxed) != node) continue;
+    struct IndexNode* next = atomic_load_explicit(&node->next[i], memory_order_relaxed);
+    atomic_store_explicit(&preds[i]->next[i], next, memory_order_release);
+  }
+  return node;
+}
+
+/// Unlinks an entry from the hash fallback.
+/// @param list Event list to be modified.
+/// @param event_id Id of the entry to be unlinked.
+/// @return The unlinked entry, NULL if there is none.
+static struct HashEntry* hash_remove(struct EventList* list, unsigned int event_id) {
+  struct HashTable* hash = atomic_load_explicit(&list->hash, memory_order_relaxed);
+  _Atomic(struct HashEntry*)* link = &hash->buckets[event_id % hash->num_buckets];
+
+  struct HashEntry* current;
+  while ((current = atomic_load_explicit(link, memory_order_relaxed)) != NULL) {
+    if (current->event->id == event_id) {
+      struct HashEntry* next = atomic_load_explicit(&current->next, memory_order_relaxed);
+      atomic_store_explicit(link, next, memory_order_release);
+      hash->size--;
+      return current;
+    }
+    link = &current->next;
+  }
+  return NULL;
+}
+
+int remove_from_list(struct EventList* list, unsigned int event_id) {
+  if (!list) return 1;
+
+  struct ListNode* prev = NULL;
+  struct ListNode* node = atomic_load_explicit(&list->head, memory_order_relaxed);
+  while (node && node->event->id != event_id) {
+    prev = node;
+    node = atomic_load_explicit(&node->next, memory_order_relaxed);
+  }
+  if (!node) return 1;
+
+  // Unlinked everywhere first, readers that already hold a pointer keep it valid until they leave
+  struct Event* event = node->event;
+  if (event_id < EVENT_DENSE_MAX_ID) {
+    struct DenseIndex* dense = atomic_load_explicit(&list->dense, memory_order_relaxed);
+    atomic_store_explicit(&dense->slots[event_id], NULL, memory_order_release);
+  } else {
+    epoch_retire(hash_remove(list, event_id), free);
+  }
+
+  epoch_retire(index_remove(list, event_id), free);
+
+  struct ListNode* next = atomic_load_explicit(&node->next, memory_order_relaxed);
+  if (prev) {
+    atomic_store_explicit(&prev->next, next, memory_order_release);
+  } else {
+    atomic_store_explicit(&list->head, next, memory_order_release);
+  }
+  if (list->tail == node) list->tail = prev;
+  atomic_fetch_sub_explicit(&list->size, 1, memory_order_relaxed);
+
+  epoch_retire(node, free);
+  epoch_retire(event, retire_event);
+  return 0;
+}
+
 void free_list(struct EventList* list) {
   if (!list) return;
 
-  struct ListNode* current = list->head;
+  struct ListNode* current = atomic_load_explicit(&list->head, memory_order_relaxed);
   while (current) {
     struct ListNode* temp = current;
-    current = current->next;
+    current = atomic_load_explicit(&current->next, memory_order_relaxed);
 
     free_event(temp->event);
     free(temp);
   }
 
+  struct IndexNode* index = list->index;
+  while (index) {
+    struct IndexNode* next = atomic_load_explicit(&index->next[0], memory_order_relaxed);
+    free(index);
+    index = next;
+  }
+
+  free(atomic_load_explicit(&list->dense, memory_order_relaxed));
+  free_hash(atomic_load_explicit(&list->hash, memory_order_relaxed));
+  pthread_mutex_destroy(&list->lock);
   free(list);
 }
 
-struct Event* get_event(struct EventList* list, unsigned int event_id, struct ListNode* from, struct ListNode* to) {
-  if (!list || !from || !to) return NULL;
-  struct ListNode* current = from;
+struct Event* get_event(struct EventList* list, unsigned int event_id) {
+  if (!list) return NULL;
+
+  if (event_id < EVENT_DENSE_MAX_ID) {
+    struct DenseIndex* dense = atomic_load_explicit(&list->dense, memory_order_acquire);
+    if (event_id >= dense->capacity) return NULL;
+    return atomic_load_explicit(&dense->slots[event_id], memory_order_acquire);
+  }
 
-  while (1) {
+  struct HashTable* hash = atomic_load_explicit(&list->hash, memory_order_acquire);
+  struct HashEntry* current = atomic_load_explicit(&hash->buckets[event_id % hash->num_buckets], memory_order_acquire);
+  while (current) {
     if (current->event->id == event_id) {
       return current->event;
     }
+    current = atomic_load_explicit(&current->next, memory_order_acquire);
+  }
 
-    if (current == to) {
-      return NULL;
-    }
+  return NULL;
+}
+
+size_t get_event_ids(struct EventList* list, unsigned int from, unsigned int* ids, size_t max) {
+  if (!list) return 0;
 
-    current = current->next;
+  size_t count = 0;
+  struct IndexNode* current = index_seek(list, from, NULL);
+  while (current && count < max) {
+    ids[count++] = current->event->id;
+    current = atomic_load_explicit(&current->next[0], memory_order_acquire);
   }
+
+  return count;
 }
@@ -2,29 +2,102 @@
 #define SERVER_EVENT_LIST_H
 
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#include "common/constants.h"
+
+// Seat taken by a reservation, kept so a client can be sent only the seats it has not seen.
+// Written under the event mutex and read without it, so a reader checks the entry was not overwritten meanwhile
+struct SeatChange {
+  _Atomic uint64_t version;  // Version of the event the reservation made
+  _Atomic size_t seat;       // Index of the seat in the event data
+};
+
+// Receiver of the reservations made in an event
+struct Subscriber {
+  void* subscriber;
+  struct Subscriber* next;
+};
+
+// Seats of an event as a reservation left them, never written once published. Every reservation
+// publishes a new map that copies the chunks it changes and shares the others, then retires the old
+// map and the replaced chunks, so readers take a consistent snapshot without the mutex
+struct SeatMap {
+  // Versions come from a counter shared by every event, so an event created again
+  // with the same id never repeats a version of the old one
+  uint64_t version;           // Bumped by every reservation
+  uint64_t log_floor;         // Every seat taken after this version is in the log of the event
+  size_t num_changes;         // Seats logged up to this version, the newest is at num_changes - 1
+  unsigned int reservations;  // Reservations made in the event, the id of the last one
+  size_t num_chunks;          // Chunks of seats, the last one may hold fewer than SEAT_CHUNK_SIZE
+  unsigned int* chunks[];     // Reservation of each seat, rows * cols row by row, SEAT_CHUNK_SIZE per chunk
+};
 
 struct Event {
-  unsigned int id;            /// Event id
-  unsigned int reservations;  /// Number of reservations for the event.
+  unsigned int id;  /// Event id
 
   size_t cols;  /// Number of columns.
   size_t rows;  /// Number of rows.
 
-  unsigned int* data;     /// Array of size rows * cols with the reservations for each seat.
-  pthread_mutex_t mutex;  // Mutex to protect the event
+  _Atomic(struct SeatMap*) seats;  // Current seats, read inside an epoch section
+  const unsigned int* mapped;      // Seats restored from a snapshot, NULL if none, chunks still there are not freed
+  pthread_mutex_t mutex;           // Serializes reservations, protects subscribers
+  struct Subscriber* subscribers;  // Notified of every reservation, emptied when deleted
+
+  // Kept out of the seat maps, so a reservation does not copy it along with the seats
+  struct SeatChange changes[EVENT_CHANGE_LOG_SIZE];  // Ring of the seats taken, oldest overwritten first
+  _Atomic size_t changes_started;                    // Entries a reservation has started writing
 };
 
 struct ListNode {
   struct Event* event;
-  struct ListNode* next;
+  _Atomic(struct ListNode*) next;
+};
+
+// Entry of the hash fallback, immutable once published
+struct HashEntry {
+  struct Event* event;
+  _Atomic(struct HashEntry*) next;  // Next entry in the same bucket
+};
+
+// Hash table for sparse or large ids, replaced as a whole when it grows
+struct HashTable {
+  size_t num_buckets;                    // Number of buckets
+  size_t size;                           // Number of entries
+  _Atomic(struct HashEntry*) buckets[];  // Chains of entries
+};
+
+// Node of the ordered index (a skiplist sorted by event id)
+struct IndexNode {
+  struct Event* event;
+  int level;                          // Number of forward pointers
+  _Atomic(struct IndexNode*) next[];  // Forward pointers, one per level
+};
+
+// Direct-indexed table of events, slot i holds the event with id i (or NULL)
+struct DenseIndex {
+  size_t capacity;                 // Number of slots
+  _Atomic(struct Event*) slots[];  // Events indexed by id
 };
 
 // Linked list structure
+// Readers never lock: they run inside an epoch section (see epoch.h) and every
+// structure below is published with release semantics. Writers serialize on lock.
 struct EventList {
-  struct ListNode* head;  // Head of the list
-  struct ListNode* tail;  // Tail of the list
-  pthread_rwlock_t rwl;   // Mutex to protect the list
+  _Atomic(struct ListNode*) head;  // Head of the list
+  struct ListNode* tail;           // Tail of the list
+  _Atomic size_t size;             // Number of events in the list
+
+  _Atomic(struct DenseIndex*) dense;  // Fast path for ids below EVENT_DENSE_MAX_ID
+  _Atomic(struct HashTable*) hash;    // Fallback for sparse or large ids
+
+  struct IndexNode* index;  // Sentinel of the ordered index
+  unsigned int index_seed;  // State of the generator used to pick node levels
+
+  pthread_mutex_t lock;  // Serializes writers
 };
 
 /// Creates a new event list.
@@ -32,22 +105,46 @@ struct EventList {
 struct EventList* create_list();
 
 /// Appends a new node to the list.
+/// @note Must be called with the list lock held.
 /// @param list Event list to be modified.
 /// @param data Event to be stored in the new node.
 /// @return 0 if the node was appended successfully, 1 otherwise.
 int append_to_list(struct EventList* list, struct Event* data);
 
-/// Removes a node from the list.
+/// Unlinks an event from the list and retires it.
+/// @note Must be called with the list lock held. The event and its nodes are
+/// only freed once no reader inside an epoch section can still reach them.
 /// @param list Event list to be modified.
-/// @return 0 if the node was removed successfully, 1 otherwise.
+/// @param event_id Id of the event to be removed.
+/// @return 0 if the event was removed successfully, 1 otherwise.
+int remove_from_list(struct EventList* list, unsigned int event_id);
+
+/// Tells whether a chunk of seats was allocated for the event, rather than left in the snapshot it was restored from.
+/// @param event Event the seats belong to.
+/// @param seats Seat map of the event holding the chunk.
+/// @param chunk Index of the chunk.
+/// @return true if the chunk must be freed with the map, false otherwise.
+bool seat_chunk_owned(const struct Event* event, const struct SeatMap* seats, size_t chunk);
+
+/// Frees the whole list, with every event still in it and its indexes.
+/// @note Must only be called once no other thread uses the list.
+/// @param list Event list to be freed, may be NULL.
 void free_list(struct EventList* list);
 
 /// Retrieves an event in the list.
+/// @note Must be called inside an epoch section or with the list lock held.
 /// @param list Event list to be searched
 /// @param event_id Event id.
-/// @param from First node to be searched.
-/// @param to Last node to be searched.
 /// @return Pointer to the event if found, NULL otherwise.
-struct Event* get_event(struct EventList* list, unsigned int event_id, struct ListNode* from, struct ListNode* to);
+struct Event* get_event(struct EventList* list, unsigned int event_id);
+
+/// Retrieves the ids of the events with id greater or equal to the given one, in ascending order.
+/// @note Must be called inside an epoch section or with the list lock held.
+/// @param list Event list to be searched.
+/// @param from Smallest id to be returned.
+/// @param ids Array to store the ids in.
+/// @param max Maximum number of ids to store.
+/// @return Number of ids stored.
+size_t get_event_ids(struct EventList* list, unsigned int from, unsigned int* ids, size_t max);
 
 #endif  // SERVER_EVENT_LIST_H
@@ -1,469 +1,1657 @@
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
 #include "common/constants.h"
 #include "common/io.h"
+#include "common/shm.h"
 #include "operations.h"
+#include "scheduler.h"
+#include "stats.h"
+
+// Session table, far larger than the number of workers
+static worker_client_t *sessions;
+static int session_count = SESSION_COUNT;
+static int *free_sessions;  // Stack of unused session ids
+static int num_free_sessions;
+static bool registrations_paused;  // Set while the table is full, the server pipe is then not watched
+static worker_client_t **half_open;  // Pipe sessions whose client has not opened its response pipe yet, loop only
+static size_t num_half_open;
+static pthread_mutex_t free_sessions_lock;
+
+static int worker_count = WORKER_COUNT;
+
+// Every watched descriptor is one-shot, the read task of a session re-arms it
+static int epoll_fd;
+static int fd_server;  // Server pipe, or listening socket in the other transports
+
+// How sessions reach the server, chosen at startup by the prefix of the server path
+enum Transport {
+  TRANSPORT_PIPES,   // A pair of named pipes registered through the server pipe
+  TRANSPORT_SOCKET,  // A SOCK_SEQPACKET connection
+  TRANSPORT_SHM,     // Rings in memory shared with the client, the connection only wakes the server
+};
+static enum Transport transport = TRANSPORT_PIPES;
+static size_t max_write = SIZE_MAX;
+
+enum TaskKind { TASK_SESSION, TASK_REQUEST, TASK_NOTIFY };
+enum RequestState { REQUEST_QUEUED, REQUEST_RUNNING, REQUEST_DONE };
+
+// Unit of work given to the scheduler
+struct Task {
+  enum TaskKind kind;
+  worker_client_t *client;
+
+  // Only used by requests
+  enum RequestState state;
+  uint32_t logical_session;  // Logical session of a multiplexed request, 0 for the one of the connection
+  struct Task *next;         // Next request of the same session
+  frame_header_t header;
+  char *payload;      // header.length bytes, NULL when empty
+  buffer_t reply;     // Payload of the reply
+  buffer_t stream;    // Messages of a streamed reply built before it was next in sequence, each with its header
+  buffer_t placed;    // Reply built in the reply ring of a shared-memory session, data is NULL unless it was
+  uint64_t received_ns;  // When the request was read, its latency ends once the reply is sent
+};
+
+// Signals only set flags, the event loop acts on them once epoll_pwait returns
+static volatile sig_atomic_t dump_requested = 0;  // SIGUSR1 arrived
+static volatile sig_atomic_t dump_finished = 0;   // SIGCHLD arrived
+static volatile sig_atomic_t stop_requested = 0;  // SIGTERM or SIGINT arrived
+static pid_t dump_pid = 0;  // Process writing the dump of the events, 0 if none
+static bool dump_printing = false;  // The running process writes EVENTS_DUMP_PATH, not only the snapshot
+static const char *snapshot_path = NULL;  // Snapshot restored at startup and saved with every dump, NULL if none
+static char snapshot_temp[PATH_MAX];      // Where the snapshot is written before it is renamed over snapshot_path
+static unsigned int snapshot_interval_s = SNAPSHOT_INTERVAL_S;  // Time between two snapshots, 0 if only signals save it
+static uint64_t next_snapshot_ns = 0;  // When the next snapshot is due, on the clock of stats_now_ns
+static sigset_t loop_mask;  // Mask of the event loop while it waits, the only time the signals below are taken
 
-static int fd_server;
+static void sig_handler(int sig) {
+  if (sig == SIGUSR1) {
+    dump_requested = 1;
+  } else if (sig == SIGCHLD) {
+    dump_finished = 1;
+  } else if (sig == SIGTERM || sig == SIGINT) {
+    stop_requested = 1;
+  }
+}
 
-static worker_client_t *clients;
-static char *server_pipe;
-static pthread_mutex_t server_pipe_lock;
-static pthread_mutex_t free_client_lock;
-static pthread_cond_t cond_to_wait;
+/// Copies a field of a request and moves past it.
+/// @param dest Variable to store the field in.
+/// @param src Start of the field.
+/// @param size Size of the field.
+/// @return Start of the next field.
+static const char *take(void *dest, const char *src, size_t size) {
+  memcpy(dest, src, size);
+  return src + size;
+}
 
-bool all_clients_are_busy = false;
+/// Gives the size of the fixed payload of an operation inside a batch.
+/// @param opcode Opcode of the operation, only the ones a batch may hold are accepted.
+/// @param payload Payload of the operation.
+/// @param left Bytes left in the batch from the payload on.
+/// @return Size of the payload, 0 if the operation is not valid.
+static size_t operation_size(uint8_t opcode, const char *payload, size_t left) {
+  size_t num_seats;
 
-static void sig_handler(int sig) {
-  if (sig == SIGUSR1) {
-    print_events();
+  switch (opcode) {
+    case OP_CODE_SHOW:
+    case OP_CODE_DELETE:
+      return sizeof(unsigned int);
+    case OP_CODE_SHOW_SINCE:
+      return sizeof(unsigned int) + sizeof(uint64_t);
+    case OP_CODE_CREATE:
+      return sizeof(unsigned int) + 2 * sizeof(size_t);
+    case OP_CODE_RESERVE:
+      if (left < sizeof(unsigned int) + sizeof(size_t)) return 0;
+      memcpy(&num_seats, payload + sizeof(unsigned int), sizeof(size_t));
+      if (num_seats == 0 || num_seats > MAX_RESERVATION_SIZE) return 0;
+      return sizeof(unsigned int) + sizeof(size_t) + 2 * num_seats * sizeof(size_t);
+    default:
+      return 0;
+  }
+}
+
+/// Checks that the payload of a request has the layout its opcode requires.
+/// @param header Header of the request.
+/// @param payload Payload of the request.
+/// @return true if the request is well formed, false otherwise.
+static bool request_valid(const frame_header_t *header, const char *payload) {
+  switch (header->opcode) {
+    case OP_CODE_QUIT:
+    case OP_CODE_STATS:
+      return header->length == 0;
+    case OP_CODE_SHOW:
+    case OP_CODE_DELETE:
+    case OP_CODE_SUBSCRIBE:
+      return header->length == sizeof(unsigned int);
+    case OP_CODE_SHOW_SINCE:
+      return header->length == sizeof(unsigned int) + sizeof(uint64_t);
+    case OP_CODE_CREATE:
+      return header->length == sizeof(unsigned int) + 2 * sizeof(size_t);
+    case OP_CODE_LIST_PAGE:
+      return header->length == sizeof(unsigned int) + sizeof(size_t);
+    case OP_CODE_RESERVE: {
+      size_t fixed = sizeof(unsigned int) + sizeof(size_t);
+      if (header->length < fixed) return false;
+
+      size_t num_seats;
+      memcpy(&num_seats, payload + sizeof(unsigned int), sizeof(size_t));
+      if (num_seats == 0 || num_seats > MAX_RESERVATION_SIZE) return false;
+      return header->length == fixed + 2 * num_seats * sizeof(size_t);
+    }
+    case OP_CODE_BATCH: {
+      // The number of operations, then the opcode and the payload of each one
+      size_t left = header->length;
+      size_t count;
+      if (left < sizeof(size_t)) return false;
+      payload = take(&count, payload, sizeof(size_t));
+      left -= sizeof(size_t);
+      if (count == 0 || count > BATCH_MAX_OPERATIONS) return false;
+
+      for (size_t i = 0; i < count; i++) {
+        if (left < sizeof(uint8_t)) return false;
+        uint8_t opcode = (uint8_t)*payload++;
+        left--;
+
+        size_t size = operation_size(opcode, payload, left);
+        if (size == 0 || size > left) return false;
+        payload += size;
+        left -= size;
+      }
+      return left == 0;
+    }
+    default:
+      return false;
   }
 }
 
-void initialize_client(worker_client_t *client) {
+/// Moves one field of a compact payload to a fixed one.
+/// @param fixed Payload being rebuilt.
+/// @param src Start of the field, moved past it.
+/// @param left Bytes left in the compact payload.
+/// @param size Size of the field in the fixed payload.
+/// @param value Variable to store the value of the field in.
+/// @return 0 if the field was moved, 1 otherwise.
+static int expand_field(buffer_t *fixed, const char **src, size_t *left, size_t size, uint64_t *value) {
+  return take_uint(value, WIRE_COMPACT, src, left, size) || buffer_put_uint(fixed, WIRE_FIXED, *value, size);
+}
 
-  ssize_t ret = read(fd_server, client->req_client_pipe, PIPENAME_SIZE);
-  if (ret < 0) {
-    fprintf(stdout, "ERROR read failed\n");
-    close(fd_server);
-    exit(EXIT_FAILURE);
+/// Moves the fields of one compact request or operation to a fixed payload.
+/// @param fixed Payload being rebuilt.
+/// @param opcode Opcode of the request or operation.
+/// @param payload Start of the fields, moved past them.
+/// @param left Bytes left in the compact payload.
+/// @return 0 if the fields were moved, 1 otherwise.
+static int expand_fields(buffer_t *fixed, uint8_t opcode, const char **payload, size_t *left) {
+  uint64_t value;
+  int failed = 0;
+
+  switch (opcode) {
+    case OP_CODE_SHOW:
+    case OP_CODE_DELETE:
+    case OP_CODE_SUBSCRIBE:
+      failed = expand_field(fixed, payload, left, sizeof(unsigned int), &value);
+      break;
+    case OP_CODE_CREATE:
+      failed = expand_field(fixed, payload, left, sizeof(unsigned int), &value) ||
+               expand_field(fixed, payload, left, sizeof(size_t), &value) ||
+               expand_field(fixed, payload, left, sizeof(size_t), &value);
+      break;
+    case OP_CODE_LIST_PAGE:
+      failed = expand_field(fixed, payload, left, sizeof(unsigned int), &value) ||
+               expand_field(fixed, payload, left, sizeof(size_t), &value);
+      break;
+    case OP_CODE_SHOW_SINCE:
+      failed = expand_field(fixed, payload, left, sizeof(unsigned int), &value) ||
+               expand_field(fixed, payload, left, sizeof(uint64_t), &value);
+      break;
+    case OP_CODE_RESERVE: {
+      uint64_t num_seats;
+      failed = expand_field(fixed, payload, left, sizeof(unsigned int), &value) ||
+               expand_field(fixed, payload, left, sizeof(size_t), &num_seats) || num_seats == 0 ||
+               num_seats > MAX_RESERVATION_SIZE;
+      for (uint64_t i = 0; !failed && i < 2 * num_seats; i++) {
+        failed = expand_field(fixed, payload, left, sizeof(size_t), &value);
+      }
+      break;
+    }
+    case OP_CODE_BATCH: {
+      uint64_t count;
+      failed = expand_field(fixed, payload, left, sizeof(size_t), &count) || count == 0 ||
+               count > BATCH_MAX_OPERATIONS;
+      for (uint64_t i = 0; !failed && i < count; i++) {
+        // Batches do not nest, request_valid rejects any other opcode
+        uint64_t op;
+        failed = expand_field(fixed, payload, left, sizeof(uint8_t), &op) || op == OP_CODE_BATCH ||
+                 expand_fields(fixed, (uint8_t)op, payload, left);
+      }
+      break;
+    }
+    default:
+      // Requests without fields, unknown opcodes are rejected by request_valid
+      break;
   }
-  ret = read(fd_server, client->resp_client_pipe, PIPENAME_SIZE);  
-  if (ret < 0) {
-    fprintf(stdout, "ERROR read failed\n");
-    close(fd_server);
+
+  return failed;
+}
+
+/// Rebuilds a compact request payload in the fixed layout the handlers read.
+/// @param header Header of the request, its length becomes the one of the fixed payload.
+/// @param payload Compact payload.
+/// @param fixed Empty buffer to build the fixed payload in.
+/// @return 0 if the payload holds exactly the fields of its opcode, 1 otherwise.
+static int expand_request(frame_header_t *header, const char *payload, buffer_t *fixed) {
+  size_t left = header->length;
+  int failed = expand_fields(fixed, header->opcode, &payload, &left);
+
+  header->length = (uint32_t)fixed->len;
+  return failed || left != 0;
+}
+
+/// Tells how the payloads of a request and of its reply are encoded.
+/// @param task Request to be checked.
+/// @return Encoding chosen by the client for the request.
+static wire_encoding_t task_encoding(const struct Task *task) {
+  return (task->header.flags & FRAME_FLAG_COMPACT) ? WIRE_COMPACT : WIRE_FIXED;
+}
+
+/// Appends the result of an operation to a reply.
+/// @param task Request being answered.
+/// @param success Result of the operation.
+static void reply_result(struct Task *task, int success) {
+  buffer_put_uint(&task->reply, task_encoding(task), (unsigned int)success, sizeof(int));
+}
+
+void create_event(struct Task *task, const char *args) {
+  unsigned int event_id;
+  size_t num_rows;
+  size_t num_cols;
+
+  args = take(&event_id, args, sizeof(unsigned int));
+  args = take(&num_rows, args, sizeof(size_t));
+  take(&num_cols, args, sizeof(size_t));
+
+  reply_result(task, ems_create(event_id, num_rows, num_cols));
+}
+
+void delete_event(struct Task *task, const char *args) {
+  unsigned int event_id;
+
+  take(&event_id, args, sizeof(unsigned int));
+
+  reply_result(task, ems_delete(event_id));
+}
+
+void reserve_seats(struct Task *task, const char *args) {
+  unsigned int event_id;
+  size_t num_seats;
+  size_t xs[MAX_RESERVATION_SIZE];
+  size_t ys[MAX_RESERVATION_SIZE];
+
+  // request_valid already checked num_seats against MAX_RESERVATION_SIZE
+  args = take(&event_id, args, sizeof(unsigned int));
+  args = take(&num_seats, args, sizeof(size_t));
+  args = take(xs, args, sizeof(size_t[num_seats]));
+  take(ys, args, sizeof(size_t[num_seats]));
+
+  reply_result(task, ems_reserve(event_id, num_seats, xs, ys));
+}
+
+void show_event(struct Task *task, const char *args, ems_place_fn place) {
+  unsigned int event_id;
+
+  take(&event_id, args, sizeof(unsigned int));
+
+  ems_show(&task->reply, task_encoding(task), event_id, place, task);
+}
+
+void show_event_since(struct Task *task, const char *args, ems_chunk_fn chunk, ems_place_fn place) {
+  unsigned int event_id;
+  uint64_t since;
+
+  args = take(&event_id, args, sizeof(unsigned int));
+  take(&since, args, sizeof(uint64_t));
+
+  ems_show_since(&task->reply, task_encoding(task), event_id, since, chunk, place, task);
+}
+
+void show_stats(struct Task *task) {
+  stats_put(&task->reply, task_encoding(task));
+}
+
+void list_events_page(struct Task *task, const char *args) {
+  unsigned int cursor;
+  size_t limit;
+
+  args = take(&cursor, args, sizeof(unsigned int));
+  take(&limit, args, sizeof(size_t));
+
+  ems_list_page(&task->reply, task_encoding(task), cursor, limit);
+}
+
+void subscribe_event(struct Task *task, const char *args) {
+  worker_client_t *client = task->client;
+  unsigned int event_id;
+
+  take(&event_id, args, sizeof(unsigned int));
+
+  // Looked up without the session lock, since finding the event takes a while
+  int result = ems_subscribe(event_id, client);
+
+  if (pthread_mutex_lock(&client->lock) != 0) {
     exit(EXIT_FAILURE);
   }
+  bool known = false;
+  for (size_t i = 0; i < client->num_subscriptions; i++) {
+    if (client->subscriptions[i] == event_id) known = true;
+  }
 
-  close(fd_server);
-  // Open response client pipe for reading
-  // This waits for someone to open it for writing
-  fd_server = open(server_pipe, O_WRONLY);
-  if (fd_server == -1) {
-    fprintf(stderr, "[ERR]: open failed: %s\n", strerror(errno));
-    exit(EXIT_FAILURE);
+  // A draining session already dropped its subscriptions
+  if (result == 0 && !known) {
+    if (client->state == SESSION_DRAINING || client->num_subscriptions == SESSION_MAX_SUBSCRIPTIONS) {
+      ems_unsubscribe(event_id, client);
+      result = 1;
+    } else {
+      client->subscriptions[client->num_subscriptions++] = event_id;
+    }
   }
-  
-  ret = write(fd_server, &client->session_id, sizeof(int));
-  if (ret < 0) {
-    fprintf(stdout, "ERROR write failed\n");
-    close(fd_server);
-    exit(EXIT_FAILURE);
+
+  // Notifications already queued in another encoding are dropped
+  if (result == 0) {
+    if (pthread_mutex_lock(&client->notify_lock) != 0) {
+      exit(EXIT_FAILURE);
+    }
+    if (client->notify_encoding != task_encoding(task) && client->num_notices > 0) {
+      client->notices.len = 0;
+      client->num_notices = 0;
+      client->notices_dropped = true;
+    }
+    client->notify_encoding = task_encoding(task);
+    if (pthread_mutex_unlock(&client->notify_lock) != 0) {
+      exit(EXIT_FAILURE);
+    }
   }
-  close(fd_server);
 
-  if(pthread_mutex_unlock(&client->lock) != 0) {
+  if (pthread_mutex_unlock(&client->lock) != 0) {
     exit(EXIT_FAILURE);
   }
 
-  if(pthread_mutex_lock(&client->lock) != 0) {
+  reply_result(task, result);
+}
+
+/// Stops the notifications to a session.
+/// @note Must be called with the session lock held.
+/// @param client Session leaving.
+static void drop_subscriptions(worker_client_t *client) {
+  for (size_t i = 0; i < client->num_subscriptions; i++) {
+    ems_unsubscribe(client->subscriptions[i], client);
+  }
+  client->num_subscriptions = 0;
+}
+
+/// Queues the notification of a reservation for a subscribed session and makes sure it gets sent.
+/// @note Runs with the event mutex held, so it never waits for the session to write.
+static void queue_notice(void *subscriber, unsigned int event_id, unsigned int reservation_id, size_t num_seats,
+                         const size_t *xs, const size_t *ys) {
+  worker_client_t *client = (worker_client_t *)subscriber;
+  if (pthread_mutex_lock(&client->notify_lock) != 0) {
     exit(EXIT_FAILURE);
   }
 
-  // Open request client pipe for reading
-  // This waits for someone to open it for writing
-  do{
-    client->fd_req = open(client->req_client_pipe, O_RDONLY);
-  } while (client->fd_req == -1);
-  if (client->fd_req == -1) {
-    fprintf(stderr, "[ERR]: open failed: %s\n", strerror(errno));
-    client->opcode = 2;
+  wire_encoding_t encoding = client->notify_encoding;
+  size_t len = client->notices.len;
+  buffer_put_uint(&client->notices, encoding, event_id, sizeof(unsigned int));
+  buffer_put_uint(&client->notices, encoding, reservation_id, sizeof(unsigned int));
+  buffer_put_uint(&client->notices, encoding, num_seats, sizeof(size_t));
+  for (size_t i = 0; i < num_seats; i++) buffer_put_uint(&client->notices, encoding, xs[i], sizeof(size_t));
+  for (size_t i = 0; i < num_seats; i++) buffer_put_uint(&client->notices, encoding, ys[i], sizeof(size_t));
+
+  // A client that falls behind loses notifications rather than holding up the reservers
+  if (client->notices.failed || client->notices.len > NOTIFY_MAX_PENDING) {
+    client->notices.len = len;
+    client->notices.failed = false;
+    client->notices_dropped = true;
+  } else {
+    client->num_notices++;
   }
 
-  // Open response client pipe for reading
-  // This waits for someone to open it for writing
-  do {
-    client->fd_resp = open(client->resp_client_pipe, O_WRONLY);
-  } while(client->fd_resp == -1);
-  if (client->fd_resp == -1) {
-    fprintf(stderr, "[ERR]: open failed: %s\n", strerror(errno));
-    client->opcode = 2;
+  // Everything queued until the task takes the notifications goes out in the same message
+  if (!client->notify_pending) {
+    client->notify_pending = true;
+    scheduler_submit(client->notify_task);
   }
 
-  char op_code;
-  ret = read(client->fd_req, &op_code, sizeof(char));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: read failed\n");
-    client->opcode = 2;
+  if (pthread_mutex_unlock(&client->notify_lock) != 0) {
+    exit(EXIT_FAILURE);
   }
-  else
-    client->opcode = op_code;
+}
 
+void close_client(worker_client_t *client) {
+  // Closing the request pipe also removes it from the epoll set
+  close(client->fd_req);
+  if (client->fd_resp != client->fd_req) close(client->fd_resp);
+  shm_detach(client->shm);
+  client->shm = NULL;
+}
 
-  if(pthread_mutex_unlock(&client->lock) != 0) {
+/// Watches a descriptor for the next time it becomes readable.
+/// @param fd Descriptor to be watched.
+/// @param client Session of the descriptor, NULL for the server pipe.
+/// @param op EPOLL_CTL_ADD for a new descriptor, EPOLL_CTL_MOD to re-arm it.
+static void watch(int fd, worker_client_t *client, int op) {
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLONESHOT;
+  event.data.ptr = client;
+  if (epoll_ctl(epoll_fd, op, fd, &event) != 0) {
+    fprintf(stdout, "ERROR epoll_ctl failed: %s\n", strerror(errno));
     exit(EXIT_FAILURE);
   }
+}
 
-  if (pthread_mutex_unlock(&server_pipe_lock) != 0) {
+/// Checks whether a new client can be given a session.
+/// @note When the table is full registrations are paused until a session is released.
+/// @return true if a session is free, false otherwise.
+static bool session_available() {
+  if (pthread_mutex_lock(&free_sessions_lock) != 0) {
     exit(EXIT_FAILURE);
   }
 
+  bool available = num_free_sessions > 0;
+  if (!available) registrations_paused = true;
+
+  if (pthread_mutex_unlock(&free_sessions_lock) != 0) {
+    exit(EXIT_FAILURE);
+  }
+  return available;
 }
 
-void create_event(int fd_req, int fd_resp, worker_client_t *client) {
-  unsigned int event_id;
-  size_t num_rows;
-  size_t num_cols;
+/// Takes an unused entry of the session table.
+/// @note Must only be called after session_available returned true.
+/// @return Session to be given to a new client.
+static worker_client_t *acquire_session() {
+  if (pthread_mutex_lock(&free_sessions_lock) != 0) {
+    exit(EXIT_FAILURE);
+  }
+
+  worker_client_t *client = &sessions[free_sessions[--num_free_sessions]];
 
-  if(pthread_mutex_lock(&client->lock) != 0) {
+  if (pthread_mutex_unlock(&free_sessions_lock) != 0) {
     exit(EXIT_FAILURE);
   }
-  ssize_t ret = read(fd_req, &event_id, sizeof(unsigned int));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: read failed\n");
-    client->opcode = 2;
+
+  // Not shared until its task is submitted
+  client->state = SESSION_CONNECTING;
+  stats_record_session(1);
+  return client;
+}
+
+/// Returns a closed session to the table, resuming registrations if they were paused.
+/// @param client Session to be released.
+static void release_session(worker_client_t *client) {
+  client->state = SESSION_FREE;
+  stats_record_session(-1);
+
+  if (pthread_mutex_lock(&free_sessions_lock) != 0) {
+    exit(EXIT_FAILURE);
   }
 
-  ret = read(fd_req, &num_rows, sizeof(size_t));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: read failed\n");
-    client->opcode = 2;
+  free_sessions[num_free_sessions++] = client->session_id;
+  if (registrations_paused) {
+    registrations_paused = false;
+    watch(fd_server, NULL, EPOLL_CTL_MOD);
   }
 
-  ret = read(fd_req, &num_cols, sizeof(size_t));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: read failed\n");
-    client->opcode = 2;
+  if (pthread_mutex_unlock(&free_sessions_lock) != 0) {
+    exit(EXIT_FAILURE);
   }
+}
 
-  int success = ems_create(event_id, num_rows, num_cols);
-  ret = write(fd_resp, &success, sizeof(int));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: write failed\n");
-    client->opcode = 2;
+/// Tells whether a request changes the state, such requests run alone in their session.
+/// @note Batches count as writes whatever operations they hold.
+/// @param opcode Opcode of the request.
+/// @return true if the request writes, false if it only reads.
+static bool is_write(char opcode) {
+  return opcode == OP_CODE_CREATE || opcode == OP_CODE_RESERVE || opcode == OP_CODE_DELETE || opcode == OP_CODE_BATCH ||
+         opcode == OP_CODE_SUBSCRIBE;
+}
+
+/// Tells whether a queued request may run, only earlier requests of its logical session hold it back.
+/// @note Must be called with the session lock held. Reads run in parallel with
+/// each other, a write waits for every earlier request and holds back later ones.
+/// @param client Session of the request.
+/// @param task Request to be checked.
+/// @return true if the request may run now, false otherwise.
+static bool may_run(worker_client_t *client, const struct Task *task) {
+  bool write = is_write((char)task->header.opcode);
+
+  for (const struct Task *earlier = client->head; earlier != task; earlier = earlier->next) {
+    if (earlier->logical_session == task->logical_session && earlier->state != REQUEST_DONE &&
+        (write || is_write((char)earlier->header.opcode))) {
+      return false;
+    }
   }
+  return true;
+}
 
-  char op_code;
-  ret = read(fd_req, &op_code, sizeof(char));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: read failed\n");
-    client->opcode = 2;
+/// Submits every request of a session that may run now.
+/// @note Must be called with the session lock held.
+/// @param client Session whose requests are submitted.
+static void dispatch_requests(worker_client_t *client) {
+  for (struct Task *task = client->head; task != NULL; task = task->next) {
+    if (task->state == REQUEST_QUEUED && may_run(client, task)) {
+      task->state = REQUEST_RUNNING;
+      scheduler_submit(task);
+    }
   }
-  else
-    client->opcode = op_code;
+}
 
-  if(pthread_mutex_unlock(&client->lock) != 0) {
-    exit(EXIT_FAILURE);
+/// Sends a message to a client, on pipes and sockets it stays buffered until the session is flushed.
+/// @note Must be called with the session lock held.
+/// @param client Session to send to.
+/// @param header Header of the message.
+/// @param payload Payload of the message.
+/// @return 0 if the message was sent, 1 otherwise.
+static int send_reply(worker_client_t *client, const frame_header_t *header, const void *payload) {
+  stats_record_reply(sizeof(frame_header_t) + header->length);
+  if (client->shm == NULL) {
+    return write_all(&client->out, header, sizeof(frame_header_t)) ||
+           write_all(&client->out, payload, header->length);
   }
+
+  // The client sleeps on the ring itself, so whether it was woken does not matter
+  bool woken = false;
+  return shm_write(client->shm, SHM_REPLIES, header, sizeof(frame_header_t), client->fd_resp, &woken) ||
+         shm_write(client->shm, SHM_REPLIES, payload, header->length, client->fd_resp, &woken);
 }
 
-void reserve_seats(int fd_req, int fd_resp, worker_client_t *client) {
-  unsigned int event_id;
-  size_t num_seats;
+/// Writes the messages buffered for a client, so that replies sent together cost one system call.
+/// @note Must be called with the session lock held, before it is released.
+/// @param client Session to flush.
+static void flush_client(worker_client_t *client) {
+  if (client->shm != NULL) return;
 
-  if(pthread_mutex_lock(&client->lock) != 0) {
-    exit(EXIT_FAILURE);
+  if (client->broken) {
+    client->out.len = 0;
+  } else if (io_flush(&client->out) != 0) {
+    fprintf(stdout, "ERR: write failed\n");
+    client->broken = true;
   }
+}
 
-  ssize_t ret = read(fd_req, &event_id, sizeof(unsigned int));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: read failed\n");
-    client->opcode = 2;
+/// Tells whether an earlier request of the same logical session still waits for its reply to be sent.
+/// @note Must be called with the session lock held.
+/// @param client Session of the request.
+/// @param task Request to be checked.
+/// @return true if the reply must wait, false if it is next in its logical session.
+static bool reply_held_back(worker_client_t *client, const struct Task *task) {
+  for (const struct Task *earlier = client->head; earlier != task; earlier = earlier->next) {
+    if (earlier->logical_session == task->logical_session) return true;
   }
+  return false;
+}
 
-  ret = read(fd_req, &num_seats, sizeof(size_t));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: read failed\n");
-    client->opcode = 2;
+/// Sends the messages of a streamed reply that were kept until it was next in sequence.
+/// @note Must be called with the session lock held.
+/// @param client Session of the request.
+/// @param task Request being answered.
+static void send_stream(worker_client_t *client, struct Task *task) {
+  for (size_t offset = 0; offset < task->stream.len;) {
+    frame_header_t header;
+    memcpy(&header, task->stream.data + offset, sizeof(frame_header_t));
+    offset += sizeof(frame_header_t);
+
+    if (!client->broken && send_reply(client, &header, task->stream.data + offset) != 0) {
+      fprintf(stdout, "ERR: write failed\n");
+      client->broken = true;
+    }
+    offset += header.length;
   }
+  task->stream.len = 0;
+}
 
-  size_t* xs = malloc(sizeof(size_t) * num_seats);
+/// Sends the part of a streamed reply built so far as one message, or keeps it until the reply is next in sequence.
+/// @param reply Part of the reply, emptied but for the logical session it starts with.
+/// @param arg Request being answered.
+/// @return 0 if the reply goes on, 1 if it can no longer be sent.
+static int send_chunk(buffer_t *reply, void *arg) {
+  struct Task *task = arg;
+  worker_client_t *client = task->client;
+  frame_header_t header = task->header;
+  header.flags |= FRAME_FLAG_MORE;
+  header.length = (uint32_t)reply->len;
+
+  if (pthread_mutex_lock(&client->lock) != 0) {
+    exit(EXIT_FAILURE);
+  }
 
-  if (xs == NULL) {
+  if (reply->len > UINT32_MAX) {
     fprintf(stdout, "ERR: failed to allocate memory\n");
-    client->opcode = 2;
+    client->broken = true;
+  } else if (!reply_held_back(client, task)) {
+    send_stream(client, task);
+    if (!client->broken && send_reply(client, &header, reply->data) != 0) {
+      fprintf(stdout, "ERR: write failed\n");
+      client->broken = true;
+    }
+    flush_client(client);
+  } else if (buffer_append(&task->stream, &header, sizeof(frame_header_t)) ||
+             buffer_append(&task->stream, reply->data, reply->len)) {
+    fprintf(stdout, "ERR: failed to allocate memory\n");
+    client->broken = true;
   }
+  bool broken = client->broken;
 
-  ret = read(fd_req, xs, sizeof(size_t[num_seats]));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: read failed\n");
-    free(xs);
-    client->opcode = 2;
+  if (pthread_mutex_unlock(&client->lock) != 0) {
+    exit(EXIT_FAILURE);
   }
 
-  size_t* ys = malloc(sizeof(size_t) * num_seats);
+  reply->len = 0;
+  if (task->header.flags & FRAME_FLAG_SESSION) {
+    buffer_put_uint(reply, task_encoding(task), task->logical_session, sizeof(uint32_t));
+  }
+  return broken;
+}
 
-  if (ys == NULL) {
-    fprintf(stdout, "ERR: failed to allocate memory\n");
-    client->opcode = 2;
+/// Reserves room in the reply ring of a shared-memory session, so the reply is built where the client reads it
+/// instead of being copied there once built.
+/// @note Once room is reserved the session lock stays held, so nothing else goes in the ring before run_request
+/// commits the reply.
+/// @param resp Reply built so far.
+/// @param size Largest number of bytes the rest of the reply takes.
+/// @param arg Request being answered.
+/// @return Buffer over the room, or resp if the reply is not next in sequence or the room would wrap.
+static buffer_t *place_reply(buffer_t *resp, size_t size, void *arg) {
+  struct Task *task = arg;
+  worker_client_t *client = task->client;
+  if (transport != TRANSPORT_SHM) return resp;
+
+  if (pthread_mutex_lock(&client->lock) != 0) {
+    exit(EXIT_FAILURE);
   }
 
-  ret = read(fd_req, ys, sizeof(size_t[num_seats]));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: read failed\n");
-    free(xs);
-    free(ys);
-    client->opcode = 2;
+  size_t room = sizeof(frame_header_t) + resp->len + size;
+  char *slot = NULL;
+  if (client->shm != NULL && !client->broken && !resp->failed && room <= UINT32_MAX && task->stream.len == 0 &&
+      !reply_held_back(client, task)) {
+    slot = shm_reserve(client->shm, SHM_REPLIES, room);
+  }
+  if (slot == NULL) {
+    if (pthread_mutex_unlock(&client->lock) != 0) {
+      exit(EXIT_FAILURE);
+    }
+    return resp;
   }
 
-  int success = ems_reserve(event_id, num_seats, xs, ys);
-  ret = write(fd_resp, &success, sizeof(int));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: write failed\n");
-    free(xs);
-    free(ys);
-    client->opcode = 2;
+  // The header goes in front once the length is known
+  buffer_wrap(&task->placed, slot + sizeof(frame_header_t), room - sizeof(frame_header_t));
+  buffer_append(&task->placed, resp->data, resp->len);
+  return &task->placed;
+}
+
+/// Publishes a reply built in the ring by place_reply.
+/// @note Must be called with the session lock place_reply kept.
+/// @param client Session of the request.
+/// @param task Request answered.
+static void commit_reply(worker_client_t *client, struct Task *task) {
+  // The room was an upper bound of the reply, it only overflows if that bound is wrong
+  if (task->placed.failed) {
+    fprintf(stdout, "ERR: reply larger than its room in the ring\n");
+    client->broken = true;
+    return;
   }
 
-  free(ys);
-  free(xs);
+  frame_header_t header = task->header;
+  header.length = (uint32_t)task->placed.len;
+  memcpy(task->placed.data - sizeof(frame_header_t), &header, sizeof(frame_header_t));
+  stats_record_reply(sizeof(frame_header_t) + header.length);
 
-  char op_code;
-  ret = read(fd_req, &op_code, sizeof(char));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: read failed\n");
-    client->opcode = 2;
+  // The client sleeps on the ring itself, so whether it was woken does not matter
+  bool woken = false;
+  shm_commit(client->shm, SHM_REPLIES, sizeof(frame_header_t) + header.length, &woken);
+}
+
+/// Adds the time a request took, until its reply was sent, to the latency metrics.
+/// @param task Request answered, every operation of a batch counts with the latency of the batch.
+static void record_latency(const struct Task *task) {
+  uint64_t latency = stats_now_ns() - task->received_ns;
+  if (task->header.opcode != OP_CODE_BATCH) {
+    stats_record_latency(task->header.opcode, latency);
+    return;
   }
-  else
-    client->opcode = op_code;
 
-  if(pthread_mutex_unlock(&client->lock) != 0) {
-    exit(EXIT_FAILURE);
+  const char *args = task->payload;
+  size_t count;
+  args = take(&count, args, sizeof(size_t));
+  for (size_t i = 0; i < count; i++) {
+    uint8_t opcode = (uint8_t)*args++;
+    stats_record_latency(opcode, latency);
+    args += operation_size(opcode, args, SIZE_MAX);
   }
 }
 
-void show_event(int fd_req, int fd_resp, worker_client_t *client) {
-  unsigned int event_id;
+/// Sends the replies that are next in sequence in their logical session.
+/// @note Must be called with the session lock held.
+/// @param client Session whose replies are sent.
+static void flush_replies(worker_client_t *client) {
+  struct Task *previous = NULL;
+
+  while (1) {
+    struct Task *task = previous == NULL ? client->head : previous->next;
+    if (task == NULL) break;
+    if (task->state != REQUEST_DONE || reply_held_back(client, task)) {
+      previous = task;
+      continue;
+    }
+
+    if (task->reply.failed || task->reply.len > UINT32_MAX) {
+      fprintf(stdout, "ERR: failed to allocate memory\n");
+      client->broken = true;
+    }
+
+    // A half-sent reply would break the stream, later replies are dropped until the client leaves
+    send_stream(client, task);
+    frame_header_t header = task->header;
+    header.length = (uint32_t)task->reply.len;
+    // A reply built in the ring was committed already
+    if (task->placed.data == NULL && !client->broken && send_reply(client, &header, task->reply.data) != 0) {
+      fprintf(stdout, "ERR: write failed\n");
+      client->broken = true;
+    }
 
-  if(pthread_mutex_lock(&client->lock) != 0) {
+    if (previous == NULL) {
+      client->head = task->next;
+    } else {
+      previous->next = task->next;
+    }
+    if (client->tail == task) client->tail = previous;
+    client->num_requests--;
+    record_latency(task);
+    buffer_free(&task->reply);
+    buffer_free(&task->stream);
+    free(task->payload);
+    free(task);
+  }
+  flush_client(client);
+}
+
+/// Closes a draining session once its last reply is sent.
+/// @note Must be called with the session lock held.
+/// @param client Session to be checked.
+/// @return true if the session was closed and must be released, false otherwise.
+static bool close_if_drained(worker_client_t *client) {
+  if (client->state != SESSION_DRAINING || client->head != NULL) return false;
+
+  // The notify task still refers to the session, it closes it once done
+  if (pthread_mutex_lock(&client->notify_lock) != 0) {
+    exit(EXIT_FAILURE);
+  }
+  bool notifying = client->notify_pending;
+  if (pthread_mutex_unlock(&client->notify_lock) != 0) {
     exit(EXIT_FAILURE);
   }
+  if (notifying) return false;
+
+  close_client(client);
+  return true;
+}
+
+/// Builds the first message of a session, also sent when it is resumed.
+/// @param client Session being set up.
+/// @param setup Buffer to append the message to.
+/// @return 0 if the message was built, 1 otherwise.
+static int put_setup(const worker_client_t *client, buffer_t *setup) {
+  // The session id is followed by the FRAME_FLAG_* bits the client may use
+  return buffer_put_uint(setup, WIRE_FIXED, (unsigned int)client->session_id, sizeof(int)) ||
+         buffer_put_uint(setup, WIRE_FIXED, FRAME_FLAG_COMPACT | FRAME_FLAG_SESSION | FRAME_FLAG_RESUME,
+                         sizeof(uint32_t));
+}
+
+/// Parses the complete requests buffered for a session and queues them.
+/// @note Must be called with the session lock held.
+/// @param client Session whose requests are parsed.
+/// @return 0 if the session may keep reading, 1 if it must stop.
+static int parse_requests(worker_client_t *client) {
+  size_t offset = 0;
+  int result = 0;
+
+  while (client->num_requests < SESSION_MAX_REQUESTS && client->in_len - offset >= sizeof(frame_header_t)) {
+    frame_header_t header;
+    memcpy(&header, client->in + offset, sizeof(frame_header_t));
+    if (header.version != PROTOCOL_VERSION || header.length > REQUEST_MAX_PAYLOAD) {
+      fprintf(stdout, "ERR: invalid request\n");
+      result = 1;
+      break;
+    }
+
+    size_t size = sizeof(frame_header_t) + header.length;
+    if (size > client->in_len - offset) break;
+
+    // Compact requests are rebuilt in the fixed layout, the flags still tell how to encode the reply
+    const char *payload = client->in + offset + sizeof(frame_header_t);
+    buffer_t fixed = {0};
+    bool compact = (header.flags & FRAME_FLAG_COMPACT) != 0;
+    uint32_t logical_session = 0;
+    // A parked session only accepts the request resuming it, which carries nothing
+    bool resume = client->parked || header.opcode == OP_CODE_CLIENT;
+    if (resume ? !client->parked || header.opcode != OP_CODE_CLIENT || header.flags != 0 || header.length != 0
+               : (header.flags & ~(FRAME_FLAG_COMPACT | FRAME_FLAG_SESSION | FRAME_FLAG_RESUME)) != 0 ||
+                     ((header.flags & FRAME_FLAG_RESUME) && header.opcode != OP_CODE_QUIT) ||
+                     ((header.flags & FRAME_FLAG_SESSION) &&
+                      take_logical_session(&header, &payload, &logical_session) != 0) ||
+                     (compact && expand_request(&header, payload, &fixed) != 0) ||
+                     !request_valid(&header, compact ? fixed.data : payload)) {
+      fprintf(stdout, fixed.failed ? "ERR: failed to allocate memory\n" : "ERR: invalid request\n");
+      buffer_free(&fixed);
+      result = 1;
+      break;
+    }
+
+    stats_record_request(size);
+
+    // Logical sessions only live in their requests, a QUIT ends the whole connection unless the
+    // client keeps it to resume the session
+    if (header.opcode == OP_CODE_QUIT) {
+      if ((header.flags & FRAME_FLAG_RESUME) == 0 || client->broken) {
+        result = 1;
+        break;
+      }
+      client->parked = true;
+      offset += size;
+      continue;
+    }
+
+    struct Task *task = malloc(sizeof(struct Task));
+    char *copy = compact ? fixed.data : header.length > 0 ? malloc(header.length) : NULL;
+    if (task == NULL || (header.length > 0 && copy == NULL)) {
+      fprintf(stdout, "ERR: failed to allocate memory\n");
+      free(task);
+      free(copy);
+      result = 1;
+      break;
+    }
+
+    if (!compact && header.length > 0) memcpy(copy, payload, header.length);
+    task->kind = TASK_REQUEST;
+    task->client = client;
+    task->state = REQUEST_QUEUED;
+    task->logical_session = logical_session;
+    task->next = NULL;
+    task->header = header;
+    task->payload = copy;
+    task->reply = (buffer_t){0};
+    task->stream = (buffer_t){0};
+    task->placed = (buffer_t){0};
+    task->received_ns = stats_now_ns();
+
+    // The reply starts with the logical session too
+    if (header.flags & FRAME_FLAG_SESSION) {
+      buffer_put_uint(&task->reply, task_encoding(task), logical_session, sizeof(uint32_t));
+    }
 
-  ssize_t ret = read(fd_req, &event_id, sizeof(unsigned int));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: read failed\n");
-    client->opcode = 2;
+    // A resume is answered right away, after the replies to the requests sent before the QUIT
+    if (resume) {
+      client->parked = false;
+      task->state = REQUEST_DONE;
+      put_setup(client, &task->reply);
+    }
+
+    if (client->tail == NULL) {
+      client->head = task;
+    } else {
+      client->tail->next = task;
+    }
+    client->tail = task;
+    client->num_requests++;
+    offset += size;
   }
 
-  ems_show(fd_resp, event_id);
+  // Keeps the start of an incomplete request for the next time the pipe is readable
+  memmove(client->in, client->in + offset, client->in_len - offset);
+  client->in_len -= offset;
+  return result;
+}
+
+/// Maps the channel a new client created, whose name is the first message on its connection.
+/// @param client Session given to the client, with the connection already set.
+/// @return 0 if the channel was mapped, 1 otherwise.
+static int attach_channel(worker_client_t *client) {
+  char msg[sizeof(frame_header_t) + SHM_NAME_SIZE];
+  frame_header_t header;
 
-  char op_code;
-  ret = read(fd_req, &op_code, sizeof(char));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: read failed\n");
-    client->opcode = 2;
+  ssize_t ret;
+  do {
+    ret = recv(client->fd_req, msg, sizeof(msg), 0);
+  } while (ret < 0 && errno == EINTR);
+  if (ret < (ssize_t)sizeof(frame_header_t)) {
+    fprintf(stdout, "ERR: failed to read the channel name\n");
+    return 1;
   }
-  else
-    client->opcode = op_code;
 
-  if(pthread_mutex_unlock(&client->lock) != 0) {
-    exit(EXIT_FAILURE);
+  memcpy(&header, msg, sizeof(frame_header_t));
+  if (header.version != PROTOCOL_VERSION || header.opcode != OP_CODE_CLIENT || header.length == 0 ||
+      header.length >= SHM_NAME_SIZE || (size_t)ret != sizeof(frame_header_t) + header.length) {
+    fprintf(stdout, "ERR: invalid channel name\n");
+    return 1;
   }
+
+  char name[SHM_NAME_SIZE];
+  memcpy(name, msg + sizeof(frame_header_t), header.length);
+  name[header.length] = '\0';
+  client->shm = shm_attach(name);
+  if (client->shm == NULL) {
+    fprintf(stdout, "ERR: failed to map channel %s\n", name);
+    return 1;
+  }
+
+  // The server waits in the event loop until the first request, so the client must ring for it
+  shm_sleep(client->shm, SHM_REQUESTS);
+  return 0;
 }
 
-void list_events(worker_client_t *client) {
+/// Runs the setup handshake of a new client: sends the session id as the first message on the response pipe.
+/// @param client Session given to the client, with the pipes or the connection already open.
+/// @return 0 if the client is connected, 1 otherwise.
+static int accept_client(worker_client_t *client) {
+  // Pipes were opened and connections accepted by the event loop, the channel is mapped before answering
+  if (transport == TRANSPORT_SHM && attach_channel(client) != 0) {
+    close_client(client);
+    return 1;
+  }
 
-  if(pthread_mutex_lock(&client->lock) != 0) {
+  buffer_t setup = {0};
+  put_setup(client, &setup);
+  frame_header_t header = {PROTOCOL_VERSION, OP_CODE_CLIENT, 0, (uint32_t)setup.len, 0};
+  // The connection is shared by both directions, so it stays blocking and is read with MSG_DONTWAIT
+  io_writer_init(&client->out, client->fd_resp, max_write);
+  if (setup.failed || write_all(&client->out, &header, sizeof(frame_header_t)) != 0 ||
+      write_all(&client->out, setup.data, setup.len) != 0 || io_flush(&client->out) != 0) {
+    fprintf(stdout, "ERROR write failed\n");
+    buffer_free(&setup);
+    close_client(client);
+    return 1;
+  }
+  buffer_free(&setup);
+
+  client->in_len = 0;
+  client->broken = false;
+  client->parked = false;
+  client->head = NULL;
+  client->tail = NULL;
+  client->num_requests = 0;
+  client->num_subscriptions = 0;
+  client->notices.len = 0;
+  client->num_notices = 0;
+  client->notices_dropped = false;
+  // The pipe may be readable as soon as it is watched
+  if (pthread_mutex_lock(&client->lock) != 0) {
+    exit(EXIT_FAILURE);
+  }
+  client->state = SESSION_READING;
+  watch(client->fd_req, client, EPOLL_CTL_ADD);
+  if (pthread_mutex_unlock(&client->lock) != 0) {
     exit(EXIT_FAILURE);
   }
+  return 0;
+}
 
-  ems_list_events(client->fd_resp, client->fd_req, client);
-  
+/// Reads request bytes of a session without blocking.
+/// @param client Session to read from.
+/// @param dest Where the bytes go.
+/// @param room Largest number of bytes to read.
+/// @return Like read(), -1 with errno EAGAIN when nothing is pending.
+static ssize_t read_requests(worker_client_t *client, char *dest, size_t room) {
+  switch (transport) {
+    case TRANSPORT_PIPES:
+      return read(client->fd_req, dest, room);
+    case TRANSPORT_SOCKET:
+      // Requests are never split across packets, so a packet always fits in the space left
+      return recv(client->fd_req, dest, room, MSG_DONTWAIT);
+    case TRANSPORT_SHM:
+      break;
+  }
+
+  while (1) {
+    size_t copied = shm_read(client->shm, SHM_REQUESTS, dest, room);
+    if (copied > 0) return (ssize_t)copied;
 
-  if(pthread_mutex_unlock(&client->lock) != 0) {
+    // Doorbells only wake the event loop, the end of the connection means the client left
+    char bells[64];
+    ssize_t ret;
+    do {
+      ret = recv(client->fd_req, bells, sizeof(bells), MSG_DONTWAIT);
+    } while (ret > 0 || (ret < 0 && errno == EINTR));
+    if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return ret;
+
+    // The client rings once it sees the flag, and requests written before it are read now
+    if (shm_sleep(client->shm, SHM_REQUESTS)) {
+      errno = EAGAIN;
+      return -1;
+    }
+  }
+}
+
+/// Reads whatever a session sent and queues its complete requests.
+/// @param client Session whose request pipe is readable.
+static void read_session(worker_client_t *client) {
+  if (pthread_mutex_lock(&client->lock) != 0) {
     exit(EXIT_FAILURE);
   }
 
-}
+  bool stop = parse_requests(client) != 0;
+  while (!stop && client->num_requests < SESSION_MAX_REQUESTS) {
+    ssize_t ret = read_requests(client, client->in + client->in_len, sizeof(client->in) - client->in_len);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (ret < 0) {
+      fprintf(stdout, "ERR: read failed\n");
+    }
+    if (ret <= 0) {
+      stop = true;
+      break;
+    }
 
-void close_client(worker_client_t *client) {
+    client->in_len += (size_t)ret;
+    stop = parse_requests(client) != 0;
+  }
+
+  flush_replies(client);
+  dispatch_requests(client);
+
+  if (stop) {
+    client->state = SESSION_DRAINING;
+    drop_subscriptions(client);
+  } else if (client->num_requests >= SESSION_MAX_REQUESTS) {
+    // Resumed by the request that brings the session back under the limit
+    client->state = SESSION_PAUSED;
+  } else {
+    watch(client->fd_req, client, EPOLL_CTL_MOD);
+  }
 
-  if(pthread_mutex_lock(&client->lock) != 0) {
+  bool closed = close_if_drained(client);
+  if (pthread_mutex_unlock(&client->lock) != 0) {
     exit(EXIT_FAILURE);
   }
+  if (closed) release_session(client);
+}
 
-  close(client->fd_req);
-  close(client->fd_resp);
+/// Runs one operation and appends its reply.
+/// @param task Request being answered.
+/// @param opcode Opcode of the operation, the one of the request unless it is part of a batch.
+/// @param args Fixed payload of the operation.
+static void run_operation(struct Task *task, uint8_t opcode, const char *args) {
+  switch (opcode) {
+    case OP_CODE_CREATE:
+      create_event(task, args);
+      break;
+    case OP_CODE_RESERVE:
+      reserve_seats(task, args);
+      break;
+    case OP_CODE_DELETE:
+      delete_event(task, args);
+      break;
+    case OP_CODE_SHOW:
+      // Only a reply of its own can be built in the ring, not one inside a batch
+      show_event(task, args, task->header.opcode == OP_CODE_SHOW ? place_reply : NULL);
+      break;
+    case OP_CODE_SHOW_SINCE:
+      // Only a reply of its own can be streamed or built in the ring, not one inside a batch
+      if (task->header.opcode == OP_CODE_SHOW_SINCE) {
+        show_event_since(task, args, send_chunk, place_reply);
+      } else {
+        show_event_since(task, args, NULL, NULL);
+      }
+      break;
+    case OP_CODE_LIST_PAGE:
+      list_events_page(task, args);
+      break;
+    case OP_CODE_SUBSCRIBE:
+      subscribe_event(task, args);
+      break;
+    case OP_CODE_STATS:
+      show_stats(task);
+      break;
+    default:
+      break;
+  }
+}
 
-  if(pthread_mutex_unlock(&client->lock) != 0) {
-    exit(EXIT_FAILURE);
+/// Runs the operations of a batch in order, the reply of each one prefixed with its size.
+/// @param task Batch request being answered.
+/// @param args Fixed payload of the batch.
+static void run_batch(struct Task *task, const char *args) {
+  wire_encoding_t encoding = task_encoding(task);
+  size_t count;
+
+  args = take(&count, args, sizeof(size_t));
+  buffer_t reply = {0};
+  // Keeps the logical session a multiplexed reply starts with
+  if (task->reply.len > 0) buffer_append(&reply, task->reply.data, task->reply.len);
+  buffer_put_uint(&reply, encoding, count, sizeof(size_t));
+
+  // Each operation replies in the task's buffer, so its size is known before it is copied
+  for (size_t i = 0; i < count; i++) {
+    uint8_t opcode = (uint8_t)*args++;
+    task->reply.len = 0;
+    run_operation(task, opcode, args);
+    args += operation_size(opcode, args, SIZE_MAX);
+
+    if (task->reply.failed || buffer_put_uint(&reply, encoding, task->reply.len, sizeof(size_t)) ||
+        buffer_append(&reply, task->reply.data, task->reply.len)) {
+      reply.failed = true;
+      break;
+    }
   }
 
+  buffer_free(&task->reply);
+  task->reply = reply;
 }
 
-void *handle_messages(void *args) {
-  
-  worker_client_t *client =   (worker_client_t *)args;
+/// Runs one request and sends every reply that became next in sequence.
+/// @param task Request to be run.
+static void run_request(struct Task *task) {
+  if (task->header.opcode == OP_CODE_BATCH) {
+    run_batch(task, task->payload);
+  } else {
+    run_operation(task, task->header.opcode, task->payload);
+  }
 
-  if(client->client_was_used) {
-    if(pthread_mutex_unlock(&client->lock) != 0)
-      return NULL;
+  worker_client_t *client = task->client;
+  // A reply built in the ring kept the session lock since its room was reserved
+  if (task->placed.data != NULL) {
+    commit_reply(client, task);
+  } else if (pthread_mutex_lock(&client->lock) != 0) {
+    exit(EXIT_FAILURE);
   }
 
-  if(pthread_mutex_lock(&client->lock) != 0)
-    return NULL;
+  task->state = REQUEST_DONE;
+  flush_replies(client);
+  dispatch_requests(client);
 
-  sigset_t mask;
-  sigemptyset(&mask);
-  sigaddset(&mask, SIGUSR1);
-  if(pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) {
-    fprintf(stdout, "ERROR %s\n", "Failed to mask thread");
-    return NULL;
+  // The buffered bytes may already hold the next requests, so the read task runs right away
+  if (client->state == SESSION_PAUSED && client->num_requests < SESSION_MAX_REQUESTS) {
+    client->state = SESSION_READING;
+    scheduler_submit(client->io_task);
   }
 
-  while (!client->to_execute) {
-    if (pthread_cond_wait(&client->cond, &client->lock) != 0) {
-      fprintf(stdout, "ERROR %s\n", "Failed to wait for condition variable");
-      return NULL;
-    }
+  bool closed = close_if_drained(client);
+  if (pthread_mutex_unlock(&client->lock) != 0) {
+    exit(EXIT_FAILURE);
   }
+  if (closed) release_session(client);
+}
 
-  int client_ended = 0;
-  client->client_was_used = true;
+/// Sends the notifications queued for a session, as one message each time the queue is taken.
+/// @param client Session to notify.
+static void send_notices(worker_client_t *client) {
+  if (pthread_mutex_lock(&client->lock) != 0) {
+    exit(EXIT_FAILURE);
+  }
+
+  buffer_t message = {0};
   while (1) {
-    switch (client->opcode)
-    {
-    case OP_CODE_CLIENT:
-      initialize_client(client);
+    if (pthread_mutex_lock(&client->notify_lock) != 0) {
+      exit(EXIT_FAILURE);
+    }
+    if (client->num_notices == 0 && !client->notices_dropped) {
+      client->notify_pending = false;
+      if (pthread_mutex_unlock(&client->notify_lock) != 0) {
+        exit(EXIT_FAILURE);
+      }
       break;
-    case OP_CODE_QUIT:
-      close_client(client);
-      client_ended = 1;
+    }
+
+    wire_encoding_t encoding = client->notify_encoding;
+    message.len = 0;
+    buffer_put_uint(&message, encoding, client->notices_dropped, sizeof(uint8_t));
+    buffer_put_uint(&message, encoding, client->num_notices, sizeof(size_t));
+    buffer_append(&message, client->notices.data, client->notices.len);
+    client->notices.len = 0;
+    client->num_notices = 0;
+    client->notices_dropped = false;
+    if (pthread_mutex_unlock(&client->notify_lock) != 0) {
+      exit(EXIT_FAILURE);
+    }
+
+    // Written between whole replies, since those are sent with the session lock held too
+    uint16_t flags = encoding == WIRE_COMPACT ? FRAME_FLAG_COMPACT : 0;
+    frame_header_t header = {PROTOCOL_VERSION, OP_CODE_NOTIFY, flags, (uint32_t)message.len, 0};
+    if (message.failed) {
+      fprintf(stdout, "ERR: failed to allocate memory\n");
+      client->broken = true;
+    }
+    if (!client->broken && send_reply(client, &header, message.data) != 0) {
+      fprintf(stdout, "ERR: write failed\n");
+      client->broken = true;
+    }
+  }
+  buffer_free(&message);
+  flush_client(client);
+
+  bool closed = close_if_drained(client);
+  if (pthread_mutex_unlock(&client->lock) != 0) {
+    exit(EXIT_FAILURE);
+  }
+  if (closed) release_session(client);
+}
+
+/// Runs the step of the current state of a session. Only the handshake and
+/// reading have one, the other states are left by requests finishing.
+/// @param client Session to be advanced.
+static void step_session(worker_client_t *client) {
+  if (pthread_mutex_lock(&client->lock) != 0) {
+    exit(EXIT_FAILURE);
+  }
+  session_state_t state = client->state;
+  if (pthread_mutex_unlock(&client->lock) != 0) {
+    exit(EXIT_FAILURE);
+  }
+
+  switch (state) {
+    case SESSION_CONNECTING:
+      if (accept_client(client) != 0) release_session(client);
       break;
-    case OP_CODE_CREATE:
-      create_event(client->fd_req , client->fd_resp, client);
+    case SESSION_READING:
+      read_session(client);
       break;
-    case OP_CODE_RESERVE:
-      reserve_seats(client->fd_req , client->fd_resp, client);
+    case SESSION_FREE:
+    case SESSION_PAUSED:
+    case SESSION_DRAINING:
       break;
-    case OP_CODE_SHOW:
-      show_event(client->fd_req , client->fd_resp, client);
+  }
+}
+
+static void run_task(void *arg) {
+  struct Task *task = (struct Task *)arg;
+
+  switch (task->kind) {
+    case TASK_SESSION:
+      step_session(task->client);
       break;
-    case OP_CODE_LIST:
-      list_events(client);
+    case TASK_REQUEST:
+      run_request(task);
       break;
-    default:
+    case TASK_NOTIFY:
+      send_notices(task->client);
       break;
-    
+  }
+}
+
+/// Opens the pipes of a new client without blocking, from the event loop. The request pipe opens at once, the
+/// response pipe only once the client opened it for reading, so until then the session waits in half_open.
+/// @note A client that never opens its pipes only holds its session until its deadline, never a worker.
+/// @param client Session given to the client, with the pipe names set.
+/// @return true if the session is done with, connected or dropped, false if it is still half open.
+static bool connect_pipes(worker_client_t *client) {
+  if (client->fd_req == -1) {
+    client->fd_req = open(client->req_client_pipe, O_RDONLY | O_NONBLOCK);
+    if (client->fd_req == -1) {
+      fprintf(stderr, "[ERR]: open failed: %s\n", strerror(errno));
+      release_session(client);
+      return true;
     }
-    if(client_ended)break; 
   }
-  client->to_execute = false;
 
-  if(all_clients_are_busy) {
-    if (pthread_mutex_lock(&free_client_lock) != 0) {
-      return NULL;
-    } 
+  client->fd_resp = open(client->resp_client_pipe, O_WRONLY | O_NONBLOCK);
+  if (client->fd_resp == -1 && errno == ENXIO && stats_now_ns() < client->connect_deadline_ns) return false;
 
-    all_clients_are_busy = false;
-    if (pthread_cond_broadcast(&cond_to_wait) != 0) {
-      fprintf(stdout, "ERROR %s\n", "Couldn't signal client");
-      return NULL;
+  // Replies wait for room in the pipe, only the request pipe is read without blocking
+  if (client->fd_resp == -1 || fcntl(client->fd_resp, F_SETFL, 0) != 0) {
+    fprintf(stderr, "[ERR]: open failed: %s\n", client->fd_resp == -1 ? strerror(errno) : "fcntl");
+    if (client->fd_resp != -1) close(client->fd_resp);
+    close(client->fd_req);
+    release_session(client);
+    return true;
+  }
+
+  scheduler_submit(client->io_task);
+  return true;
+}
+
+/// Tries again to open the pipes of the half open sessions, dropping the ones past their deadline.
+static void retry_half_open(void) {
+  size_t kept = 0;
+  for (size_t i = 0; i < num_half_open; i++) {
+    if (!connect_pipes(half_open[i])) half_open[kept++] = half_open[i];
+  }
+  num_half_open = kept;
+}
+
+/// Reads registrations from the server pipe, one client at a time, and opens
+/// their pipes.
+/// @note Registrations are left in the pipe while the session table is full.
+static void read_registrations() {
+  static char msg[1 + 2 * PIPENAME_SIZE];
+  static size_t msg_len = 0;
+
+  while (1) {
+    // Bytes that cannot start a registration are skipped up to the next one already read, reading only for more
+    const char *start = memchr(msg, OP_CODE_CLIENT, msg_len);
+    size_t skipped = start == NULL ? msg_len : (size_t)(start - msg);
+    memmove(msg, msg + skipped, msg_len - skipped);
+    msg_len -= skipped;
+
+    if (msg_len == sizeof(msg)) {
+      worker_client_t *client = acquire_session();
+      memcpy(client->req_client_pipe, msg + 1, PIPENAME_SIZE);
+      memcpy(client->resp_client_pipe, msg + 1 + PIPENAME_SIZE, PIPENAME_SIZE);
+      msg_len = 0;
+
+      client->fd_req = -1;
+      client->connect_deadline_ns = stats_now_ns() + (uint64_t)CONNECT_TIMEOUT_MS * 1000000;
+      if (!connect_pipes(client)) half_open[num_half_open++] = client;
+      continue;
     }
 
-    if (pthread_mutex_unlock(&free_client_lock) != 0) {
-      return NULL;
+    if (msg_len == 0 && !session_available()) return;
+
+    ssize_t ret = read(fd_server, msg + msg_len, sizeof(msg) - msg_len);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (ret <= 0) {
+      fprintf(stdout, "ERROR %s\n", "Failed to read pipe");
+      break;
     }
 
+    msg_len += (size_t)ret;
   }
 
-  handle_messages((void *)&clients[client->session_id]);
-  if (pthread_mutex_unlock(&client->lock) != 0) {
-    return NULL;
+  watch(fd_server, NULL, EPOLL_CTL_MOD);
+}
+
+/// Accepts the pending connections on the listening socket and queues their handshakes.
+/// @note Connections are left in the backlog while the session table is full.
+static void accept_connections() {
+  while (1) {
+    if (!session_available()) return;
+
+    int fd = accept(fd_server, NULL, NULL);
+    if (fd == -1 && errno == EINTR) continue;
+    if (fd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        fprintf(stdout, "ERROR accept failed: %s\n", strerror(errno));
+      }
+      break;
+    }
+
+    worker_client_t *client = acquire_session();
+    client->fd_req = fd;
+    client->fd_resp = fd;
+    scheduler_submit(client->io_task);
   }
 
-  return 0;
+  watch(fd_server, NULL, EPOLL_CTL_MOD);
+}
+
+/// Writes a file aside and renames it over the given path, so the path always holds a whole file.
+/// @note Only makes system calls, so a process forked from the server can call it whatever its threads were doing.
+/// @param path Path of the file.
+/// @param temp Path the file is written to before the rename.
+/// @param write_fn Function writing the file.
+/// @param image Events to be written.
+/// @param sync Whether the file is synced before the rename, for a file the server is restored from.
+/// @return 0 if the file was written, 1 otherwise.
+static int write_aside(const char *path, const char *temp, int (*write_fn)(const struct EventImage *image, int fd),
+                       const struct EventImage *image, bool sync) {
+  int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  bool failed = fd == -1 || write_fn(image, fd) != 0 || (sync && fsync(fd) != 0);
+  if (fd != -1 && close(fd) != 0) failed = true;
+  return failed || rename(temp, path) != 0;
+}
+
+/// Starts writing the snapshot if there is one, and the events to EVENTS_DUMP_PATH if asked to, from a forked
+/// process. The events are captured before the fork, the child only writes them out, so it never allocates or
+/// takes a lock another thread may have held at the fork. The event loop pauses for the capture and the fork.
+/// @param print Whether the events are also written to EVENTS_DUMP_PATH.
+static void start_dump(bool print) {
+  if (print) dump_requested = 0;
+  // A failed attempt waits for the next interval like a saved snapshot
+  next_snapshot_ns = stats_now_ns() + (uint64_t)snapshot_interval_s * 1000000000;
+
+  struct EventImage *image = capture_events();
+  if (image == NULL) {
+    fprintf(stdout, "ERROR failed to capture the events\n");
+    return;
+  }
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    fprintf(stdout, "ERROR fork failed: %s\n", strerror(errno));
+    release_events(image);
+    return;
+  }
+
+  if (pid == 0) {
+    // The snapshot the server was restored from is still mapped, the rename leaves its pages untouched
+    bool failed = (print && write_aside(EVENTS_DUMP_PATH, EVENTS_DUMP_PATH ".tmp", print_events, image, false) != 0) ||
+                  (snapshot_path != NULL && write_aside(snapshot_path, snapshot_temp, save_events, image, true) != 0);
+    _exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
+  release_events(image);
+  dump_pid = pid;
+  dump_printing = print;
+}
+
+/// Collects the process writing the dump once it exited.
+/// @param wait Whether to wait for it to exit, rather than only collect it if it already did.
+static void reap_dump(bool wait) {
+  dump_finished = 0;
+
+  int status;
+  if (dump_pid == 0 || waitpid(dump_pid, &status, wait ? 0 : WNOHANG) <= 0) return;
+  dump_pid = 0;
+
+  if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+    if (dump_printing) fprintf(stdout, "Events dumped to %s\n", EVENTS_DUMP_PATH);
+    if (snapshot_path != NULL) fprintf(stdout, "Snapshot saved to %s\n", snapshot_path);
+  } else {
+    fprintf(stdout, "ERROR failed to dump the events\n");
+  }
+}
+
+/// Tells how long the event loop may wait before the next snapshot is due.
+/// @return Milliseconds to wait, -1 to wait for an event or a signal alone.
+static int snapshot_timeout(void) {
+  // A snapshot due while a dump runs starts once it ends, SIGCHLD wakes the loop then
+  if (snapshot_path == NULL || snapshot_interval_s == 0 || dump_pid != 0) return -1;
+
+  uint64_t now = stats_now_ns();
+  if (now >= next_snapshot_ns) return 0;
+  uint64_t wait_ms = (next_snapshot_ns - now + 999999) / 1000000;
+  return wait_ms > INT_MAX ? INT_MAX : (int)wait_ms;
+}
+
+/// Saves the snapshot a last time before the server exits, once the dump still running ended.
+/// @note Requests the workers are still running may finish after the capture and be missing from it.
+static void save_final_snapshot(void) {
+  if (dump_pid != 0) reap_dump(true);
+  if (snapshot_path == NULL) return;
+
+  struct EventImage *image = capture_events();
+  if (image == NULL || write_aside(snapshot_path, snapshot_temp, save_events, image, true) != 0) {
+    fprintf(stdout, "ERROR failed to save the snapshot\n");
+  } else {
+    fprintf(stdout, "Snapshot saved to %s\n", snapshot_path);
+  }
+  release_events(image);
 }
 
 int init_server() {
-  clients = malloc(sizeof(worker_client_t)*MAX_SESSION_COUNT);
+  sessions = malloc(sizeof(worker_client_t) * (size_t)session_count);
+  free_sessions = malloc(sizeof(int) * (size_t)session_count);
+  half_open = malloc(sizeof(worker_client_t *) * (size_t)session_count);
+  if (sessions == NULL || free_sessions == NULL || half_open == NULL) {
+    return -1;
+  }
 
   struct sigaction sa_sigusr1;
   memset(&sa_sigusr1, 0, sizeof(sa_sigusr1));
   sa_sigusr1.sa_handler = sig_handler;
   sigaction(SIGUSR1, &sa_sigusr1, NULL);
-  
-  for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-    clients[i].session_id = i;
-    clients[i].to_execute = false;
-    clients[i].client_was_used = false;
-    if (pthread_mutex_init(&clients[i].lock, NULL) != 0) {
-        return -1;
-    }
-    if (pthread_cond_init(&clients[i].cond, NULL) != 0) {
-        return -1;
-    }
-    if (pthread_create(&clients[i].tid, NULL, handle_messages, &clients[i]) != 0) {
-        return -1;
+
+  struct sigaction sa_sigchld;
+  memset(&sa_sigchld, 0, sizeof(sa_sigchld));
+  sa_sigchld.sa_handler = sig_handler;
+  sa_sigchld.sa_flags = SA_NOCLDSTOP;
+  sigaction(SIGCHLD, &sa_sigchld, NULL);
+
+  // Stopping saves the snapshot first
+  struct sigaction sa_stop;
+  memset(&sa_stop, 0, sizeof(sa_stop));
+  sa_stop.sa_handler = sig_handler;
+  sigaction(SIGTERM, &sa_stop, NULL);
+  sigaction(SIGINT, &sa_stop, NULL);
+
+  // A client that leaves early must not take the server down with it
+  struct sigaction sa_sigpipe;
+  memset(&sa_sigpipe, 0, sizeof(sa_sigpipe));
+  sa_sigpipe.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa_sigpipe, NULL);
+
+  // Every session holds two pipes, the soft limit is often too low for a full table
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  // Lowest ids are handed out first
+  num_free_sessions = session_count;
+  for (int i = 0; i < session_count; i++) {
+    sessions[i].session_id = i;
+    sessions[i].state = SESSION_FREE;
+    sessions[i].shm = NULL;
+    sessions[i].notices = (buffer_t){0};
+    sessions[i].notify_pending = false;
+    sessions[i].notify_encoding = WIRE_FIXED;
+    sessions[i].io_task = malloc(sizeof(struct Task));
+    sessions[i].notify_task = malloc(sizeof(struct Task));
+    if (sessions[i].io_task == NULL || sessions[i].notify_task == NULL ||
+        pthread_mutex_init(&sessions[i].lock, NULL) != 0 || pthread_mutex_init(&sessions[i].notify_lock, NULL) != 0) {
+      return -1;
     }
+    sessions[i].io_task->kind = TASK_SESSION;
+    sessions[i].io_task->client = &sessions[i];
+    sessions[i].notify_task->kind = TASK_NOTIFY;
+    sessions[i].notify_task->client = &sessions[i];
+    free_sessions[i] = session_count - 1 - i;
   }
-  if (pthread_mutex_init(&server_pipe_lock, NULL) != 0) {
+
+  if (pthread_mutex_init(&free_sessions_lock, NULL) != 0) {
     return -1;
   }
-  if (pthread_mutex_init(&free_client_lock, NULL) != 0) {
+
+  epoll_fd = epoll_create1(0);
+  if (epoll_fd == -1) {
     return -1;
   }
-  if (pthread_cond_init(&cond_to_wait, NULL) != 0) {
+
+  // Workers inherit a mask without these signals, the event loop only takes them inside epoll_pwait,
+  // so a signal arriving between two waits is never missed
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGCHLD);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGINT);
+  if (pthread_sigmask(SIG_BLOCK, &mask, &loop_mask) != 0 || scheduler_start(worker_count, run_task) != 0) {
     return -1;
   }
   return 0;
 }
 
-void function(int parser_fn(worker_client_t*), char op_code) {
+/// Creates the server pipe where clients register.
+/// @param server_pipe Path of the pipe.
+/// @return Descriptor of the pipe, -1 on failure.
+static int open_server_pipe(const char *server_pipe) {
+  // Remove server pipe if it does exist
+  if (unlink(server_pipe) != 0 && errno != ENOENT) {
+    fprintf(stdout, "ERROR unlink(%s) failed:\n", server_pipe);
+    return -1;
+  }
 
-  int session_id = -1;
-  for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-    if (!clients[i].to_execute) {
-      session_id = i;
-      break;
-    }
+  // Create server pipe
+  if (mkfifo(server_pipe, 0666) != 0) {
+    fprintf(stdout, "ERROR mkfifo failed for pipe %s\n", server_pipe);
+    return -1;
   }
-  if(session_id < 0) {
-    if (pthread_mutex_lock(&free_client_lock) != 0) {
-      exit(EXIT_FAILURE);
-    }
-    all_clients_are_busy = true;
-    while(all_clients_are_busy) {
-      if (pthread_cond_wait(&cond_to_wait, &free_client_lock) != 0) {
-        fprintf(stdout, "ERROR %s\n", "Failed to wait for condition variable");
-        exit(EXIT_FAILURE);
-      }
-    }
-    for (int i = 0; i < MAX_SESSION_COUNT; i++) {
-    if (!clients[i].to_execute) {
-        session_id = i;
-        break;
-      }
-    }
-    if (pthread_mutex_unlock(&free_client_lock) != 0) {
-      exit(EXIT_FAILURE);
-    }
+
+  // Open server pipe for reading and writing, so it is never seen as closed
+  // between clients and registrations of concurrent clients are not lost
+  int fd;
+  do {
+    fd = open(server_pipe, O_RDWR | O_NONBLOCK);
+  } while (fd == -1 && errno == EINTR);
+  if (fd == -1) {
+    fprintf(stdout, "ERROR %s\n", "Failed to open pipe");
+    return -1;
   }
-  
-  worker_client_t *client = &clients[session_id];
-  
-  pthread_mutex_lock(&client->lock);
 
-  client->opcode = op_code;
-  int result = 0;
-  if (parser_fn != NULL) {
-      result = parser_fn(client);
+  return fd;
+}
+
+/// Creates the listening socket clients connect to.
+/// @param path Path of the socket.
+/// @return Descriptor of the socket, -1 on failure.
+static int open_listener(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stdout, "ERROR socket path too long: %s\n", path);
+    return -1;
   }
-  
-  if (pthread_mutex_lock(&server_pipe_lock) != 0) {
-    exit(EXIT_FAILURE);
+  strcpy(addr.sun_path, path);
+
+  // Remove the socket if it does exist
+  if (unlink(path) != 0 && errno != ENOENT) {
+    fprintf(stdout, "ERROR unlink(%s) failed:\n", path);
+    return -1;
   }
 
-  if (result == 0) {
-    client->to_execute = true;
-    if (pthread_cond_signal(&client->cond) != 0) {
-      fprintf(stdout, "ERROR %s\n", "Couldn't signal client");
-      exit(EXIT_FAILURE);
-    }
-  } else {
-    fprintf(stdout, "ERROR %s\n", "Failed to execute client");
-    exit(EXIT_FAILURE);
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (fd == -1 || fcntl(fd, F_SETFL, O_NONBLOCK) != 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    fprintf(stdout, "ERROR failed to listen on %s: %s\n", path, strerror(errno));
+    if (fd != -1) close(fd);
+    return -1;
   }
-  pthread_mutex_unlock(&client->lock);
+
+  return fd;
+}
+
+/// Parses an optional positive integer argument.
+/// @param arg Argument to be parsed.
+/// @param max Largest accepted value.
+/// @param value Pointer to the variable to store the value in.
+/// @return 0 if the argument is valid, 1 otherwise.
+static int parse_count(const char *arg, long max, int *value) {
+  char *endptr;
+  long count = strtol(arg, &endptr, 10);
+  if (*endptr != '\0' || count <= 0 || count > max) {
+    return 1;
+  }
+  *value = (int)count;
+  return 0;
 }
 
 int main(int argc, char* argv[]) {
-  if (argc < 2 || argc > 3) {
-    fprintf(stderr, "Usage: %s\n <pipe_path> [delay]\n", argv[0]);
+  if (argc < 2 || argc > 7) {
+    fprintf(stderr,
+            "Usage: %s\n <pipe_path | unix:socket_path | shm:socket_path> [delay] [workers] [sessions] [snapshot_path]"
+            " [snapshot_interval_s]\n"
+            " The snapshot is saved every snapshot_interval_s seconds (%d by default, 0 for never), on SIGUSR1 along\n"
+            " with the dump of the events to %s, and on SIGTERM or SIGINT before exiting\n",
+            argv[0], SNAPSHOT_INTERVAL_S, EVENTS_DUMP_PATH);
     return 1;
   }
 
   char* endptr;
   unsigned int state_access_delay_us = STATE_ACCESS_DELAY_US;
-  if (argc == 3) {
+  if (argc >= 3) {
     unsigned long int delay = strtoul(argv[2], &endptr, 10);
 
     if (*endptr != '\0' || delay > UINT_MAX) {
@@ -474,77 +1662,103 @@ int main(int argc, char* argv[]) {
     state_access_delay_us = (unsigned int)delay;
   }
 
-  if (ems_init(state_access_delay_us)) {
-    fprintf(stderr, "ERROR failed to initialize EMS\n");
+  if (argc >= 4 && parse_count(argv[3], INT_MAX, &worker_count) != 0) {
+    fprintf(stderr, "ERROR invalid number of workers\n");
     return 1;
   }
 
-  if (init_server() != 0) {
-    fprintf(stdout, "ERROR %s\n", "Failed to init server\n");
+  // Session ids are sent as an int, the table has no other bound
+  if (argc >= 5 && parse_count(argv[4], INT_MAX, &session_count) != 0) {
+    fprintf(stderr, "ERROR invalid number of sessions\n");
     return 1;
   }
 
-  //TODO: Intialize server, create worker threads
-  server_pipe = argv[1];
+  // The events are restored from the snapshot, which is saved again on an interval and by signals
+  if (argc >= 6) {
+    snapshot_path = argv[5];
+    if (snprintf(snapshot_temp, sizeof(snapshot_temp), "%s.tmp", snapshot_path) >= (int)sizeof(snapshot_temp)) {
+      fprintf(stderr, "ERROR snapshot path too long\n");
+      return 1;
+    }
+  }
 
-  // Remove server pipe if it does exist
-  if (unlink(server_pipe) != 0 && errno != ENOENT) {
-    fprintf(stdout, "ERROR unlink(%s) failed:\n", server_pipe);
-    return 1;
+  if (argc >= 7) {
+    unsigned long int interval = strtoul(argv[6], &endptr, 10);
+
+    if (*endptr != '\0' || interval > UINT_MAX) {
+      fprintf(stderr, "ERROR invalid snapshot interval or value too large\n");
+      return 1;
+    }
+
+    snapshot_interval_s = (unsigned int)interval;
   }
+  next_snapshot_ns = stats_now_ns() + (uint64_t)snapshot_interval_s * 1000000000;
 
-  // Create server pipe
-  if (mkfifo(server_pipe, 0666) != 0) {
-    fprintf(stdout, "ERROR mkfifo failed for pipe %s\n", server_pipe);
+  if (ems_init(state_access_delay_us, snapshot_path)) {
+    fprintf(stderr, "ERROR failed to initialize EMS\n");
     return 1;
   }
+  ems_set_notify(queue_notice);
 
-  char op_code;
-  ssize_t ret;
-  while(1) {
-
-    // Open server pipe for reading
-    // This waits for someone to open it for writing
-    do {
-      fd_server = open(server_pipe, O_RDONLY);
-    } while (fd_server == -1 && errno == EINTR);
-
-    do {
-      ret = read(fd_server, &op_code, sizeof(char));
-    } while (ret < 0 && errno == EINTR);
+  if (init_server() != 0) {
+    fprintf(stdout, "ERROR %s\n", "Failed to init server\n");
+    return 1;
+  }
 
-    while(ret > 0) {
-      function(NULL, op_code);
-      if (pthread_mutex_lock(&server_pipe_lock) != 0) {
-        return 1;
-      }
+  // The transport is chosen by the path, clients select it the same way
+  if (strncmp(argv[1], SOCKET_PATH_PREFIX, strlen(SOCKET_PATH_PREFIX)) == 0) {
+    transport = TRANSPORT_SOCKET;
+    max_write = SOCKET_PACKET_SIZE;
+    fd_server = open_listener(argv[1] + strlen(SOCKET_PATH_PREFIX));
+  } else if (strncmp(argv[1], SHM_PATH_PREFIX, strlen(SHM_PATH_PREFIX)) == 0) {
+    transport = TRANSPORT_SHM;
+    max_write = SOCKET_PACKET_SIZE;
+    fd_server = open_listener(argv[1] + strlen(SHM_PATH_PREFIX));
+  } else {
+    fd_server = open_server_pipe(argv[1]);
+  }
+  if (fd_server == -1) {
+    return 1;
+  }
+  watch(fd_server, NULL, EPOLL_CTL_ADD);
+
+  // Event loop: only hands readable pipes to the scheduler, never blocks on a client
+  struct epoll_event events[EPOLL_BATCH_SIZE];
+  while (!stop_requested) {
+    if (dump_finished) reap_dump(false);
+    // A dump asked for while one is running starts once it ends
+    if (dump_requested && dump_pid == 0) start_dump(true);
+    // Between signals the snapshot is saved on its own every interval
+    if (snapshot_timeout() == 0) start_dump(false);
+    retry_half_open();
+
+    // Half open sessions are tried again every CONNECT_RETRY_MS, nothing wakes the loop when a client opens a pipe
+    int timeout = snapshot_timeout();
+    if (num_half_open > 0 && (timeout == -1 || timeout > CONNECT_RETRY_MS)) timeout = CONNECT_RETRY_MS;
+
+    int count = epoll_pwait(epoll_fd, events, EPOLL_BATCH_SIZE, timeout, &loop_mask);
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stdout, "ERROR epoll_pwait failed: %s\n", strerror(errno));
+      break;
+    }
 
-      // Open server pipe for reading
-      // This waits for someone to open it for writing
-      do {
-        fd_server = open(server_pipe, O_RDONLY);
-      } while (fd_server == -1 && errno == EINTR);
-      
-      do {
-        ret = read(fd_server, &op_code, sizeof(char));
-      } while (ret < 0 && errno == EINTR);
-
-      if (pthread_mutex_unlock(&server_pipe_lock) != 0) {
-        return 1;
+    for (int i = 0; i < count; i++) {
+      worker_client_t *client = (worker_client_t *)events[i].data.ptr;
+      if (client == NULL) {
+        if (transport != TRANSPORT_PIPES) {
+          accept_connections();
+        } else {
+          read_registrations();
+        }
+      } else {
+        scheduler_submit(client->io_task);
       }
     }
-    if (ret < 0) {
-      fprintf(stdout, "ERROR %s\n", "Failed to read pipe");
-      return 1;
-    }
-    
-    if (close(fd_server) < 0) {
-      fprintf(stdout, "ERROR failed to close pipe\n");
-      return 1;
-    }
-    
   }
 
-  ems_terminate();
+  close(fd_server);
+  save_final_snapshot();
+  // Workers may still be running requests, the state is left for the exit to reclaim
   return 0;
-}
\ No newline at end of file
+}
@@ -1,20 +1,90 @@
+#include <sys/mman.h>
+
 #include "common/io.h"
+#include "epoch.h"
 #include "eventlist.h"
+#include "operations.h"
+#include "stats.h"
 
 static struct EventList* event_list = NULL;
 static unsigned int state_access_delay_us = 0;
+static _Atomic uint64_t last_version = 0;  // Last version given to an event
+static ems_notify_fn notify_fn = NULL;
+
+// Snapshot of the events, written by save_events and mapped back by ems_init. Integers are in the byte
+// order of the machine, a snapshot restarts a server on the host that saved it.
+// The header takes the first page, the index and the seats each start on a page, so restoring only reads
+// the index and the seats are paged in by the first request that touches them
+#define SNAPSHOT_MAGIC "EMSSNAP1"
+
+struct SnapshotHeader {
+  char magic[8];          // SNAPSHOT_MAGIC, without the terminator
+  uint64_t last_version;  // Last version given to an event
+  uint64_t num_events;    // Entries in the index
+  uint64_t index_offset;  // Offset of the index
+  uint64_t size;          // Size of the whole snapshot, a smaller file was cut short
+};
+
+// Entry of the snapshot index, one per event in list order
+struct SnapshotEntry {
+  uint32_t id;
+  uint32_t reservations;
+  uint64_t rows;
+  uint64_t cols;
+  uint64_t version;       // Version of the seats saved
+  uint64_t seats_offset;  // Offset of the seats, rows * cols unsigned ints row by row
+};
+
+// Events gathered by capture_events, everything save_events and print_events need without the event list
+struct EventImage {
+  uint64_t last_version;        // Last version given to an event
+  size_t num_events;            // Events in the index, in list order
+  struct SnapshotEntry* index;  // Index of the snapshot, with the offset of the seats of each event
+  const struct SeatMap** seats; // Seats of each event, the maps current when captured
+  size_t index_offset;          // Offset of the index in the snapshot
+  size_t size;                  // Size of the whole snapshot
+  bool in_epoch;                // The seats are held by an epoch section of the capturing thread
+};
+
+static void* snapshot = NULL;  // Snapshot the restored seats are mapped from, until ems_terminate
+static size_t snapshot_size = 0;
+
+/// Locks the mutex of an event, records how long it was waited for and starts timing how long it is held.
+/// @param event Event to be locked.
+/// @param locked_at Variable to store the time the mutex was taken at.
+/// @return 0 if the mutex was locked, 1 otherwise.
+static int lock_event(struct Event* event, uint64_t* locked_at) {
+  uint64_t start = stats_now_ns();
+  if (pthread_mutex_lock(&event->mutex) != 0) {
+    fprintf(stderr, "Error locking mutex\n");
+    return 1;
+  }
+
+  *locked_at = stats_now_ns();
+  stats_record_lock_wait(*locked_at - start);
+  return 0;
+}
+
+/// Unlocks the mutex of an event and adds the time it was held to the lock metrics.
+/// @param event Event to be unlocked.
+/// @param locked_at Time the mutex was taken at.
+static void unlock_event(struct Event* event, uint64_t locked_at) {
+  uint64_t held = stats_now_ns() - locked_at;
+  pthread_mutex_unlock(&event->mutex);
+
+  stats_record_lock_hold(held);
+}
 
 /// Gets the event with the given ID from the state.
 /// @note Will wait to simulate a real system accessing a costly memory resource.
+/// @note Must be called inside an epoch section or with the list lock held.
 /// @param event_id The ID of the event to get.
-/// @param from First node to be searched.
-/// @param to Last node to be searched.
 /// @return Pointer to the event if found, NULL otherwise.
-static struct Event* get_event_with_delay(unsigned int event_id, struct ListNode* from, struct ListNode* to) {
+static struct Event* get_event_with_delay(unsigned int event_id) {
   struct timespec delay = {0, state_access_delay_us * 1000};
   nanosleep(&delay, NULL);  // Should not be removed
 
-  return get_event(event_list, event_id, from, to);
+  return get_event(event_list, event_id);
 }
 
 /// Gets the index of a seat.
@@ -25,7 +95,179 @@ static struct Event* get_event_with_delay(unsigned int event_id, struct ListNode
 /// @return Index of the seat.
 static size_t seat_index(struct Event* event, size_t row, size_t col) { return (row - 1) * event->cols + col - 1; }
 
-int ems_init(unsigned int delay_us) {
+/// Rounds an offset up to a multiple of an alignment.
+/// @param offset Offset to be rounded.
+/// @param alignment Alignment, a page size.
+/// @return Smallest multiple of the alignment not below the offset.
+static size_t align_up(size_t offset, size_t alignment) { return (offset + alignment - 1) / alignment * alignment; }
+
+/// Gets the reservation of a seat.
+/// @param seats Seat map to read from.
+/// @param seat Index of the seat, row by row.
+/// @return Id of the reservation of the seat, 0 if it is free.
+static unsigned int seat_at(const struct SeatMap* seats, size_t seat) {
+  return seats->chunks[seat / SEAT_CHUNK_SIZE][seat % SEAT_CHUNK_SIZE];
+}
+
+/// Gets the number of seats in a chunk.
+/// @param num_seats Number of seats of the event.
+/// @param chunk Index of the chunk.
+/// @return SEAT_CHUNK_SIZE, or fewer for the last chunk.
+static size_t chunk_seats(size_t num_seats, size_t chunk) {
+  size_t left = num_seats - chunk * SEAT_CHUNK_SIZE;
+  return left < SEAT_CHUNK_SIZE ? left : SEAT_CHUNK_SIZE;
+}
+
+/// Frees a seat map that was never published, with the chunks allocated for it.
+/// @param seats Seat map to be freed.
+/// @param mapped Seats restored from a snapshot the chunks may point into, NULL if none.
+static void free_seat_map(struct SeatMap* seats, const unsigned int* mapped) {
+  if (mapped == NULL) {
+    for (size_t i = 0; i < seats->num_chunks; i++) free(seats->chunks[i]);
+  }
+  free(seats);
+}
+
+/// Creates the first seat map of an event, not yet published.
+/// @param num_seats Number of seats of the event.
+/// @param mapped Seats restored from a snapshot, NULL to start with every seat free.
+/// @return Newly created seat map, NULL on failure.
+static struct SeatMap* new_seat_map(size_t num_seats, const unsigned int* mapped) {
+  size_t num_chunks = (num_seats + SEAT_CHUNK_SIZE - 1) / SEAT_CHUNK_SIZE;
+  struct SeatMap* seats = calloc(1, sizeof(struct SeatMap) + num_chunks * sizeof(unsigned int*));
+  if (seats == NULL) {
+    fprintf(stderr, "Error allocating memory for event data\n");
+    return NULL;
+  }
+
+  // Chunks left in the snapshot are never written, a reservation copies them first
+  for (; seats->num_chunks < num_chunks; seats->num_chunks++) {
+    size_t chunk = seats->num_chunks;
+    seats->chunks[chunk] = mapped != NULL ? (unsigned int*)(mapped + chunk * SEAT_CHUNK_SIZE)
+                                          : calloc(chunk_seats(num_seats, chunk), sizeof(unsigned int));
+    if (seats->chunks[chunk] == NULL) {
+      fprintf(stderr, "Error allocating memory for event data\n");
+      free_seat_map(seats, mapped);
+      return NULL;
+    }
+  }
+  return seats;
+}
+
+/// Creates an event, not yet in the list.
+/// @param event_id Id of the event.
+/// @param num_rows Number of rows of the event.
+/// @param num_cols Number of columns of the event.
+/// @param seats Seats of the event, owned by the event once created.
+/// @param mapped Seats restored from a snapshot the chunks point into, NULL if none.
+/// @return Newly created event, NULL on failure.
+static struct Event* new_event(unsigned int event_id, size_t num_rows, size_t num_cols, struct SeatMap* seats,
+                               const unsigned int* mapped) {
+  struct Event* event = malloc(sizeof(struct Event));
+
+  if (event == NULL) {
+    fprintf(stderr, "Error allocating memory for event\n");
+    return NULL;
+  }
+
+  event->id = event_id;
+  event->rows = num_rows;
+  event->cols = num_cols;
+  event->subscribers = NULL;
+  if (pthread_mutex_init(&event->mutex, NULL) != 0) {
+    free(event);
+    return NULL;
+  }
+  atomic_init(&event->seats, seats);
+  event->mapped = mapped;
+  atomic_init(&event->changes_started, 0);
+  return event;
+}
+
+/// Adds the events of a snapshot to the empty state, their seats stay in the mapped file.
+/// @param path Path of the snapshot, a missing file leaves the state empty.
+/// @return 0 if the snapshot was restored, 1 otherwise.
+static int restore_snapshot(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    // A server started for the first time has no snapshot yet
+    if (errno == ENOENT) return 0;
+    fprintf(stderr, "Error opening snapshot: %s\n", strerror(errno));
+    return 1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct SnapshotHeader)) {
+    fprintf(stderr, "Invalid snapshot\n");
+    close(fd);
+    return 1;
+  }
+
+  // Pages are only read once touched, and they are never written: a reservation copies the seats it changes
+  size_t size = (size_t)st.st_size;
+  void* base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "Error mapping snapshot: %s\n", strerror(errno));
+    return 1;
+  }
+  snapshot = base;
+  snapshot_size = size;
+
+  const struct SnapshotHeader* header = base;
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 || header->size != size ||
+      header->index_offset % sizeof(uint64_t) != 0 || header->index_offset > size ||
+      header->num_events > (size - header->index_offset) / sizeof(struct SnapshotEntry)) {
+    fprintf(stderr, "Invalid snapshot\n");
+    return 1;
+  }
+
+  if (pthread_mutex_lock(&event_list->lock) != 0) {
+    fprintf(stderr, "Error locking list mutex\n");
+    return 1;
+  }
+
+  const struct SnapshotEntry* index = (const void*)((const char*)base + header->index_offset);
+  for (size_t i = 0; i < header->num_events; i++) {
+    const struct SnapshotEntry* entry = &index[i];
+    size_t num_seats = entry->rows * entry->cols;
+    if ((entry->rows != 0 && num_seats / entry->rows != entry->cols) || entry->seats_offset % sizeof(unsigned int) != 0 ||
+        entry->seats_offset > size || num_seats > (size - entry->seats_offset) / sizeof(unsigned int) ||
+        get_event(event_list, entry->id) != NULL) {
+      fprintf(stderr, "Invalid snapshot\n");
+      pthread_mutex_unlock(&event_list->lock);
+      return 1;
+    }
+
+    // The change log starts empty, clients with an older version are sent every seat
+    const unsigned int* mapped = (const void*)((const char*)base + entry->seats_offset);
+    struct SeatMap* seats = new_seat_map(num_seats, mapped);
+    if (seats == NULL) {
+      pthread_mutex_unlock(&event_list->lock);
+      return 1;
+    }
+    seats->version = entry->version;
+    seats->log_floor = entry->version;
+    seats->reservations = entry->reservations;
+
+    struct Event* event = new_event(entry->id, entry->rows, entry->cols, seats, mapped);
+    if (event == NULL || append_to_list(event_list, event) != 0) {
+      fprintf(stderr, "Error appending event to list\n");
+      pthread_mutex_unlock(&event_list->lock);
+      free_seat_map(seats, mapped);
+      free(event);
+      return 1;
+    }
+  }
+
+  pthread_mutex_unlock(&event_list->lock);
+
+  // Versions go on from the saved ones, so clients never mistake new seats for the ones they have
+  if (header->last_version > atomic_load(&last_version)) atomic_store(&last_version, header->last_version);
+  return 0;
+}
+
+int ems_init(unsigned int delay_us, const char* snapshot_path) {
   if (event_list != NULL) {
     fprintf(stderr, "EMS state has already been initialized\n");
     return 1;
@@ -33,23 +275,35 @@ int ems_init(unsigned int delay_us) {
 
   event_list = create_list();
   state_access_delay_us = delay_us;
+  if (event_list == NULL) {
+    return 1;
+  }
+
+  if (snapshot_path != NULL && restore_snapshot(snapshot_path) != 0) {
+    ems_terminate();
+    return 1;
+  }
 
-  return event_list == NULL;
+  return 0;
 }
 
+void ems_set_notify(ems_notify_fn notify) { notify_fn = notify; }
+
 int ems_terminate() {
   if (event_list == NULL) {
     fprintf(stderr, "EMS state must be initialized\n");
     return 1;
   }
 
-  if (pthread_rwlock_wrlock(&event_list->rwl) != 0) {
-    fprintf(stderr, "Error locking list rwl\n");
-    return 1;
-  }
-
   free_list(event_list);
-  pthread_rwlock_unlock(&event_list->rwl);
+  event_list = NULL;
+  epoch_shutdown();
+
+  // Every seat map pointing into the snapshot is freed by now
+  if (snapshot != NULL) {
+    munmap(snapshot, snapshot_size);
+    snapshot = NULL;
+  }
   return 0;
 }
 
@@ -59,389 +313,670 @@ int ems_create(unsigned int event_id, size_t num_rows, size_t num_cols) {
     return 1;
   }
 
-  if (pthread_rwlock_wrlock(&event_list->rwl) != 0) {
-    fprintf(stderr, "Error locking list rwl\n");
+  // Only writers serialize, readers never take this lock
+  if (pthread_mutex_lock(&event_list->lock) != 0) {
+    fprintf(stderr, "Error locking list mutex\n");
     return 1;
   }
 
-  if (get_event_with_delay(event_id, event_list->head, event_list->tail) != NULL) {
+  if (get_event_with_delay(event_id) != NULL) {
     fprintf(stderr, "Event already exists\n");
-    pthread_rwlock_unlock(&event_list->rwl);
+    pthread_mutex_unlock(&event_list->lock);
     return 1;
   }
 
-  struct Event* event = malloc(sizeof(struct Event));
-
-  if (event == NULL) {
-    fprintf(stderr, "Error allocating memory for event\n");
-    pthread_rwlock_unlock(&event_list->rwl);
-    return 1;
-  }
-
-  event->id = event_id;
-  event->rows = num_rows;
-  event->cols = num_cols;
-  event->reservations = 0;
-  if (pthread_mutex_init(&event->mutex, NULL) != 0) {
-    pthread_rwlock_unlock(&event_list->rwl);
-    free(event);
+  struct SeatMap* seats = new_seat_map(num_rows * num_cols, NULL);
+  if (seats == NULL) {
+    pthread_mutex_unlock(&event_list->lock);
     return 1;
   }
-  event->data = calloc(num_rows * num_cols, sizeof(unsigned int));
+  seats->version = atomic_fetch_add(&last_version, 1) + 1;
+  seats->log_floor = seats->version;
 
-  if (event->data == NULL) {
-    fprintf(stderr, "Error allocating memory for event data\n");
-    pthread_rwlock_unlock(&event_list->rwl);
-    free(event);
+  struct Event* event = new_event(event_id, num_rows, num_cols, seats, NULL);
+  if (event == NULL) {
+    pthread_mutex_unlock(&event_list->lock);
+    free_seat_map(seats, NULL);
     return 1;
   }
 
   if (append_to_list(event_list, event) != 0) {
     fprintf(stderr, "Error appending event to list\n");
-    pthread_rwlock_unlock(&event_list->rwl);
-    free(event->data);
+    pthread_mutex_unlock(&event_list->lock);
+    free_seat_map(seats, NULL);
     free(event);
     return 1;
   }
 
-  pthread_rwlock_unlock(&event_list->rwl);
+  pthread_mutex_unlock(&event_list->lock);
   return 0;
 }
 
-int ems_reserve(unsigned int event_id, size_t num_seats, size_t* xs, size_t* ys) {
+int ems_delete(unsigned int event_id) {
   if (event_list == NULL) {
     fprintf(stderr, "EMS state must be initialized\n");
     return 1;
   }
 
-  if (pthread_rwlock_rdlock(&event_list->rwl) != 0) {
-    fprintf(stderr, "Error locking list rwl\n");
+  if (pthread_mutex_lock(&event_list->lock) != 0) {
+    fprintf(stderr, "Error locking list mutex\n");
     return 1;
   }
 
-  struct Event* event = get_event_with_delay(event_id, event_list->head, event_list->tail);
-
-  pthread_rwlock_unlock(&event_list->rwl);
-
+  struct Event* event = get_event_with_delay(event_id);
   if (event == NULL) {
     fprintf(stderr, "Event not found\n");
+    pthread_mutex_unlock(&event_list->lock);
     return 1;
   }
 
-  if (pthread_mutex_lock(&event->mutex) != 0) {
-    fprintf(stderr, "Error locking mutex\n");
-    return 1;
+  // Reservers that already found the event notify nobody, the subscribers leave with it
+  uint64_t locked_at;
+  if (lock_event(event, &locked_at) == 0) {
+    while (event->subscribers) {
+      struct Subscriber* subscriber = event->subscribers;
+      event->subscribers = subscriber->next;
+      free(subscriber);
+    }
+    unlock_event(event, locked_at);
   }
 
+  // Readers may still hold the event, its memory is reclaimed once their epoch ends
+  int result = remove_from_list(event_list, event_id);
+
+  pthread_mutex_unlock(&event_list->lock);
+  return result;
+}
+
+/// Reserves the given seats of an event.
+/// @param event Event to reserve the seats in.
+/// @param num_seats Number of seats to reserve.
+/// @param xs Array of rows of the seats to reserve.
+/// @param ys Array of columns of the seats to reserve.
+/// @return 0 if the reservation was created successfully, 1 otherwise.
+static int reserve_in_event(struct Event* event, size_t num_seats, size_t* xs, size_t* ys) {
+  // The dimensions never change, only the seats need the mutex
   for (size_t i = 0; i < num_seats; i++) {
     if (xs[i] <= 0 || xs[i] > event->rows || ys[i] <= 0 || ys[i] > event->cols) {
       fprintf(stderr, "Seat out of bounds\n");
-      pthread_mutex_unlock(&event->mutex);
       return 1;
     }
   }
 
-  for (size_t i = 0; i < event->rows * event->cols; i++) {
-    for (size_t j = 0; j < num_seats; j++) {
-      if (seat_index(event, xs[j], ys[j]) != i) {
-        continue;
-      }
+  // The map holds only pointers, the chunks the reservation touches are copied under the mutex
+  size_t num_event_seats = event->rows * event->cols;
+  size_t num_chunks = (num_event_seats + SEAT_CHUNK_SIZE - 1) / SEAT_CHUNK_SIZE;
+  struct SeatMap* next = malloc(sizeof(struct SeatMap) + num_chunks * sizeof(unsigned int*));
+  if (next == NULL) {
+    fprintf(stderr, "Error allocating memory for event data\n");
+    return 1;
+  }
 
-      if (event->data[i] != 0) {
-        fprintf(stderr, "Seat already reserved\n");
-        pthread_mutex_unlock(&event->mutex);
-        return 1;
-      }
+  uint64_t locked_at;
+  if (lock_event(event, &locked_at) != 0) {
+    free(next);
+    return 1;
+  }
 
-      break;
+  // Only reservations publish maps and they hold the mutex, so this one stays current until unlocking
+  struct SeatMap* current = atomic_load_explicit(&event->seats, memory_order_relaxed);
+  for (size_t i = 0; i < num_seats; i++) {
+    if (seat_at(current, seat_index(event, xs[i], ys[i])) != 0) {
+      fprintf(stderr, "Seat already reserved\n");
+      unlock_event(event, locked_at);
+      free(next);
+      return 1;
     }
   }
 
-  unsigned int reservation_id = ++event->reservations;
+  next->num_chunks = num_chunks;
+  memcpy(next->chunks, current->chunks, num_chunks * sizeof(unsigned int*));
+  for (size_t i = 0; i < num_seats; i++) {
+    size_t chunk = seat_index(event, xs[i], ys[i]) / SEAT_CHUNK_SIZE;
+    if (next->chunks[chunk] != current->chunks[chunk]) continue;
+
+    size_t size = chunk_seats(num_event_seats, chunk) * sizeof(unsigned int);
+    next->chunks[chunk] = malloc(size);
+    if (next->chunks[chunk] == NULL) {
+      fprintf(stderr, "Error allocating memory for event data\n");
+      for (size_t j = 0; j < num_chunks; j++) {
+        if (next->chunks[j] != current->chunks[j] && next->chunks[j] != NULL) free(next->chunks[j]);
+      }
+      unlock_event(event, locked_at);
+      free(next);
+      return 1;
+    }
+    memcpy(next->chunks[chunk], current->chunks[chunk], size);
+  }
+
+  unsigned int reservation_id = next->reservations = current->reservations + 1;
+  next->version = atomic_fetch_add(&last_version, 1) + 1;
+  next->log_floor = current->log_floor;
+  next->num_changes = current->num_changes;
 
   for (size_t i = 0; i < num_seats; i++) {
-    event->data[seat_index(event, xs[i], ys[i])] = reservation_id;
+    size_t seat = seat_index(event, xs[i], ys[i]);
+    next->chunks[seat / SEAT_CHUNK_SIZE][seat % SEAT_CHUNK_SIZE] = reservation_id;
+
+    // Readers of an entry see it was started again before they trust what they read of it
+    struct SeatChange* change = &event->changes[next->num_changes % EVENT_CHANGE_LOG_SIZE];
+    atomic_store_explicit(&event->changes_started, ++next->num_changes, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    // A seat dropped from the log leaves the versions up to its own without a delta
+    if (next->num_changes > EVENT_CHANGE_LOG_SIZE) {
+      next->log_floor = atomic_load_explicit(&change->version, memory_order_relaxed);
+    }
+    atomic_store_explicit(&change->version, next->version, memory_order_relaxed);
+    atomic_store_explicit(&change->seat, seat, memory_order_relaxed);
   }
 
-  pthread_mutex_unlock(&event->mutex);
+  atomic_store_explicit(&event->seats, next, memory_order_release);
+
+  // Under the mutex, so every subscriber sees the reservations of the event in order
+  if (notify_fn != NULL) {
+    for (struct Subscriber* subscriber = event->subscribers; subscriber != NULL; subscriber = subscriber->next) {
+      notify_fn(subscriber->subscriber, event->id, reservation_id, num_seats, xs, ys);
+    }
+  }
+
+  unlock_event(event, locked_at);
+
+  // Readers that loaded the old map may still be sending it, chunks left in the snapshot are never freed
+  for (size_t i = 0; i < num_chunks; i++) {
+    if (next->chunks[i] != current->chunks[i] && seat_chunk_owned(event, current, i)) {
+      epoch_retire(current->chunks[i], free);
+    }
+  }
+  epoch_retire(current, free);
   return 0;
 }
 
-int ems_show(int fd_resp, unsigned int event_id, worker_client_t *client) {
+int ems_reserve(unsigned int event_id, size_t num_seats, size_t* xs, size_t* ys) {
   if (event_list == NULL) {
     fprintf(stderr, "EMS state must be initialized\n");
-    int success = 1;
-    ssize_t ret = write(fd_resp, &success, sizeof(int));
-    if (ret < 0) {
-      fprintf(stdout, "ERR: write failed\n");
-      client->opcode = 2;
-      return 1;
-    }
     return 1;
   }
 
-  if (pthread_rwlock_rdlock(&event_list->rwl) != 0) {
-    fprintf(stderr, "Error locking list rwl\n");
-    int success = 1;
-    ssize_t ret = write(fd_resp, &success, sizeof(int));
-    if (ret < 0) {
-      fprintf(stdout, "ERR: write failed\n");
-      client->opcode = 2;
-      return 1;
-    }
+  epoch_enter();
+  struct Event* event = get_event_with_delay(event_id);
+
+  if (event == NULL) {
+    fprintf(stderr, "Event not found\n");
+    epoch_exit();
     return 1;
   }
 
-  struct Event* event = get_event_with_delay(event_id, event_list->head, event_list->tail);
-
-  pthread_rwlock_unlock(&event_list->rwl);
+  int result = reserve_in_event(event, num_seats, xs, ys);
+  epoch_exit();
+  return result;
+}
 
-  if (event == NULL) {
-    int success = 1;
-    ssize_t ret = write(fd_resp, &success, sizeof(int));
-    if (ret < 0) {
-      fprintf(stdout, "ERR: write failed\n");
-      client->opcode = 2;
-      return 1;
+/// Appends consecutive seats of an event to a reply.
+/// @param resp Reply to append the seats to.
+/// @param encoding Encoding of the reply.
+/// @param seats Seat map to read from.
+/// @param first Index of the first seat to append, row by row.
+/// @param num_seats Number of seats to append.
+static void append_seat_range(buffer_t *resp, wire_encoding_t encoding, const struct SeatMap *seats, size_t first,
+                              size_t num_seats) {
+  size_t end = first + num_seats;
+  if (encoding == WIRE_FIXED) {
+    // The seats of a chunk are contiguous, so each part of the range within one is appended at once
+    for (size_t seat = first; seat < end;) {
+      size_t offset = seat % SEAT_CHUNK_SIZE;
+      size_t len = SEAT_CHUNK_SIZE - offset < end - seat ? SEAT_CHUNK_SIZE - offset : end - seat;
+      buffer_append(resp, seats->chunks[seat / SEAT_CHUNK_SIZE] + offset, len * sizeof(unsigned int));
+      seat += len;
     }
-
-    return 1;
+    return;
   }
 
-  if (pthread_mutex_lock(&event->mutex) != 0) {
-    fprintf(stderr, "Error locking mutex\n");
+  // Runs of equal seats, mostly free ones, become a count and a value, also across chunks
+  for (size_t i = first; i < end;) {
+    unsigned int value = seat_at(seats, i);
+    size_t run = 1;
+    while (i + run < end && seat_at(seats, i + run) == value) run++;
+
+    buffer_put_uint(resp, encoding, run, sizeof(size_t));
+    buffer_put_uint(resp, encoding, value, sizeof(unsigned int));
+    i += run;
   }
+}
 
-  unsigned int *seats = malloc(sizeof(unsigned int) * (event->rows*event->cols));
+/// Gives the largest size an unsigned integer field takes in a reply.
+/// @param encoding Encoding of the reply.
+/// @param size Size of the field in WIRE_FIXED.
+/// @return Largest number of bytes of the field.
+static size_t max_uint_size(wire_encoding_t encoding, size_t size) {
+  // Seven bits per byte in WIRE_COMPACT
+  return encoding == WIRE_FIXED ? size : (size * 8 + 6) / 7;
+}
 
-  if (seats == NULL) {
-    fprintf(stdout, "ERR: failed to allocate memory\n");
-    free(seats);
-    pthread_mutex_unlock(&event->mutex);
-    return 1;
+/// Gives the largest size append_seats takes for an event.
+/// @param encoding Encoding of the reply.
+/// @param event Event to be sent.
+/// @return Largest number of bytes of the dimensions and the seats.
+static size_t max_seats_size(wire_encoding_t encoding, struct Event* event) {
+  size_t num_seats = event->rows * event->cols;
+  // The count of a compact run takes at most a byte per seat it covers, its value a whole field
+  size_t seats = encoding == WIRE_FIXED ? num_seats * sizeof(unsigned int)
+                                        : num_seats * (1 + max_uint_size(encoding, sizeof(unsigned int)));
+  return 2 * max_uint_size(encoding, sizeof(size_t)) + seats;
+}
+
+/// Appends the dimensions and the seats of an event to a reply.
+/// @note Must be called inside the epoch section the seats were loaded in.
+/// @param resp Reply to append the seats to.
+/// @param encoding Encoding of the reply.
+/// @param event Event to be sent.
+/// @param seats Seats of the event to be sent.
+static void append_seats(buffer_t *resp, wire_encoding_t encoding, struct Event* event, const struct SeatMap* seats) {
+  buffer_put_uint(resp, encoding, event->rows, sizeof(size_t));
+  buffer_put_uint(resp, encoding, event->cols, sizeof(size_t));
+
+  // Seats are stored row by row, in the order the client expects them
+  append_seat_range(resp, encoding, seats, 0, event->rows * event->cols);
+}
+
+/// Appends the dimensions and the seats of an event to a reply, handing the reply to the chunk
+/// function every time it holds SHOW_CHUNK_SIZE bytes.
+/// @note Must be called inside the epoch section the seats were loaded in.
+/// @param resp Reply to append the seats to, it holds the last rows once done.
+/// @param encoding Encoding of the reply.
+/// @param event Event to be sent.
+/// @param seats Seats of the event to be sent.
+/// @param chunk Function given each part of the reply.
+/// @param arg Argument given to the chunk function.
+static void stream_seats(buffer_t *resp, wire_encoding_t encoding, struct Event* event, const struct SeatMap* seats,
+                         ems_chunk_fn chunk, void *arg) {
+  buffer_put_uint(resp, encoding, event->rows, sizeof(size_t));
+  buffer_put_uint(resp, encoding, event->cols, sizeof(size_t));
+
+  // Parts end between rows, so the client prints each one without waiting for the next
+  for (size_t row = 0; row < event->rows; row++) {
+    append_seat_range(resp, encoding, seats, row * event->cols, event->cols);
+    if (resp->len >= SHOW_CHUNK_SIZE && row + 1 < event->rows && !resp->failed && chunk(resp, arg) != 0) return;
   }
-  int aux = 0;
-  for (size_t i = 1; i <= event->rows; i++) {
-    for (size_t j = 1; j <= event->cols; j++) {  
-      seats[aux] = event->data[seat_index(event, i, j)];
-      aux++;
+}
+
+/// Appends the seats of an event to a reply.
+/// @note Must be called inside an epoch section, the seats are read without locking.
+/// @param resp Reply to append the seats to.
+/// @param encoding Encoding of the reply.
+/// @param event Event to be sent.
+/// @param place Function choosing where the reply is built, NULL to build it in resp.
+/// @param arg Argument given to the place function.
+static void show_event_seats(buffer_t *resp, wire_encoding_t encoding, struct Event* event, ems_place_fn place,
+                             void *arg) {
+  const struct SeatMap* seats = atomic_load_explicit(&event->seats, memory_order_acquire);
+
+  if (place != NULL) resp = place(resp, max_uint_size(encoding, sizeof(int)) + max_seats_size(encoding, event), arg);
+  buffer_put_uint(resp, encoding, 0, sizeof(int));
+  append_seats(resp, encoding, event, seats);
+}
+
+/// Appends the seats of an event taken after a version to a reply, or all of them if that is shorter.
+/// @note Must be called inside an epoch section, the seats are read without locking.
+/// @param resp Reply to append the seats to.
+/// @param encoding Encoding of the reply.
+/// @param event Event to be sent.
+/// @param since Version of the event the client has.
+/// @param chunk Function given the parts of a streamed reply, NULL to always build the whole reply.
+/// @param place Function choosing where a reply that is not streamed is built, NULL to build it in resp.
+/// @param arg Argument given to the chunk and place functions.
+static void show_event_since(buffer_t *resp, wire_encoding_t encoding, struct Event* event, uint64_t since,
+                             ems_chunk_fn chunk, ems_place_fn place, void *arg) {
+  // The version, the end of the log and the seats all come from the same snapshot
+  const struct SeatMap* seats = atomic_load_explicit(&event->seats, memory_order_acquire);
+
+  // The newest seats are at the end of the log, the ones taken after since are counted back from there.
+  // The log goes on with later reservations, so the entries are copied out and then checked they were not reused
+  size_t changed[EVENT_CHANGE_LOG_SIZE];
+  size_t count = 0;
+  if (since >= seats->log_floor && since < seats->version) {
+    size_t lowest = seats->num_changes;  // Lowest entry read
+    while (count < seats->num_changes && count < EVENT_CHANGE_LOG_SIZE) {
+      const struct SeatChange* change = &event->changes[--lowest % EVENT_CHANGE_LOG_SIZE];
+      if (atomic_load_explicit(&change->version, memory_order_relaxed) <= since) break;
+      changed[EVENT_CHANGE_LOG_SIZE - ++count] = atomic_load_explicit(&change->seat, memory_order_relaxed);
     }
+
+    // An entry started again by a later reservation may have been read half written, every seat is sent instead
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&event->changes_started, memory_order_relaxed) > lowest + EVENT_CHANGE_LOG_SIZE) count = 0;
+  }
+
+  // A delta takes an index and a reservation per seat, past the size of every seat it is not worth it
+  size_t num_seats = event->rows * event->cols;
+  bool delta = count > 0 && count * (sizeof(size_t) + sizeof(unsigned int)) < num_seats * sizeof(unsigned int);
+  bool streamed = !delta && since != seats->version && chunk != NULL && num_seats * sizeof(unsigned int) > SHOW_CHUNK_SIZE;
+
+  // A streamed reply is sent as it is built, the others are built whole wherever place chooses
+  if (place != NULL && !streamed) {
+    size_t size = max_uint_size(encoding, sizeof(int)) + max_uint_size(encoding, sizeof(uint64_t)) +
+                  max_uint_size(encoding, sizeof(uint8_t));
+    if (since == seats->version) {
+      // Nothing follows the kind of reply
+    } else if (delta) {
+      size += (1 + count) * max_uint_size(encoding, sizeof(size_t)) + count * max_uint_size(encoding, sizeof(unsigned int));
+    } else {
+      size += max_seats_size(encoding, event);
+    }
+    resp = place(resp, size, arg);
+  }
+
+  buffer_put_uint(resp, encoding, 0, sizeof(int));
+  buffer_put_uint(resp, encoding, seats->version, sizeof(uint64_t));
+  if (since == seats->version) {
+    buffer_put_uint(resp, encoding, SHOW_UNCHANGED, sizeof(uint8_t));
+  } else if (delta) {
+    buffer_put_uint(resp, encoding, SHOW_DELTA, sizeof(uint8_t));
+    buffer_put_uint(resp, encoding, count, sizeof(size_t));
+    for (size_t i = EVENT_CHANGE_LOG_SIZE - count; i < EVENT_CHANGE_LOG_SIZE; i++) {
+      size_t seat = changed[i];
+      buffer_put_uint(resp, encoding, seat, sizeof(size_t));
+      buffer_put_uint(resp, encoding, seat_at(seats, seat), sizeof(unsigned int));
+    }
+  } else if (streamed) {
+    buffer_put_uint(resp, encoding, SHOW_ROWS, sizeof(uint8_t));
+    stream_seats(resp, encoding, event, seats, chunk, arg);
+  } else {
+    buffer_put_uint(resp, encoding, SHOW_FULL, sizeof(uint8_t));
+    append_seats(resp, encoding, event, seats);
   }
+}
 
-  int success = 0;
-  ssize_t ret = write(fd_resp, &success, sizeof(int));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: write failed\n");
-    free(seats);
-    client->opcode = 2;
-    pthread_mutex_unlock(&event->mutex);
-    return 1;
+/// Appends ascending event ids to a reply.
+/// @param resp Reply to append the ids to.
+/// @param encoding Encoding of the reply, WIRE_COMPACT sends the gaps between ids.
+/// @param ids Ids to be sent.
+/// @param count Number of ids.
+static void append_event_ids(buffer_t *resp, wire_encoding_t encoding, const unsigned int *ids, size_t count) {
+  buffer_put_uint(resp, encoding, count, sizeof(size_t));
+
+  if (encoding == WIRE_FIXED) {
+    buffer_append(resp, ids, sizeof(unsigned int[count]));
+    return;
   }
 
-  ret = write(fd_resp, &event->rows, sizeof(size_t));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: write failed\n");
-    free(seats);
-    client->opcode = 2;
-    pthread_mutex_unlock(&event->mutex);
-    return 1;
+  unsigned int previous = 0;
+  for (size_t i = 0; i < count; i++) {
+    buffer_put_uint(resp, encoding, ids[i] - previous, sizeof(unsigned int));
+    previous = ids[i];
   }
+}
 
-  ret = write(fd_resp, &event->cols, sizeof(size_t));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: write failed\n");
-    free(seats);
-    client->opcode = 2;
-    pthread_mutex_unlock(&event->mutex);
+int ems_show(buffer_t *resp, wire_encoding_t encoding, unsigned int event_id, ems_place_fn place, void *arg) {
+  if (event_list == NULL) {
+    fprintf(stderr, "EMS state must be initialized\n");
+    buffer_put_uint(resp, encoding, 1, sizeof(int));
     return 1;
   }
 
-  ret = write(fd_resp, seats, sizeof(unsigned int[event->rows*event->cols]));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: write failed\n");
-    free(seats);
-    client->opcode = 2;
-    pthread_mutex_unlock(&event->mutex);
+  epoch_enter();
+  struct Event* event = get_event_with_delay(event_id);
+
+  if (event == NULL) {
+    epoch_exit();
+    buffer_put_uint(resp, encoding, 1, sizeof(int));
     return 1;
   }
-  free(seats);
-  pthread_mutex_unlock(&event->mutex);
+
+  show_event_seats(resp, encoding, event, place, arg);
+  epoch_exit();
   return 0;
 }
 
-int ems_list_events(int fd_resp, int fd_req, worker_client_t *client) {
-
+int ems_show_since(buffer_t *resp, wire_encoding_t encoding, unsigned int event_id, uint64_t since, ems_chunk_fn chunk,
+                   ems_place_fn place, void *arg) {
   if (event_list == NULL) {
     fprintf(stderr, "EMS state must be initialized\n");
-    int success = 1;
-    ssize_t ret = write(fd_resp, &success, sizeof(int));
-    if (ret < 0) {
-      fprintf(stdout, "ERR: write failed\n");
-      client->opcode = 2;
-      return 1;
-    }
-
-    char op_code;
-    ret = read(fd_req, &op_code, sizeof(char));
-    if (ret < 0) {
-      fprintf(stdout, "ERR: read failed\n");
-      client->opcode = 2;
-      exit(EXIT_FAILURE);
-    }
-    else
-      client->opcode = op_code;
+    buffer_put_uint(resp, encoding, 1, sizeof(int));
     return 1;
   }
 
-  if (pthread_rwlock_rdlock(&event_list->rwl) != 0) {
-    fprintf(stderr, "Error locking list rwl\n");
-    int success = 1;
-    ssize_t ret = write(fd_resp, &success, sizeof(int));
-    if (ret < 0) {
-      fprintf(stdout, "ERR: write failed\n");
-      client->opcode = 2;
-      pthread_rwlock_unlock(&event_list->rwl);
-      return 1;
-    }
+  epoch_enter();
+  struct Event* event = get_event_with_delay(event_id);
 
-    char op_code;
-    ret = read(fd_req, &op_code, sizeof(char));
-    if (ret < 0) {
-      fprintf(stdout, "ERR: read failed\n");
-      client->opcode = 2;
-      return 1;
-    }
-    else 
-      client->opcode = op_code;
+  if (event == NULL) {
+    epoch_exit();
+    buffer_put_uint(resp, encoding, 1, sizeof(int));
     return 1;
   }
 
-  struct ListNode* to = event_list->tail;
-  struct ListNode* current = event_list->head;
+  show_event_since(resp, encoding, event, since, chunk, place, arg);
+  epoch_exit();
+  return 0;
+}
 
-  if (current == NULL) {
-    int success = 0;
-    ssize_t ret = write(fd_resp, &success, sizeof(int));
-    if (ret < 0) {
-      fprintf(stdout, "ERR: write failed\n");
-      client->opcode = 2;
-      pthread_rwlock_unlock(&event_list->rwl);
-      return 1;
-    }
+int ems_list_page(buffer_t *resp, wire_encoding_t encoding, unsigned int cursor, size_t limit) {
+  if (event_list == NULL) {
+    fprintf(stderr, "EMS state must be initialized\n");
+    buffer_put_uint(resp, encoding, 1, sizeof(int));
+    return 1;
+  }
 
-    ret = write(fd_resp, &success, sizeof(int));
-    if (ret < 0) {
-      fprintf(stdout, "ERR: write failed\n");
-      client->opcode = 2;
-      pthread_rwlock_unlock(&event_list->rwl);
-      return 1;
-    }
+  if (limit == 0 || limit > LIST_PAGE_MAX) limit = LIST_PAGE_MAX;
 
-    char op_code;
-    ret = read(fd_req, &op_code, sizeof(char));
-    if (ret < 0) {
-      fprintf(stdout, "ERR: read failed\n");
-      client->opcode = 2;
-      return 1;
-    }
-    else
-      client->opcode = op_code;
+  // One extra id tells whether there is a next page
+  unsigned int ids[LIST_PAGE_MAX + 1];
+  epoch_enter();
+  size_t count = get_event_ids(event_list, cursor, ids, limit + 1);
+  epoch_exit();
 
-    pthread_rwlock_unlock(&event_list->rwl);
-    return 0;
+  int more = count > limit;
+  if (more) count = limit;
 
-  }
+  buffer_put_uint(resp, encoding, 0, sizeof(int));
+  append_event_ids(resp, encoding, ids, count);
+  buffer_put_uint(resp, encoding, (unsigned int)more, sizeof(int));
+  return 0;
+}
 
-  size_t num_events = 0;
-  while (1) {
-    num_events++;
-    if (current == to) {
-      break;
-    }
-    current = current->next;
+int ems_subscribe(unsigned int event_id, void *subscriber) {
+  if (event_list == NULL) {
+    fprintf(stderr, "EMS state must be initialized\n");
+    return 1;
   }
 
-  current = event_list->head;
+  epoch_enter();
+  struct Event* event = get_event_with_delay(event_id);
 
-  unsigned int ids[num_events];
-  for(size_t i = 0; i < num_events; i++) {
-    ids[i] = (current->event)->id;
-    current = current->next;
-  }
-
-  int success = 0;
-  ssize_t ret = write(fd_resp, &success, sizeof(int));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: write failed\n");
-    client->opcode = 2;
-    pthread_rwlock_unlock(&event_list->rwl);
+  if (event == NULL) {
+    epoch_exit();
     return 1;
   }
 
-  ret = write(fd_resp, &num_events, sizeof(size_t));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: write failed\n");
-    client->opcode = 2;
-    pthread_rwlock_unlock(&event_list->rwl);
+  uint64_t locked_at;
+  if (lock_event(event, &locked_at) != 0) {
+    epoch_exit();
     return 1;
   }
 
-  ret = write(fd_resp, ids, sizeof(unsigned int[num_events]));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: write failed\n");
-    client->opcode = 2;
-    pthread_rwlock_unlock(&event_list->rwl);
-    return 1;
+  struct Subscriber* current = event->subscribers;
+  while (current != NULL && current->subscriber != subscriber) current = current->next;
+
+  int result = 0;
+  if (current == NULL) {
+    current = malloc(sizeof(struct Subscriber));
+    if (current == NULL) {
+      fprintf(stderr, "Error allocating memory for subscriber\n");
+      result = 1;
+    } else {
+      current->subscriber = subscriber;
+      current->next = event->subscribers;
+      event->subscribers = current;
+    }
   }
 
-  char op_code;
-  ret = read(fd_req, &op_code, sizeof(char));
-  if (ret < 0) {
-    fprintf(stdout, "ERR: read failed\n");
-    client->opcode = 2;
-    return 1;
+  unlock_event(event, locked_at);
+  epoch_exit();
+  return result;
+}
+
+void ems_unsubscribe(unsigned int event_id, void *subscriber) {
+  if (event_list == NULL) return;
+
+  // A deleted event already dropped its subscribers, so a missing one has nothing to remove
+  epoch_enter();
+  struct Event* event = get_event(event_list, event_id);
+
+  uint64_t locked_at;
+  if (event != NULL && lock_event(event, &locked_at) == 0) {
+    for (struct Subscriber** current = &event->subscribers; *current != NULL; current = &(*current)->next) {
+      if ((*current)->subscriber == subscriber) {
+        struct Subscriber* removed = *current;
+        *current = removed->next;
+        free(removed);
+        break;
+      }
+    }
+    unlock_event(event, locked_at);
   }
-  else
-    client->opcode = op_code;
 
-  pthread_rwlock_unlock(&event_list->rwl);
+  epoch_exit();
+}
 
-  return 0;
+struct EventImage* capture_events(void) {
+  if (event_list == NULL) {
+    fprintf(stderr, "EMS state must be initialized\n");
+    return NULL;
+  }
+
+  struct EventImage* image = calloc(1, sizeof(struct EventImage));
+  size_t capacity = INIT_SIZE;
+  if (image != NULL) {
+    image->index = malloc(capacity * sizeof(struct SnapshotEntry));
+    image->seats = malloc(capacity * sizeof(struct SeatMap*));
+  }
+  if (image == NULL || image->index == NULL || image->seats == NULL) {
+    fprintf(stderr, "Error allocating memory for the events image\n");
+    release_events(image);
+    return NULL;
+  }
+
+  // Left in release_events, the seat maps gathered stay readable until then
+  epoch_enter();
+  image->in_epoch = true;
+
+  struct ListNode* current = atomic_load_explicit(&event_list->head, memory_order_acquire);
+  for (; current != NULL; current = atomic_load_explicit(&current->next, memory_order_acquire)) {
+    if (image->num_events == capacity) {
+      capacity *= 2;
+      struct SnapshotEntry* grown_index = realloc(image->index, capacity * sizeof(struct SnapshotEntry));
+      if (grown_index != NULL) image->index = grown_index;
+      const struct SeatMap** grown_seats = realloc(image->seats, capacity * sizeof(struct SeatMap*));
+      if (grown_seats != NULL) image->seats = grown_seats;
+      if (grown_index == NULL || grown_seats == NULL) {
+        fprintf(stderr, "Error allocating memory for the events image\n");
+        release_events(image);
+        return NULL;
+      }
+    }
+
+    // The reservation count, the version and the seats all come from the same map
+    struct Event* event = current->event;
+    const struct SeatMap* seats = atomic_load_explicit(&event->seats, memory_order_acquire);
+    image->seats[image->num_events] = seats;
+    image->index[image->num_events++] = (struct SnapshotEntry){.id = event->id,
+                                                               .reservations = seats->reservations,
+                                                               .rows = event->rows,
+                                                               .cols = event->cols,
+                                                               .version = seats->version};
+  }
+
+  // Seats of a page or more start on a page of their own, smaller ones are packed so each event does not take a page
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  image->last_version = atomic_load(&last_version);
+  image->index_offset = page;
+  image->size = align_up(page + image->num_events * sizeof(struct SnapshotEntry), page);
+  for (size_t i = 0; i < image->num_events; i++) {
+    size_t size = image->index[i].rows * image->index[i].cols * sizeof(unsigned int);
+    if (size >= page) image->size = align_up(image->size, page);
+    image->index[i].seats_offset = image->size;
+    image->size += size;
+  }
+
+  return image;
 }
 
-void print_events() {
+void release_events(struct EventImage* image) {
+  if (image == NULL) return;
 
-  if (pthread_rwlock_rdlock(&event_list->rwl) != 0) {
-    fprintf(stderr, "Error locking list rwl\n");
-    return;
+  if (image->in_epoch) epoch_exit();
+  free(image->index);
+  free(image->seats);
+  free(image);
+}
+
+int print_events(const struct EventImage* image, int fd) {
+  io_writer_t text;
+  io_writer_init(&text, fd, SIZE_MAX);
+  int failed = 0;
+
+  if (image->num_events == 0) {
+    failed = print_str(&text, "No events\n");
   }
+  for (size_t e = 0; e < image->num_events && !failed; e++) {
+    const struct SnapshotEntry* entry = &image->index[e];
+    failed = print_str(&text, "Event ") || print_uint(&text, entry->id) || print_str(&text, "\n");
 
-  struct ListNode* to = event_list->tail;
-  struct ListNode* current = event_list->head;
-  
-  if (current == NULL) {
-    fprintf(stdout, "No events\n");
-  } else {
-    while (current != NULL) {
-      fprintf(stdout, "Event %u\n", (current->event)->id);
-
-      for (size_t i = 1; i <= (current->event)->rows; i++) {
-        for (size_t j = 1; j <= (current->event)->cols; j++) {  
-          fprintf(stdout, "%u", (current->event)->data[seat_index(current->event, i, j)]);
-          
-          if (j < (current->event)->cols) {
-            fprintf(stdout, " ");
-          }
-
-        }
-        fprintf(stdout, "\n");
+    // Seats are stored row by row
+    size_t seat = 0;
+    for (size_t i = 1; i <= entry->rows && !failed; i++) {
+      for (size_t j = 1; j <= entry->cols && !failed; j++) {
+        failed = print_uint(&text, seat_at(image->seats[e], seat++)) || print_str(&text, j < entry->cols ? " " : "\n");
       }
+    }
+  }
 
-      if(current == to)
-        break;
-      current = current->next;
+  if (io_flush(&text) != 0) failed = 1;
+  return failed;
+}
+
+/// Writes zeros to a snapshot up to an offset.
+/// @param writer Writer of the snapshot.
+/// @param offset Offset reached so far, moved to the given one.
+/// @param to Offset to be reached.
+/// @return 0 if the zeros were written, 1 otherwise.
+static int pad_to(io_writer_t* writer, size_t* offset, size_t to) {
+  static const char zeros[IO_BUFFER_SIZE];
+  while (*offset < to) {
+    size_t size = to - *offset < sizeof(zeros) ? to - *offset : sizeof(zeros);
+    if (write_all(writer, zeros, size) != 0) return 1;
+    *offset += size;
+  }
+  return 0;
+}
+
+int save_events(const struct EventImage* image, int fd) {
+  struct SnapshotHeader header = {.last_version = image->last_version,
+                                  .num_events = image->num_events,
+                                  .index_offset = image->index_offset,
+                                  .size = image->size};
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+
+  io_writer_t snapshot_out;
+  io_writer_init(&snapshot_out, fd, SIZE_MAX);
+  size_t written = sizeof(header);
+  int failed = write_all(&snapshot_out, &header, sizeof(header)) ||
+               pad_to(&snapshot_out, &written, image->index_offset) ||
+               write_all(&snapshot_out, image->index, image->num_events * sizeof(struct SnapshotEntry));
+  written += image->num_events * sizeof(struct SnapshotEntry);
+
+  for (size_t i = 0; i < image->num_events && !failed; i++) {
+    size_t num_seats = image->index[i].rows * image->index[i].cols;
+    failed = pad_to(&snapshot_out, &written, image->index[i].seats_offset);
+
+    // Chunks follow each other in the snapshot, so they are mapped back in place
+    const struct SeatMap* seats = image->seats[i];
+    for (size_t chunk = 0; chunk < seats->num_chunks && !failed; chunk++) {
+      failed = write_all(&snapshot_out, seats->chunks[chunk], chunk_seats(num_seats, chunk) * sizeof(unsigned int));
     }
+    written += num_seats * sizeof(unsigned int);
   }
 
-  pthread_rwlock_unlock(&event_list->rwl);
-}
\ No newline at end of file
+  if (io_flush(&snapshot_out) != 0) failed = 1;
+  return failed;
+}
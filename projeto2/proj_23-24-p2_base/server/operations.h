@@ -3,10 +3,38 @@
 
 #include <stddef.h>
 
+#include "common/io.h"
+
+/// Receives a reservation made in an event the subscriber asked for.
+/// @note Runs with the event mutex held, so it must only queue the notification.
+typedef void (*ems_notify_fn)(void *subscriber, unsigned int event_id, unsigned int reservation_id, size_t num_seats,
+                              const size_t *xs, const size_t *ys);
+
+/// Receives the part of a streamed reply built so far.
+/// @param resp Part of the reply, emptied but for the logical session it starts with.
+/// @param arg Argument given with the function.
+/// @return 0 if the reply goes on, 1 if it can no longer be sent.
+typedef int (*ems_chunk_fn)(buffer_t *resp, void *arg);
+
+/// Chooses where the rest of a reply is built, once the event was found and the size of the reply is bounded.
+/// @param resp Reply built so far.
+/// @param size Largest number of bytes the rest of the reply takes.
+/// @param arg Argument given with the function.
+/// @return resp, or a buffer of at least size more bytes that starts with the contents of resp.
+typedef buffer_t *(*ems_place_fn)(buffer_t *resp, size_t size, void *arg);
+
 /// Initializes the EMS state.
+/// @note The snapshot is mapped rather than read, so restoring only reads its index and the seats of an
+/// event are paged in when first used. The file must not be changed until ems_terminate.
 /// @param delay_us Delay in microseconds.
+/// @param snapshot_path Snapshot written by save_events to restore the events from, NULL or a missing file to
+/// start empty.
 /// @return 0 if the EMS state was initialized successfully, 1 otherwise.
-int ems_init(unsigned int delay_us);
+int ems_init(unsigned int delay_us, const char *snapshot_path);
+
+/// Sets the function every reservation is given to, once for each subscriber of its event.
+/// @param notify Function to be called, NULL for none.
+void ems_set_notify(ems_notify_fn notify);
 
 /// Destroys the EMS state.
 int ems_terminate();
@@ -18,6 +46,13 @@ int ems_terminate();
 /// @return 0 if the event was created successfully, 1 otherwise.
 int ems_create(unsigned int event_id, size_t num_rows, size_t num_cols);
 
+/// Deletes the event with the given id.
+/// @note Readers that already found the event keep using it safely, its
+/// memory is only reclaimed once they are done.
+/// @param event_id Id of the event to be deleted.
+/// @return 0 if the event was deleted successfully, 1 otherwise.
+int ems_delete(unsigned int event_id);
+
 /// Creates a new reservation for the given event.
 /// @param event_id Id of the event to create a reservation for.
 /// @param num_seats Number of seats to reserve.
@@ -26,19 +61,73 @@ int ems_create(unsigned int event_id, size_t num_rows, size_t num_cols);
 /// @return 0 if the reservation was created successfully, 1 otherwise.
 int ems_reserve(unsigned int event_id, size_t num_seats, size_t *xs, size_t *ys);
 
-/// Prints the given event.
-/// @param out_fd File descriptor to print the event to.
-/// @param event_id Id of the event to print.
-/// @return 0 if the event was printed successfully, 1 otherwise.
-//int ems_show(int out_fd, unsigned int event_id);
+/// Builds the reply with the seats of the given event.
+/// @note Replies are built in memory so the server can send them in request order.
+/// @param resp Reply to append to, resp->failed is set if it could not grow.
+/// @param encoding Encoding of the reply.
+/// @param event_id Id of the event to send.
+/// @param place Function choosing where the reply is built, NULL to build it in resp.
+/// @param arg Argument given to the place function.
+/// @return 0 if the event was found, 1 otherwise.
+int ems_show(buffer_t *resp, wire_encoding_t encoding, unsigned int event_id, ems_place_fn place, void *arg);
+
+/// Builds the reply with the seats of the given event taken after a version the client has.
+/// @note Seats of an event larger than SHOW_CHUNK_SIZE are sent as SHOW_ROWS, handed to the chunk
+/// function every time the reply holds SHOW_CHUNK_SIZE bytes, and the last rows are left in resp.
+/// @param resp Reply to append to, resp->failed is set if it could not grow.
+/// @param encoding Encoding of the reply.
+/// @param event_id Id of the event to send.
+/// @param since Version of the event the client has, 0 if none.
+/// @param chunk Function given the parts of a streamed reply, NULL to always build the whole reply.
+/// @param place Function choosing where a reply that is not streamed is built, NULL to build it in resp.
+/// @param arg Argument given to the chunk and place functions.
+/// @return 0 if the event was found, 1 otherwise.
+int ems_show_since(buffer_t *resp, wire_encoding_t encoding, unsigned int event_id, uint64_t since, ems_chunk_fn chunk,
+                   ems_place_fn place, void *arg);
+
+/// Builds the reply with one page of event ids, in ascending order.
+/// @param resp Reply to append to, resp->failed is set if it could not grow.
+/// @param encoding Encoding of the reply.
+/// @param cursor Smallest event id to be sent.
+/// @param limit Maximum number of ids to send, capped at LIST_PAGE_MAX.
+/// @return 0 if the page was built successfully, 1 otherwise.
+int ems_list_page(buffer_t *resp, wire_encoding_t encoding, unsigned int cursor, size_t limit);
+
+/// Subscribes to the reservations of the given event, until it is deleted or the subscriber leaves.
+/// @param event_id Id of the event.
+/// @param subscriber Subscriber given to the notify function, subscribing twice has no effect.
+/// @return 0 if the event was found, 1 otherwise.
+int ems_subscribe(unsigned int event_id, void *subscriber);
+
+/// Stops the notifications of the given event to a subscriber.
+/// @note Once it returns, the notify function is no longer called for them.
+/// @param event_id Id of the event.
+/// @param subscriber Subscriber to be removed.
+void ems_unsubscribe(unsigned int event_id, void *subscriber);
+
+// Events as they were when captured, for a process forked from the server to write out
+struct EventImage;
+
+/// Gathers the seats of every event, and where each one goes in a snapshot.
+/// @note Allocates and enters an epoch section, so it runs before a fork and release_events after it, on
+/// the same thread. The process forked in between writes the image with no allocation and no lock.
+/// @return Image of the events, NULL on failure.
+struct EventImage *capture_events(void);
 
-int ems_show(int fd_resp, unsigned int event_id);
+/// Frees an image and leaves the epoch section it holds.
+/// @param image Image from capture_events, may be NULL.
+void release_events(struct EventImage *image);
 
-/// Prints all the events.
-/// @param out_fd File descriptor to print the events to.
-/// @return 0 if the events were printed successfully, 1 otherwise.
-int ems_list_events(int out_fd, int fd_server, worker_client_t *client);
+/// Writes every event of an image, seat by seat, to a file.
+/// @param image Image of the events.
+/// @param fd File descriptor to write to.
+/// @return 0 if everything was written, 1 otherwise.
+int print_events(const struct EventImage *image, int fd);
 
-void print_events();
+/// Writes a snapshot of the events of an image, which ems_init can restore.
+/// @param image Image of the events.
+/// @param fd File descriptor to write to.
+/// @return 0 if the whole snapshot was written, 1 otherwise.
+int save_events(const struct EventImage *image, int fd);
 
 #endif  // SERVER_OPERATIONS_H
@@ -0,0 +1,222 @@
+// syscall() is only declared with the GNU extensions
+#define _GNU_SOURCE
+
+#include "scheduler.h"
+
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "common/constants.h"
+
+// Growable ring of tasks, the owner works at the bottom and thieves at the top
+struct Deque {
+  pthread_mutex_t lock;
+  void **tasks;
+  size_t capacity;
+  size_t top;   // Index of the oldest task
+  size_t size;  // Number of tasks
+};
+
+// Slot of the inbox, its sequence tells whether it is free or full for a given position:
+// equal to the position when free, one past it when it holds a task
+struct Cell {
+  _Atomic size_t sequence;
+  void *task;
+};
+
+static struct Deque *deques;
+static int worker_count;
+static void (*run_task)(void *task);
+
+// Bounded lock-free queue of the tasks submitted from outside the workers, drained by every worker
+static struct Cell inbox[SCHEDULER_INBOX_SIZE];
+static _Atomic size_t inbox_tail;  // Position of the next task submitted
+static _Atomic size_t inbox_head;  // Position of the next task taken
+static atomic_uint next_deque;     // Deque given the next task from outside when the inbox is full
+
+static atomic_long queued_tasks;  // Tasks in the inbox and the deques, may briefly be negative
+static atomic_int idle_workers;
+static _Atomic uint32_t wakeups;  // Futex idle workers sleep on, bumped by a submit that sees one
+
+static _Thread_local int self = -1;  // Index of the calling worker, -1 outside the workers
+
+static void push_bottom(struct Deque *deque, void *task) {
+  pthread_mutex_lock(&deque->lock);
+
+  if (deque->size == deque->capacity) {
+    size_t capacity = deque->capacity * 2;
+    void **tasks = malloc(sizeof(void *) * capacity);
+    if (tasks == NULL) {
+      fprintf(stderr, "Error allocating memory for tasks\n");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < deque->size; i++) {
+      tasks[i] = deque->tasks[(deque->top + i) % deque->capacity];
+    }
+    free(deque->tasks);
+    deque->tasks = tasks;
+    deque->capacity = capacity;
+    deque->top = 0;
+  }
+  deque->tasks[(deque->top + deque->size++) % deque->capacity] = task;
+
+  pthread_mutex_unlock(&deque->lock);
+}
+
+static void *pop_bottom(struct Deque *deque) {
+  void *task = NULL;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->size > 0) {
+    task = deque->tasks[(deque->top + --deque->size) % deque->capacity];
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return task;
+}
+
+static void *steal_top(struct Deque *deque) {
+  void *task = NULL;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->size > 0) {
+    task = deque->tasks[deque->top];
+    deque->top = (deque->top + 1) % deque->capacity;
+    deque->size--;
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return task;
+}
+
+/// Adds a task to the inbox.
+/// @param task Task to be added.
+/// @return true if the task was added, false if the inbox is full.
+static bool inbox_push(void *task) {
+  size_t pos = atomic_load_explicit(&inbox_tail, memory_order_relaxed);
+
+  while (1) {
+    struct Cell *cell = &inbox[pos % SCHEDULER_INBOX_SIZE];
+    size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+
+    if (sequence == pos) {
+      // The slot is free, claiming the position makes it ours
+      if (atomic_compare_exchange_weak_explicit(&inbox_tail, &pos, pos + 1, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        cell->task = task;
+        atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+        return true;
+      }
+    } else if (sequence < pos) {
+      // The slot still holds the task of the previous lap
+      return false;
+    } else {
+      pos = atomic_load_explicit(&inbox_tail, memory_order_relaxed);
+    }
+  }
+}
+
+/// Takes the oldest task of the inbox.
+/// @return Task taken, NULL if the inbox is empty.
+static void *inbox_pop(void) {
+  size_t pos = atomic_load_explicit(&inbox_head, memory_order_relaxed);
+
+  while (1) {
+    struct Cell *cell = &inbox[pos % SCHEDULER_INBOX_SIZE];
+    size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+
+    if (sequence == pos + 1) {
+      if (atomic_compare_exchange_weak_explicit(&inbox_head, &pos, pos + 1, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        void *task = cell->task;
+        // Frees the slot for the position it takes on the next lap
+        atomic_store_explicit(&cell->sequence, pos + SCHEDULER_INBOX_SIZE, memory_order_release);
+        return task;
+      }
+    } else if (sequence < pos + 1) {
+      return NULL;
+    } else {
+      pos = atomic_load_explicit(&inbox_head, memory_order_relaxed);
+    }
+  }
+}
+
+/// Takes a task for the calling worker, sleeping while there is none anywhere.
+/// @return Task to be run.
+static void *next_task() {
+  while (1) {
+    void *task = pop_bottom(&deques[self]);
+    if (task == NULL) task = inbox_pop();
+    for (int i = 1; task == NULL && i < worker_count; i++) {
+      task = steal_top(&deques[(self + i) % worker_count]);
+    }
+
+    if (task != NULL) {
+      atomic_fetch_sub(&queued_tasks, 1);
+      return task;
+    }
+
+    // A submit bumps wakeups after it counted its task, so a bump after this read ends the wait at once
+    uint32_t seen = atomic_load(&wakeups);
+    atomic_fetch_add(&idle_workers, 1);
+    if (atomic_load(&queued_tasks) <= 0) {
+      syscall(SYS_futex, (uint32_t *)&wakeups, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+    }
+    atomic_fetch_sub(&idle_workers, 1);
+  }
+}
+
+static void *worker_thread(void *args) {
+  self = (int)(long)args;
+
+  while (1) {
+    run_task(next_task());
+  }
+
+  return NULL;
+}
+
+int scheduler_start(int num_workers, void (*run)(void *task)) {
+  deques = malloc(sizeof(struct Deque) * (size_t)num_workers);
+  if (deques == NULL) return 1;
+
+  worker_count = num_workers;
+  run_task = run;
+  for (size_t i = 0; i < SCHEDULER_INBOX_SIZE; i++) {
+    atomic_init(&inbox[i].sequence, i);
+  }
+  for (int i = 0; i < num_workers; i++) {
+    deques[i].capacity = SCHEDULER_DEQUE_INIT_SIZE;
+    deques[i].top = 0;
+    deques[i].size = 0;
+    deques[i].tasks = malloc(sizeof(void *) * SCHEDULER_DEQUE_INIT_SIZE);
+    if (deques[i].tasks == NULL || pthread_mutex_init(&deques[i].lock, NULL) != 0) return 1;
+  }
+
+  for (int i = 0; i < num_workers; i++) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, worker_thread, (void *)(long)i) != 0) return 1;
+    pthread_detach(tid);
+  }
+  return 0;
+}
+
+void scheduler_submit(void *task) {
+  if (self >= 0) {
+    push_bottom(&deques[self], task);
+  } else if (!inbox_push(task)) {
+    push_bottom(&deques[atomic_fetch_add(&next_deque, 1) % (unsigned int)worker_count], task);
+  }
+
+  // A worker going idle counts itself before checking for tasks, so one of the two sees the other
+  atomic_fetch_add(&queued_tasks, 1);
+  if (atomic_load(&idle_workers) > 0) {
+    atomic_fetch_add(&wakeups, 1);
+    syscall(SYS_futex, (uint32_t *)&wakeups, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
@@ -0,0 +1,23 @@
+#ifndef SERVER_SCHEDULER_H
+#define SERVER_SCHEDULER_H
+
+// Work-stealing scheduler: every worker owns a deque, takes its own newest
+// task first and steals the oldest task of another worker when it runs out.
+// Tasks from other threads, like the event loop, go to a lock-free inbox
+// every worker takes from before stealing. Workers with nothing to run or
+// steal sleep on a futex until a task is submitted.
+
+/// Starts the workers.
+/// @note Workers inherit the signal mask of the calling thread.
+/// @param num_workers Number of worker threads.
+/// @param run Function run by a worker for every task it takes.
+/// @return 0 if the workers were started successfully, 1 otherwise.
+int scheduler_start(int num_workers, void (*run)(void *task));
+
+/// Queues a task, on the deque of the calling worker or, from any other
+/// thread, in the inbox, falling back to the deques of the workers in turn
+/// while it is full.
+/// @param task Task to be run, never NULL.
+void scheduler_submit(void *task);
+
+#endif  // SERVER_SCHEDULER_H
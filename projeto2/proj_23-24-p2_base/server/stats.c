@@ -0,0 +1,173 @@
+#include "stats.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "common/histogram.h"
+
+// Metrics recorded by one thread, shards are never freed since their counts stay part of the totals
+struct StatsShard {
+  _Atomic uint64_t requests;
+  _Atomic uint64_t bytes_in;
+  _Atomic uint64_t bytes_out;
+  _Atomic uint64_t lock_holds;
+  _Atomic uint64_t lock_wait_ns;
+  _Atomic uint64_t lock_held_ns;
+  _Atomic uint64_t lock_held_max_ns;
+  _Atomic int64_t sessions;  // A session may leave on another thread than the one it connected on
+  _Atomic uint64_t latencies[STATS_NUM_OPS][HISTOGRAM_BUCKETS];
+  struct StatsShard *next;   // Next shard, the list only grows
+};
+
+static _Atomic(struct StatsShard *) shards = NULL;
+static _Thread_local struct StatsShard *self = NULL;
+
+/// Gives the calling thread its shard, creating it the first time.
+/// @return Shard owned by the calling thread.
+static struct StatsShard *own_shard(void) {
+  if (self != NULL) return self;
+
+  self = calloc(1, sizeof(struct StatsShard));
+  if (self == NULL) {
+    fprintf(stderr, "Error allocating memory for stats\n");
+    exit(EXIT_FAILURE);
+  }
+
+  self->next = atomic_load(&shards);
+  while (!atomic_compare_exchange_weak(&shards, &self->next, self))
+    ;
+  return self;
+}
+
+/// Adds to a counter of the calling thread's shard.
+/// @note Only the owner writes a shard, so the update needs no atomic read-modify-write, readers
+/// only need to see whole values.
+/// @param counter Counter to add to.
+/// @param value Value to add.
+static void add(_Atomic uint64_t *counter, uint64_t value) {
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+uint64_t stats_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void stats_record_request(size_t size) {
+  struct StatsShard *shard = own_shard();
+  add(&shard->requests, 1);
+  add(&shard->bytes_in, size);
+}
+
+void stats_record_reply(size_t size) {
+  add(&own_shard()->bytes_out, size);
+}
+
+void stats_record_latency(uint8_t opcode, uint64_t ns) {
+  size_t op;
+  switch (opcode) {
+    case OP_CODE_CREATE:
+      op = STATS_CREATE;
+      break;
+    case OP_CODE_RESERVE:
+      op = STATS_RESERVE;
+      break;
+    case OP_CODE_SHOW:
+    case OP_CODE_SHOW_SINCE:
+      op = STATS_SHOW;
+      break;
+    case OP_CODE_LIST_PAGE:
+      op = STATS_LIST;
+      break;
+    default:
+      return;
+  }
+
+  add(&own_shard()->latencies[op][histogram_bucket(ns)], 1);
+}
+
+void stats_record_lock_wait(uint64_t ns) {
+  struct StatsShard *shard = own_shard();
+  add(&shard->lock_holds, 1);
+  add(&shard->lock_wait_ns, ns);
+}
+
+void stats_record_lock_hold(uint64_t ns) {
+  struct StatsShard *shard = own_shard();
+  add(&shard->lock_held_ns, ns);
+  if (ns > atomic_load_explicit(&shard->lock_held_max_ns, memory_order_relaxed)) {
+    atomic_store_explicit(&shard->lock_held_max_ns, ns, memory_order_relaxed);
+  }
+}
+
+void stats_record_session(int delta) {
+  struct StatsShard *shard = own_shard();
+  atomic_store_explicit(&shard->sessions, atomic_load_explicit(&shard->sessions, memory_order_relaxed) + delta,
+                        memory_order_relaxed);
+}
+
+void stats_read(struct Stats *stats) {
+  *stats = (struct Stats){0};
+  int64_t sessions = 0;
+
+  for (struct StatsShard *shard = atomic_load(&shards); shard != NULL; shard = shard->next) {
+    stats->requests += atomic_load_explicit(&shard->requests, memory_order_relaxed);
+    stats->bytes_in += atomic_load_explicit(&shard->bytes_in, memory_order_relaxed);
+    stats->bytes_out += atomic_load_explicit(&shard->bytes_out, memory_order_relaxed);
+    stats->lock_holds += atomic_load_explicit(&shard->lock_holds, memory_order_relaxed);
+    stats->lock_wait_ns += atomic_load_explicit(&shard->lock_wait_ns, memory_order_relaxed);
+    stats->lock_held_ns += atomic_load_explicit(&shard->lock_held_ns, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&shard->lock_held_max_ns, memory_order_relaxed);
+    if (max > stats->lock_held_max_ns) stats->lock_held_max_ns = max;
+    sessions += atomic_load_explicit(&shard->sessions, memory_order_relaxed);
+
+    for (size_t op = 0; op < STATS_NUM_OPS; op++) {
+      for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        stats->latencies[op][bucket] += atomic_load_explicit(&shard->latencies[op][bucket], memory_order_relaxed);
+      }
+    }
+  }
+
+  // Counted on different shards, the difference may briefly be off while a session leaves
+  stats->sessions = sessions > 0 ? (uint64_t)sessions : 0;
+}
+
+int stats_put(buffer_t *resp, wire_encoding_t encoding) {
+  struct Stats *stats = malloc(sizeof(struct Stats));
+  if (stats == NULL) {
+    resp->failed = true;
+    return 1;
+  }
+  stats_read(stats);
+
+  buffer_put_uint(resp, encoding, 0, sizeof(int));
+  buffer_put_uint(resp, encoding, stats->requests, sizeof(uint64_t));
+  buffer_put_uint(resp, encoding, stats->bytes_in, sizeof(uint64_t));
+  buffer_put_uint(resp, encoding, stats->bytes_out, sizeof(uint64_t));
+  buffer_put_uint(resp, encoding, stats->lock_holds, sizeof(uint64_t));
+  buffer_put_uint(resp, encoding, stats->lock_wait_ns, sizeof(uint64_t));
+  buffer_put_uint(resp, encoding, stats->lock_held_ns, sizeof(uint64_t));
+  buffer_put_uint(resp, encoding, stats->lock_held_max_ns, sizeof(uint64_t));
+  buffer_put_uint(resp, encoding, stats->sessions, sizeof(uint64_t));
+
+  // Only the buckets counting requests are sent
+  for (size_t op = 0; op < STATS_NUM_OPS; op++) {
+    size_t used = 0;
+    for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+      if (stats->latencies[op][bucket] > 0) used++;
+    }
+
+    buffer_put_uint(resp, encoding, used, sizeof(size_t));
+    for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+      if (stats->latencies[op][bucket] == 0) continue;
+      buffer_put_uint(resp, encoding, bucket, sizeof(uint32_t));
+      buffer_put_uint(resp, encoding, stats->latencies[op][bucket], sizeof(uint64_t));
+    }
+  }
+
+  free(stats);
+  return resp->failed;
+}
@@ -0,0 +1,67 @@
+#ifndef SERVER_STATS_H
+#define SERVER_STATS_H
+
+// Server metrics: request latencies per operation, traffic, event lock times
+// and sessions. Every thread records in a shard of its own, so recording
+// never contends with other threads, and readers merge the shards.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/io.h"
+
+// Metrics merged over every shard
+struct Stats {
+  uint64_t requests;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t lock_holds;        // Times an event mutex was taken
+  uint64_t lock_wait_ns;      // Time spent waiting for the event mutexes, in total
+  uint64_t lock_held_ns;      // Time the event mutexes were held, in total
+  uint64_t lock_held_max_ns;  // Longest time an event mutex was held
+  uint64_t sessions;          // Sessions connected
+  uint64_t latencies[STATS_NUM_OPS][HISTOGRAM_BUCKETS];  // Requests per histogram bucket
+};
+
+/// Gets the time of a monotonic clock.
+/// @return Time in nanoseconds.
+uint64_t stats_now_ns(void);
+
+/// Counts a request read from a client.
+/// @param size Size of the message, header included.
+void stats_record_request(size_t size);
+
+/// Counts a message sent to a client.
+/// @param size Size of the message, header included.
+void stats_record_reply(size_t size);
+
+/// Adds the time a request took to the histogram of its operation.
+/// @param opcode Opcode of the request, requests without a histogram are ignored.
+/// @param ns Time from when the request was read until its reply was sent.
+void stats_record_latency(uint8_t opcode, uint64_t ns);
+
+/// Counts an event mutex being taken.
+/// @param ns Time spent waiting to take it.
+void stats_record_lock_wait(uint64_t ns);
+
+/// Adds the time an event mutex was held to the lock metrics.
+/// @param ns Time it was held.
+void stats_record_lock_hold(uint64_t ns);
+
+/// Counts a session connecting (delta 1) or leaving (delta -1).
+/// @param delta Change in the number of sessions.
+void stats_record_session(int delta);
+
+/// Merges the shards of every thread.
+/// @note Shards keep being written meanwhile, so the metrics are only consistent with each other once the
+/// server is idle.
+/// @param stats Metrics to be filled.
+void stats_read(struct Stats *stats);
+
+/// Appends the payload of the reply to an OP_CODE_STATS.
+/// @param resp Buffer to append to.
+/// @param encoding Encoding of the reply.
+/// @return 0 if the payload was appended, 1 otherwise.
+int stats_put(buffer_t *resp, wire_encoding_t encoding);
+
+#endif  // SERVER_STATS_H